@@ -92,10 +92,10 @@
 #define MIDI_PHASER_DEPTH           0x5F
 #define MIDI_DATA_INCREMENT         0x60
 #define MIDI_DATA_DECREMENT         0x61
-#define MIDI_NONREG_PARAM_NUM_MSB   0x62
-#define MIDI_NONREG_PARAM_NUM_LSB   0x63
-#define MIDI_REG_PARAM_NUM_MSB      0x64
-#define MIDI_REG_PARAM_NUM_LSB      0x65
+#define MIDI_NONREG_PARAM_NUM_LSB   0x62
+#define MIDI_NONREG_PARAM_NUM_MSB   0x63
+#define MIDI_REG_PARAM_NUM_LSB      0x64
+#define MIDI_REG_PARAM_NUM_MSB      0x65
 
 #define MIDI_ALL_SOUND_OFF          0x78
 #define MIDI_RESET_ALL_CONTROLLERS  0x79
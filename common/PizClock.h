@@ -0,0 +1,84 @@
+#ifndef PIZCLOCK_H
+#define PIZCLOCK_H
+
+#include <chrono>
+#include <cmath>
+
+//-------------------------------------------------------------------------------------------------------
+// monotonic time in seconds (arbitrary origin), safe to call from any thread
+
+inline double pizTimeNow()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+//-------------------------------------------------------------------------------------------------------
+// Delay-locked loop mapping the monotonic clock onto the host's sample timeline.
+// update() is called once at the start of every audio block. The callback time itself
+// jitters, the DLL filters it into a smooth estimate of when the block started and of
+// the real sample period, so that timestamps taken on other threads can be converted
+// into sample offsets relative to the current block (and vice versa).
+
+class PizClockDll
+{
+public:
+    PizClockDll(double bandwidth = 0.5) : bw(bandwidth) { reset(); }
+
+    void reset() { valid = false; }
+    bool isValid() const { return valid; }
+
+    void update(double now, int sampleFrames, double sampleRate)
+    {
+        if (valid && (lastFrames > 0) && (sampleRate == rate))
+        {
+            double predicted = tBlock + lastFrames * period;
+            double err = now - predicted;
+            if (fabs(err) < 0.1) // else host was suspended or stalled: re-sync
+            {
+                double omega = 2.0 * 3.14159265358979 * bw * (lastFrames * period);
+                tBlock = predicted + 1.4142135623731 * omega * err;
+                period += omega * omega * err / lastFrames;
+
+                // stay within +/-1% of the nominal rate
+                double nominal = 1.0 / sampleRate;
+                if (period > nominal * 1.01) period = nominal * 1.01;
+                if (period < nominal * 0.99) period = nominal * 0.99;
+
+                lastFrames = sampleFrames;
+                return;
+            }
+        }
+
+        rate = sampleRate;
+        period = 1.0 / sampleRate;
+        tBlock = now;
+        lastFrames = sampleFrames;
+        valid = true;
+    }
+
+    // samples from the start of the current block to time t (negative if t lies before)
+    double samplesFromBlockStart(double t) const
+    {
+        return (t - tBlock) / period;
+    }
+
+    // time at the given sample offset from the start of the current block
+    double timeAtSample(double offset) const
+    {
+        return tBlock + offset * period;
+    }
+
+    double blockStart() const { return tBlock; }
+    double samplePeriod() const { return period; }
+
+private:
+    double bw;     // loop bandwidth in Hz
+    bool   valid;
+    double rate;   // nominal sample rate
+    double tBlock; // filtered start time of the current block
+    double period; // filtered duration of one sample
+    int    lastFrames;
+};
+
+#endif
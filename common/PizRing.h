@@ -0,0 +1,87 @@
+#ifndef PIZRING_H
+#define PIZRING_H
+
+#include <atomic>
+
+//-------------------------------------------------------------------------------------------------------
+// Lock-free single producer / single consumer ring buffer.
+// One thread may only push, another thread may only pop. N must be a power of two.
+// Holds at most N-1 elements, push() fails when full (nothing is overwritten).
+
+template <typename T, unsigned N>
+class PizRing
+{
+public:
+    PizRing() : head(0), tail(0) {}
+
+    bool push(const T& v) // producer
+    {
+        unsigned h = head.load(std::memory_order_relaxed);
+        unsigned next = (h + 1) & (N - 1);
+        if (next == tail.load(std::memory_order_acquire))
+            return false; // full
+        buf[h] = v;
+        head.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool write(const T *v, unsigned n) // producer, all or nothing
+    {
+        unsigned h = head.load(std::memory_order_relaxed);
+        unsigned t = tail.load(std::memory_order_acquire);
+        if (n > ((t - h - 1) & (N - 1)))
+            return false; // no room
+        for (unsigned i = 0; i < n; i++)
+            buf[(h + i) & (N - 1)] = v[i];
+        head.store((h + n) & (N - 1), std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& v) // consumer
+    {
+        unsigned t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire))
+            return false; // empty
+        v = buf[t];
+        tail.store((t + 1) & (N - 1), std::memory_order_release);
+        return true;
+    }
+
+    bool discard() // consumer, drops the oldest element
+    {
+        unsigned t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire))
+            return false; // empty
+        tail.store((t + 1) & (N - 1), std::memory_order_release);
+        return true;
+    }
+
+    const T *peek() const // consumer, valid until next pop()
+    {
+        unsigned t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire))
+            return 0;
+        return &buf[t];
+    }
+
+    unsigned size() const // approximate when called concurrently
+    {
+        return (head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire)) & (N - 1);
+    }
+
+    bool empty() const { return size() == 0; }
+
+    void clear() // consumer
+    {
+        tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+private:
+    static_assert((N >= 2) && ((N & (N - 1)) == 0), "PizRing size must be a power of two");
+
+    T buf[N];
+    std::atomic<unsigned> head; // written by producer
+    std::atomic<unsigned> tail; // written by consumer
+};
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef PIZTEXTFILE_H
+#define PIZTEXTFILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <vector>
+
+//-------------------------------------------------------------------------------------------------------
+// Helpers for the plain text rule files (.map) of the plugins: one rule per line,
+// blank separated words, '#' starts a comment. Names are matched in upper case.
+
+// whole file as a zero terminated string, false if it can't be opened
+inline bool pizLoadText(const char *path, std::vector<char>& text)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return false;
+
+    text.clear();
+    char buf[1024];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0)
+        text.insert(text.end(), buf, buf + n);
+    fclose(file);
+    text.push_back(0);
+    return true;
+}
+
+// Lines of a text without their comments, as modifiable strings:
+//   PizTextLines lines(text);
+//   while (char *line = lines.next()) ...
+class PizTextLines
+{
+public:
+    PizTextLines(const char *text) : pos(text), number(0) {}
+
+    char *next() // 0 at the end
+    {
+        if (!*pos)
+            return 0;
+        const char *end = pos;
+        while (*end && (*end != '\n') && (*end != '\r') && (*end != '#'))
+            end++;
+        line.assign(pos, end);
+        line.push_back(0);
+        number++;
+
+        while (*end && (*end != '\n'))
+            end++;
+        pos = *end ? end + 1 : end;
+        return &line[0];
+    }
+
+    long getNumber() const { return number; } // of the last line, from 1
+
+private:
+    const char *pos;
+    long number;
+    std::vector<char> line;
+};
+
+// next blank separated word of the line (upper case), 0 at the end
+inline char *pizNextWord(char *&pos)
+{
+    while (*pos && isspace((unsigned char)*pos))
+        pos++;
+    if (!*pos)
+        return 0;
+    char *word = pos;
+    while (*pos && !isspace((unsigned char)*pos))
+    {
+        *pos = (char)toupper((unsigned char)*pos);
+        pos++;
+    }
+    if (*pos)
+        *pos++ = 0;
+    return word;
+}
+
+// decimal number within min..max
+inline bool pizParseNumber(const char *word, long min, long max, long& value)
+{
+    if (!word)
+        return false;
+    char *end;
+    value = strtol(word, &end, 10);
+    return !*end && (value >= min) && (value <= max);
+}
+
+// value of a name in a { name, value } table ending with a 0 name
+template <typename Name, typename Value>
+inline bool pizFindName(const Name *names, const char *name, Value& value)
+{
+    for (int i = 0; names[i].name; i++)
+    {
+        if (!strcmp(names[i].name, name))
+        {
+            value = names[i].value;
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
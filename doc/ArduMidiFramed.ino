@@ -0,0 +1,274 @@
+// -----------------------------------------------------------------------------
+// Arduino MIDI Framed Test by H.R.Graf
+//
+// Same as ArduMidiTest, but using the "Framed" protocol of pizmidi/midiUartBridge
+// instead of raw MIDI bytes, for Arduino Uno and similar boards (USB <-> UART).
+//
+// Received Note On/Off control built-in LED and are sent back on channel 2
+// with slight change in pitch (to demonstrate active functionality).
+//
+// Every packet is COBS encoded and terminated by a 0x00 byte:
+//
+//   [seq] [time0..time3] { [dt] [status] [data1] [data2] } [crc0] [crc1]
+//
+// - seq:  packet counter, lets the bridge detect lost packets
+// - time: micros() of the first message of the packet, lets the bridge re-time
+//         the messages independent of USB and driver latency
+// - dt:   time of a message after the packet time, in 100 us units
+// - crc:  CRC-16/CCITT of all preceding bytes, damaged packets are dropped
+//
+// Several messages share one packet: outgoing messages are collected for up
+// to FLUSH_US microseconds (or until the packet is full) before sending.
+// Latency probes of the bridge ([0xF4] [id]) are echoed right away.
+// The bridge may negotiate a faster baud rate ([0xF5] [cmd] [value], see
+// UartProtocol.h), without a valid packet for 1 s the sketch falls back.
+// No MIDI library needed.
+// -----------------------------------------------------------------------------
+
+#define BAUD_RATE 115200
+#define LED_BLINK LED_BUILTIN
+
+#define FRAME_HEADER 5
+#define FRAME_MAX    64  // decoded packet size, same as UART_FRAME_MAX of the bridge
+#define FLUSH_US     1000
+#define PROBE        0xF4 // same as UART_PROBE of the bridge
+#define CONTROL      0xF5 // same as UART_CONTROL of the bridge
+
+// uartRates of the bridge, those marked in RATES are exact on a 16 MHz AVR
+static const unsigned long rates[] = { 115200, 230400, 460800, 500000, 921600, 1000000, 2000000 };
+#define RATES 0x69 // 115200, 500000, 1000000, 2000000
+
+// -----------------------------------------------------------------------------
+
+static unsigned short crc16(const byte *buf, int len)
+{
+    unsigned short crc = 0xFFFF;
+    for (int i = 0; i < len; i++)
+    {
+        crc ^= (unsigned short)buf[i] << 8;
+        for (int b = 0; b < 8; b++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+    return crc;
+}
+
+static int midiLen(byte status)
+{
+    switch (status & 0xF0)
+    {
+    case 0x80: case 0x90: case 0xA0: case 0xB0: case 0xE0: return 3;
+    case 0xC0: case 0xD0: return 2;
+    }
+    if (status == PROBE)
+        return 2;
+    if (status == CONTROL)
+        return 3;
+    return 0; // not supported
+}
+
+// -----------------------------------------------------------------------------
+// transmit: collect messages, then send them as one packet
+
+static byte txPkt[FRAME_MAX];
+static int  txLen = 0;
+static byte txSeq = 0;
+static unsigned long txTime;
+
+void flushPacket()
+{
+    if (txLen == 0)
+        return;
+
+    txPkt[0] = txSeq++;
+    txPkt[1] = txTime;
+    txPkt[2] = txTime >> 8;
+    txPkt[3] = txTime >> 16;
+    txPkt[4] = txTime >> 24;
+    unsigned short crc = crc16(txPkt, txLen);
+    txPkt[txLen++] = crc;
+    txPkt[txLen++] = crc >> 8;
+
+    // COBS: each code byte gives the distance to the next zero
+    byte out[FRAME_MAX + 2];
+    int code = 0, n = 1;
+    out[code] = 1;
+    for (int i = 0; i < txLen; i++)
+    {
+        if (txPkt[i])
+        {
+            out[n++] = txPkt[i];
+            out[code]++;
+        }
+        else
+        {
+            code = n++;
+            out[code] = 1;
+        }
+    }
+    out[n++] = 0; // delimiter
+    Serial.write(out, n);
+
+    txLen = 0;
+}
+
+void sendMidi(byte status, byte data1, byte data2)
+{
+    int len = midiLen(status);
+    if (txLen && (txLen + 1 + len + 2 > FRAME_MAX))
+        flushPacket();
+
+    unsigned long now = micros();
+    if (txLen == 0)
+    {
+        txTime = now;
+        txLen = FRAME_HEADER;
+    }
+
+    unsigned long dt = (now - txTime) / 100;
+    txPkt[txLen++] = (dt > 255) ? 255 : dt;
+    txPkt[txLen++] = status;
+    if (len > 1) txPkt[txLen++] = data1 & 0x7F;
+    if (len > 2) txPkt[txLen++] = data2 & 0x7F;
+}
+
+// -----------------------------------------------------------------------------
+
+void handleNoteOn(byte channel, byte key, byte velocity)
+{
+    // Do whatever you want when a note is pressed.
+
+    digitalWrite(LED_BLINK, velocity ? HIGH : LOW);
+    sendMidi(0x90 | (2 - 1), key+1, velocity);
+}
+
+void handleNoteOff(byte channel, byte key, byte velocity)
+{
+    // Do something when the note is released.
+    // Note that NoteOn messages with 0 velocity are interpreted as NoteOffs.
+
+    digitalWrite(LED_BLINK, LOW);
+    sendMidi(0x80 | (2 - 1), key+1, velocity);
+}
+
+// -----------------------------------------------------------------------------
+// receive: decode COBS on the fly, check the packet, dispatch its messages
+
+static byte rxPkt[FRAME_MAX + 2];
+static int  rxLen = 0;
+static int  rxCode = 0;    // bytes left in the current COBS block
+static bool rxZero = false; // previous block ended with a zero byte
+static bool rxBad = false;
+static bool switched = false;    // running at a negotiated rate
+static unsigned long rxValid;    // millis() of the last valid packet
+
+void handleControl(byte cmd, byte value)
+{
+    if (cmd == 0) // query
+    {
+        sendMidi(CONTROL, 1, RATES);
+        flushPacket();
+    }
+    else if ((cmd == 2) && (value < 7) && (RATES & (1 << value))) // switch
+    {
+        sendMidi(CONTROL, 3, value); // acknowledge at the old rate
+        flushPacket();
+        Serial.flush();
+        Serial.begin(rates[value]);
+        switched = (value > 0);
+        rxValid = millis();
+    }
+}
+
+void handlePacket()
+{
+    if (rxBad || (rxLen < FRAME_HEADER + 2))
+        return;
+    int len = rxLen - 2;
+    if (crc16(rxPkt, len) != (rxPkt[len] | (rxPkt[len + 1] << 8)))
+        return; // damaged
+    rxValid = millis();
+
+    for (int i = FRAME_HEADER; i + 1 < len; )
+    {
+        byte status = rxPkt[i + 1];
+        int n = midiLen(status);
+        if ((n == 0) || (i + 1 + n > len))
+            break;
+
+        byte channel = (status & 0x0F) + 1;
+        byte data1 = (n > 1) ? rxPkt[i + 2] : 0;
+        byte data2 = (n > 2) ? rxPkt[i + 3] : 0;
+        if (status == PROBE) // echo immediately
+        {
+            sendMidi(PROBE, data1, 0);
+            flushPacket();
+        }
+        else if (status == CONTROL)
+            handleControl(data1, data2);
+        else if (((status & 0xF0) == 0x90) && data2)
+            handleNoteOn(channel, data1, data2);
+        else if (((status & 0xF0) == 0x80) || ((status & 0xF0) == 0x90))
+            handleNoteOff(channel, data1, data2);
+        i += 1 + n;
+    }
+}
+
+void readSerial()
+{
+    while (Serial.available())
+    {
+        byte c = Serial.read();
+        if (c == 0) // delimiter
+        {
+            handlePacket();
+            rxLen = rxCode = 0;
+            rxZero = rxBad = false;
+            continue;
+        }
+
+        if (rxLen >= (int)sizeof(rxPkt))
+        {
+            rxBad = true; // too long, dropped at the delimiter
+            continue;
+        }
+
+        if (rxCode == 0) // code byte
+        {
+            if (rxZero)
+                rxPkt[rxLen++] = 0;
+            rxCode = c - 1;
+            rxZero = (c < 0xFF);
+        }
+        else
+        {
+            rxPkt[rxLen++] = c;
+            rxCode--;
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+void setup()
+{
+    Serial.begin(BAUD_RATE);
+
+    pinMode(LED_BLINK, OUTPUT);
+    digitalWrite(LED_BLINK, LOW);
+}
+
+void loop()
+{
+    readSerial();
+
+    if (txLen && (micros() - txTime >= FLUSH_US))
+        flushPacket();
+
+    if (switched && (millis() - rxValid > 1000)) // bridge gave up on the new rate
+    {
+        Serial.begin(BAUD_RATE);
+        switched = false;
+    }
+}
+
+// -----------------------------------------------------------------------------
@@ -0,0 +1,515 @@
+/*-----------------------------------------------------------------------------
+JoyBench
+latency and throughput benchmark of the midiFromJoystick input path
+by H.R.Graf
+
+Drives the poller and the mapping the way the plug-in's audio thread does, block by
+block, while a generator thread moves a virtual pad: the left stick sweeps, the right
+trigger follows and button A toggles every 16th report. Two sources:
+
+  fake    the generator feeds evdev events straight into an in-memory backend, which
+          decodes them with the evdev decoder (no devices, no permissions needed)
+  uinput  the generator creates a virtual game pad through /dev/uinput, read back by the
+          evdev backend from /dev/input like a real pad (needs access to both)
+
+Reported per source, report rate and block size:
+
+  st/s     pad states delivered to the audio thread per second
+  msg/s    MIDI messages made of them by the default mapping
+  p50..max delay from the input event (its kernel time stamp for uinput) to the
+           audio block which picks it up, in ms (without the plug-in's latency setting)
+  dropped  states lost in the poller queue
+  lost     reports written, but not delivered
+
+The decoder alone is timed first, as events per second.
+
+Build (Linux, with the VST SDK on the include path like the plug-in):
+  g++ -O2 -std=c++14 -I<vstsdk2.4> JoyBench.cpp JoyInput.cpp JoyPoller.cpp JoyMapping.cpp JoyRecord.cpp -lpthread -o joybench
+Run:
+  ./joybench [seconds per run (0.5)] [fake|uinput]
+  ./joybench record <file.joyrec> [seconds (10)]         records the fake source at 1000 Hz
+  ./joybench replay <file.joyrec> [speed (0)] [mapping]  replays a recording, see replay()
+-----------------------------------------------------------------------------*/
+#include "JoyInput.h"
+#include "JoyMapping.h"
+#include "JoyRecord.h"
+#include "../common/PizClock.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cerrno>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#define BENCH_SAMPLE_RATE 48000.0
+#define BENCH_TOGGLE      16 // reports per toggle of button A
+
+//-------------------------------------------------------------------------------------------------------
+// In-memory backend: event batches handed over by the generator, decoded on read()
+
+class FakeInput : public JoyInput
+{
+public:
+    FakeInput() : woken(false) {}
+
+    void put(const struct input_event *ev, int n)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            events.insert(events.end(), ev, ev + n);
+        }
+        cond.notify_one();
+    }
+
+    virtual long read(unsigned mask, JoyChange *out, long max, double timeout)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (events.empty() && !woken)
+            cond.wait_for(lock, std::chrono::duration<double>(timeout));
+        woken = false;
+
+        long n = 0;
+        while (!events.empty() && (n < max))
+        {
+            struct input_event ev = events.front();
+            events.pop_front();
+            if (decoder.event(ev.type, ev.code, ev.value) && (mask & 1))
+            {
+                out[n].time = ev.input_event_sec + ev.input_event_usec * 1e-6;
+                out[n].pad = 0;
+                out[n].state = decoder.getState();
+                n++;
+            }
+        }
+        return n;
+    }
+
+    virtual bool isPolled() const { return false; }
+    virtual unsigned connected() const { return 1; }
+    virtual void wake()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            woken = true;
+        }
+        cond.notify_one();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<struct input_event> events;
+    bool woken;
+    JoyEvdevDecoder decoder;
+};
+
+//-------------------------------------------------------------------------------------------------------
+// Virtual game pad through uinput, as xpad reports an Xbox 360 pad
+
+static int createPad()
+{
+    int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+    if (fd < 0)
+        return -1;
+
+    static const int keys[] = { BTN_A, BTN_B, BTN_X, BTN_Y, BTN_TL, BTN_TR, BTN_SELECT, BTN_START, BTN_MODE, BTN_THUMBL, BTN_THUMBR };
+    ioctl(fd, UI_SET_EVBIT, EV_KEY);
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+        ioctl(fd, UI_SET_KEYBIT, keys[i]);
+
+    static const int axes[] = { ABS_X, ABS_Y, ABS_RX, ABS_RY, ABS_Z, ABS_RZ, ABS_HAT0X, ABS_HAT0Y };
+    ioctl(fd, UI_SET_EVBIT, EV_ABS);
+    for (size_t i = 0; i < sizeof(axes) / sizeof(axes[0]); i++)
+    {
+        struct uinput_abs_setup abs;
+        memset(&abs, 0, sizeof(abs));
+        abs.code = axes[i];
+        abs.absinfo.minimum = (i < 4) ? -32768 : ((i < 6) ? 0 : -1);
+        abs.absinfo.maximum = (i < 4) ? 32767 : ((i < 6) ? 255 : 1);
+        ioctl(fd, UI_SET_ABSBIT, axes[i]);
+        ioctl(fd, UI_ABS_SETUP, &abs);
+    }
+
+    struct uinput_setup setup;
+    memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_USB;
+    setup.id.vendor = 0x045e;
+    setup.id.product = 0x028e;
+    strcpy(setup.name, "JoyBench virtual pad");
+    if ((ioctl(fd, UI_DEV_SETUP, &setup) < 0) || (ioctl(fd, UI_DEV_CREATE) < 0))
+    {
+        close(fd);
+        return -1;
+    }
+    usleep(500000); // for the device node to appear
+    return fd;
+}
+
+static void destroyPad(int fd)
+{
+    ioctl(fd, UI_DEV_DESTROY);
+    close(fd);
+}
+
+//-------------------------------------------------------------------------------------------------------
+// One report of the virtual pad, different from the one before
+
+static int makeReport(long k, struct input_event *ev)
+{
+    double now = pizTimeNow();
+    struct input_event e;
+    memset(&e, 0, sizeof(e));
+    e.input_event_sec = (long)now;
+    e.input_event_usec = (long)((now - floor(now)) * 1e6);
+
+    int n = 0;
+    long phase = (k * 256) % 131072; // triangle, a new value every report
+    long x = (phase < 65536) ? phase - 32768 : 98303 - phase;
+    e.type = EV_ABS; e.code = ABS_X;  e.value = x;                  ev[n++] = e;
+    e.type = EV_ABS; e.code = ABS_RZ; e.value = (x + 32768) >> 8;    ev[n++] = e;
+    if (k % BENCH_TOGGLE == 0)
+    {
+        e.type = EV_KEY; e.code = BTN_A; e.value = (k / BENCH_TOGGLE) & 1; ev[n++] = e;
+    }
+    e.type = EV_SYN; e.code = SYN_REPORT; e.value = 0;                ev[n++] = e;
+    return n;
+}
+
+struct Result
+{
+    std::vector<double> delays; // s
+    long states;
+    long msgs;
+    long reports;
+    long dropped;
+};
+
+// sends reports at rate until stop, returns their number (the last one waits for the others)
+static long generate(FakeInput *fake, int ufd, long rate, std::atomic<bool>& stop)
+{
+    struct input_event ev[8];
+    double next = pizTimeNow();
+    long k = 1;
+    while (!stop)
+    {
+        int n = makeReport(k, ev);
+        if (fake)
+            fake->put(ev, n);
+        else if (write(ufd, ev, n * sizeof(struct input_event)) < 0)
+            break;
+        k++;
+
+        next += 1.0 / rate;
+        double wait = next - pizTimeNow();
+        if (wait > 0)
+            usleep((useconds_t)(wait * 1e6));
+    }
+    return k - 1;
+}
+
+//-------------------------------------------------------------------------------------------------------
+
+static double percentile(std::vector<double>& v, double p)
+{
+    if (v.empty())
+        return 0;
+    size_t i = std::min(v.size() - 1, (size_t)(p * v.size()));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+static bool runOnce(bool uinput, long rate, long block, double seconds, const char *recordTo = 0)
+{
+    int ufd = -1;
+    FakeInput *fake = 0;
+    if (uinput)
+    {
+        ufd = createPad();
+        if (ufd < 0)
+        {
+            printf("uinput: cannot create a virtual pad (%s)\n", strerror(errno));
+            return false;
+        }
+    }
+    else
+        fake = new FakeInput();
+
+    JoyPoller poller(fake); // evdev backend for uinput
+    JoyMapping mapping;
+    JoyMapState last;
+    if (recordTo)
+        poller.setRecordFile(recordTo, false);
+    poller.start();
+
+    // wait for the virtual pad, then skip its initial state
+    double until = pizTimeNow() + 3.0;
+    while (uinput && !(poller.getConnected() & 1) && (pizTimeNow() < until))
+        usleep(10000);
+    if (uinput && !(poller.getConnected() & 1))
+    {
+        printf("uinput: virtual pad not found in /dev/input\n");
+        poller.stop();
+        if (ufd >= 0)
+            destroyPad(ufd);
+        return false;
+    }
+    usleep(10000);
+    JoyChange ch;
+    while (poller.changes.pop(ch))
+        ;
+    if (recordTo)
+        poller.record(true);
+    while (recordTo && (poller.getRecordState() == JoyPoller::kRecordOff)) // opened by the poller thread
+        usleep(1000);
+    if (poller.getRecordState() == JoyPoller::kRecordFailed)
+    {
+        printf("cannot write %s\n", recordTo);
+        return false;
+    }
+
+    std::atomic<bool> stop(false);
+    long reports = 0;
+    std::thread gen([&] { reports = generate(fake, ufd, rate, stop); });
+
+    Result res;
+    res.states = res.msgs = 0;
+    JoyMidiMsg msgs[JOY_MAX_MSGS];
+    double blockTime = block / BENCH_SAMPLE_RATE;
+    double start = pizTimeNow();
+    double elapsed = seconds;
+    double next = start;
+    bool draining = false;
+    double end = start + seconds;
+    while (true)
+    {
+        next += blockTime;
+        double wait = next - pizTimeNow();
+        if (wait > 0)
+            usleep((useconds_t)(wait * 1e6));
+
+        double now = pizTimeNow();
+        while (poller.changes.pop(ch))
+        {
+            res.delays.push_back(now - ch.time);
+            res.msgs += mapping.process(ch.state, last, 1, ch.time, msgs);
+            res.states++;
+        }
+
+        if (!draining && (now >= end))
+        {
+            stop = true;
+            gen.join();
+            elapsed = pizTimeNow() - start;
+            draining = true;
+            end = now + 0.1;
+        }
+        else if (draining && (now >= end))
+            break;
+    }
+    res.dropped = poller.dropped;
+    poller.stop();
+    if (ufd >= 0)
+        destroyPad(ufd);
+
+    long lost = reports - res.states - res.dropped;
+    printf("%-7s %6ld %6ld %9.0f %9.0f %7.3f %7.3f %7.3f %7.3f %7ld %7ld\n",
+           uinput ? "uinput" : "fake", rate, block, res.states / elapsed, res.msgs / elapsed,
+           percentile(res.delays, 0.5) * 1000.0, percentile(res.delays, 0.9) * 1000.0,
+           percentile(res.delays, 0.99) * 1000.0, percentile(res.delays, 1.0) * 1000.0,
+           res.dropped, std::max(lost, 0L));
+    return true;
+}
+
+//-------------------------------------------------------------------------------------------------------
+// Replays a recording through the mapping. Speed 0 runs headless, as fast as possible, on
+// the recorded time stamps; the checksum covers every MIDI message with its time, so two
+// runs (or two versions of the mapping) can be compared. Otherwise the recording is
+// replayed through the poller to an emulated audio thread, at the given speed.
+
+static unsigned long fnv(unsigned long h, const unsigned char *p, size_t n)
+{
+    while (n--)
+        h = (h ^ *p++) * 16777619ul;
+    return h & 0xFFFFFFFFul;
+}
+
+static unsigned long hashMsgs(unsigned long h, const JoyMidiMsg *msgs, long n, double time)
+{
+    long us = (long)(time * 1e6 + 0.5);
+    for (long i = 0; i < n; i++)
+    {
+        h = fnv(h, (const unsigned char *)&us, sizeof(us));
+        h = fnv(h, msgs[i].data, 3);
+    }
+    return h;
+}
+
+static bool replay(const char *path, double speed, const char *mapPath)
+{
+    JoyReplayInput *input = new JoyReplayInput(speed);
+    if (!input->open(path))
+    {
+        printf("cannot read %s\n", path);
+        delete input;
+        return false;
+    }
+    JoyMapping mapping;
+    if (mapPath && !mapping.load(mapPath))
+    {
+        printf("cannot read %s\n", mapPath);
+        delete input;
+        return false;
+    }
+
+    JoyMapState last[JOY_MAX_PADS];
+    JoyMidiMsg msgs[JOY_MAX_MSGS];
+    JoyChange buf[256];
+    long states = 0, msgCount = 0;
+    unsigned long hash = 2166136261ul;
+    double first = 0, lastTime = 0;
+    double start = pizTimeNow();
+
+    if (speed <= 0)
+    {
+        long n;
+        while ((n = input->read((1u << JOY_MAX_PADS) - 1, buf, 256, 0)) || !input->finished())
+        {
+            for (long i = 0; i < n; i++)
+            {
+                const JoyChange& ch = buf[i];
+                double due;
+                while ((due = mapping.nextDue(last[ch.pad])) <= ch.time)
+                {
+                    long m = mapping.flush(last[ch.pad], due, 1, msgs);
+                    hash = hashMsgs(hash, msgs, m, due - start);
+                    msgCount += m;
+                }
+                long m = mapping.process(ch.state, last[ch.pad], 1, ch.time, msgs);
+                hash = hashMsgs(hash, msgs, m, ch.time - start);
+                msgCount += m;
+                if (!states++)
+                    first = ch.time;
+                lastTime = ch.time;
+            }
+        }
+        for (int pad = 0; pad < JOY_MAX_PADS; pad++)
+        {
+            double due;
+            while ((due = mapping.nextDue(last[pad])) < 1e30)
+            {
+                long m = mapping.flush(last[pad], due, 1, msgs);
+                hash = hashMsgs(hash, msgs, m, due - start);
+                msgCount += m;
+            }
+        }
+        delete input;
+
+        double wall = pizTimeNow() - start;
+        double span = lastTime - first;
+        printf("replay: %ld states over %.1f s, %ld MIDI messages, checksum %08lx\n", states, span, msgCount, hash);
+        printf("        %.3f s, %.0f states/s, %.0f x real time\n", wall, states / wall, span / wall);
+        return true;
+    }
+
+    JoyPoller poller(input);
+    poller.setPads((1u << JOY_MAX_PADS) - 1);
+    poller.start();
+
+    std::vector<double> delays;
+    double blockTime = 256 / BENCH_SAMPLE_RATE;
+    double next = start;
+    JoyChange ch;
+    while (!input->finished() || !poller.changes.empty())
+    {
+        next += blockTime;
+        double wait = next - pizTimeNow();
+        if (wait > 0)
+            usleep((useconds_t)(wait * 1e6));
+
+        double now = pizTimeNow();
+        while (poller.changes.pop(ch))
+        {
+            delays.push_back(now - ch.time);
+            msgCount += mapping.process(ch.state, last[ch.pad], 1, ch.time, msgs);
+            states++;
+        }
+    }
+    long dropped = poller.dropped;
+    poller.stop();
+
+    double wall = pizTimeNow() - start;
+    printf("replay: %ld states, %ld MIDI messages, %.3f s at speed %g, %ld dropped\n", states, msgCount, wall, speed, dropped);
+    printf("        delay p50 %.3f p90 %.3f p99 %.3f max %.3f ms (block of 256)\n",
+           percentile(delays, 0.5) * 1000.0, percentile(delays, 0.9) * 1000.0,
+           percentile(delays, 0.99) * 1000.0, percentile(delays, 1.0) * 1000.0);
+    return true;
+}
+
+// the decoder alone, on a stream of prepared reports
+static void decodeSpeed()
+{
+    std::vector<struct input_event> ev;
+    struct input_event buf[8];
+    for (long k = 1; k <= 4096; k++)
+    {
+        int n = makeReport(k, buf);
+        ev.insert(ev.end(), buf, buf + n);
+    }
+
+    JoyEvdevDecoder decoder;
+    long states = 0, events = 0;
+    double start = pizTimeNow();
+    for (int r = 0; r < 500; r++)
+    {
+        for (size_t i = 0; i < ev.size(); i++)
+            states += decoder.event(ev[i].type, ev[i].code, ev[i].value);
+        events += (long)ev.size();
+    }
+    double t = pizTimeNow() - start;
+    printf("decoder: %.1f M events/s, %.1f M states/s\n\n", events / t * 1e-6, states / t * 1e-6);
+}
+
+int main(int argc, char **argv)
+{
+    if ((argc > 2) && !strcmp(argv[1], "record"))
+    {
+        double seconds = (argc > 3) ? atof(argv[3]) : 10.0;
+        printf("%-7s %6s %6s %9s %9s %7s %7s %7s %7s %7s %7s\n",
+               "source", "rate", "block", "st/s", "msg/s", "p50", "p90", "p99", "max", "dropped", "lost");
+        return runOnce(false, 1000, 256, seconds, argv[2]) ? 0 : 1;
+    }
+    if ((argc > 2) && !strcmp(argv[1], "replay"))
+        return replay(argv[2], (argc > 3) ? atof(argv[3]) : 0.0, (argc > 4) ? argv[4] : 0) ? 0 : 1;
+
+    double seconds = (argc > 1) ? atof(argv[1]) : 0.5;
+    const char *only = (argc > 2) ? argv[2] : 0;
+
+    static const long rates[] = { 125, 1000, 8000 };
+    static const long blocks[] = { 64, 1024 };
+
+    decodeSpeed();
+    printf("%-7s %6s %6s %9s %9s %7s %7s %7s %7s %7s %7s\n",
+           "source", "rate", "block", "st/s", "msg/s", "p50", "p90", "p99", "max", "dropped", "lost");
+    for (int u = 0; u < 2; u++)
+    {
+        if (only && strcmp(only, u ? "uinput" : "fake"))
+            continue;
+        if (u && !only && access("/dev/uinput", W_OK))
+        {
+            printf("uinput: /dev/uinput not available, skipped\n");
+            continue;
+        }
+        for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++)
+            for (size_t b = 0; b < sizeof(blocks) / sizeof(blocks[0]); b++)
+                if (!runOnce(u != 0, rates[r], blocks[b], seconds))
+                    return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,578 @@
+/*-----------------------------------------------------------------------------
+JoyInput
+game pad input backends for midiFromJoystick (XInput, Linux evdev)
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#include "JoyInput.h"
+#include "../common/PizClock.h"
+#include "../common/pizvstbase.h" // dbg
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+
+#ifdef _WIN32
+//=======================================================================================================
+// Win32: XInput, polled
+
+#include <XInput.h>
+
+#pragma comment(lib, "Xinput.lib")
+
+class XInputInput : public JoyInput
+{
+public:
+    XInputInput();
+
+    virtual long read(unsigned mask, JoyChange *out, long max, double timeout);
+    virtual bool isPolled() const { return true; }
+    virtual unsigned connected() const { return found; }
+    virtual void wake() {}
+
+private:
+    DWORD pktNum[JOY_MAX_PADS];
+    JoyState last[JOY_MAX_PADS];
+    double retry[JOY_MAX_PADS]; // next query of a missing pad
+    unsigned found;
+};
+
+XInputInput::XInputInput()
+    : found(0)
+{
+    for (int p = 0; p < JOY_MAX_PADS; p++)
+        retry[p] = 0;
+}
+
+//-------------------------------------------------------------------------------------------------------
+// The packet number of XInput changes with every new state, so an idle pad costs one
+// driver call per poll and nothing else.
+
+long XInputInput::read(unsigned mask, JoyChange *out, long max, double timeout)
+{
+    long n = 0;
+    double now = pizTimeNow();
+
+    for (int p = 0; (p < JOY_MAX_PADS) && (n < max); p++)
+    {
+        unsigned bit = 1u << p;
+        if (!(mask & bit))
+        {
+            found &= ~bit; // queried again when selected
+            retry[p] = 0;
+            continue;
+        }
+        if (!(found & bit) && (now < retry[p]))
+            continue;
+
+        XINPUT_STATE xs;
+        ZeroMemory(&xs, sizeof(XINPUT_STATE));
+        if (XInputGetState(p, &xs) != ERROR_SUCCESS)
+        {
+            dbg("XInput Joystick " << (p+1) << " not found");
+            found &= ~bit;
+            retry[p] = pizTimeNow() + JOY_RETRY_TIME;
+            continue;
+        }
+
+        if (!(found & bit) || (xs.dwPacketNumber != pktNum[p])) // changed
+        {
+            JoyChange& ch = out[n];
+            ch.time = pizTimeNow();
+            ch.pad = (unsigned char)p;
+            ch.state.buttons = xs.Gamepad.wButtons;
+            ch.state.leftTrigger = xs.Gamepad.bLeftTrigger;
+            ch.state.rightTrigger = xs.Gamepad.bRightTrigger;
+            ch.state.thumbLX = xs.Gamepad.sThumbLX;
+            ch.state.thumbLY = xs.Gamepad.sThumbLY;
+            ch.state.thumbRX = xs.Gamepad.sThumbRX;
+            ch.state.thumbRY = xs.Gamepad.sThumbRY;
+
+            if (!(found & bit) || memcmp(&ch.state, &last[p], sizeof(JoyState)))
+            {
+                last[p] = ch.state;
+                n++;
+            }
+            pktNum[p] = xs.dwPacketNumber;
+            found |= bit;
+        }
+    }
+    return n;
+}
+
+JoyInput *JoyInput::create()
+{
+    return new XInputInput();
+}
+
+#else
+//=======================================================================================================
+// Linux: evdev, event driven (epoll)
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <linux/input.h>
+#include <string>
+#include <vector>
+
+#ifndef input_event_sec // kernel headers before 4.16
+#define input_event_sec  time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
+//-------------------------------------------------------------------------------------------------------
+// evdev codes of a game pad (kernel gamepad layout, as xpad) -> XInput layout
+
+static unsigned short buttonBit(unsigned short code)
+{
+    switch (code)
+    {
+    case BTN_A:          return JOY_A;
+    case BTN_B:          return JOY_B;
+    case BTN_X:          return JOY_X;
+    case BTN_Y:          return JOY_Y;
+    case BTN_TL:         return JOY_LEFT_SHOULDER;
+    case BTN_TR:         return JOY_RIGHT_SHOULDER;
+    case BTN_SELECT:     return JOY_BACK;
+    case BTN_START:      return JOY_START;
+    case BTN_THUMBL:     return JOY_LEFT_THUMB;
+    case BTN_THUMBR:     return JOY_RIGHT_THUMB;
+    case BTN_DPAD_UP:    return JOY_DPAD_UP; // some pads report the d-pad as buttons
+    case BTN_DPAD_DOWN:  return JOY_DPAD_DOWN;
+    case BTN_DPAD_LEFT:  return JOY_DPAD_LEFT;
+    case BTN_DPAD_RIGHT: return JOY_DPAD_RIGHT;
+    }
+    return 0;
+}
+
+JoyEvdevDecoder::JoyEvdevDecoder()
+{
+    for (int i = 0; i < JOY_EVDEV_ABS; i++)
+        setAbsRange(i, -32768, 32767);
+    setAbsRange(ABS_Z, 0, 255);
+    setAbsRange(ABS_RZ, 0, 255);
+    setAbsRange(ABS_GAS, 0, 255);
+    setAbsRange(ABS_BRAKE, 0, 255);
+    setAbsRange(ABS_HAT0X, -1, 1);
+    setAbsRange(ABS_HAT0Y, -1, 1);
+    reset();
+}
+
+void JoyEvdevDecoder::reset()
+{
+    memset(&state, 0, sizeof(JoyState));
+    pending = state;
+    dropping = false;
+}
+
+void JoyEvdevDecoder::setAbsRange(int code, long min, long max)
+{
+    if ((code < 0) || (code >= JOY_EVDEV_ABS))
+        return;
+    absMin[code] = min;
+    absMax[code] = (max > min) ? max : min + 1;
+}
+
+// -32768..32767, centered
+short JoyEvdevDecoder::stick(int code, long value, bool invert) const
+{
+    long min = absMin[code], max = absMax[code];
+    value = std::max(min, std::min(max, value));
+    long v = (long)(((long long)(value - min) * 65535 + (max - min) / 2) / (max - min)) - 32768;
+    return (short)(invert ? (-1 - v) : v);
+}
+
+// 0..255
+unsigned char JoyEvdevDecoder::trigger(int code, long value) const
+{
+    long min = absMin[code], max = absMax[code];
+    value = std::max(min, std::min(max, value));
+    return (unsigned char)(((long long)(value - min) * 255 + (max - min) / 2) / (max - min));
+}
+
+//-------------------------------------------------------------------------------------------------------
+// The kernel sends the changes of one report as single events, closed by SYN_REPORT.
+// They are collected in pending and only become the state with the report, so a stick moved
+// diagonally gives one new state, not two. After SYN_DROPPED the kernel buffer overflowed:
+// everything up to the next report is ignored and the owner reads the full state again.
+
+bool JoyEvdevDecoder::event(unsigned short type, unsigned short code, long value)
+{
+    if (type == EV_SYN)
+    {
+        if (code == SYN_DROPPED)
+            dropping = true;
+        else if (code == SYN_REPORT)
+        {
+            if (dropping)
+            {
+                dropping = false;
+                return false;
+            }
+            if (memcmp(&pending, &state, sizeof(JoyState)))
+            {
+                state = pending;
+                return true;
+            }
+        }
+        return false;
+    }
+    if (dropping)
+        return false;
+
+    if (type == EV_KEY)
+    {
+        unsigned short bit = buttonBit(code);
+        if (value)
+            pending.buttons |= bit;
+        else
+            pending.buttons &= ~bit;
+    }
+    else if ((type == EV_ABS) && (code < JOY_EVDEV_ABS))
+    {
+        switch (code)
+        {
+        case ABS_X:  pending.thumbLX = stick(code, value, false); break;
+        case ABS_Y:  pending.thumbLY = stick(code, value, true); break; // evdev: down is positive
+        case ABS_RX: pending.thumbRX = stick(code, value, false); break;
+        case ABS_RY: pending.thumbRY = stick(code, value, true); break;
+        case ABS_Z:
+        case ABS_BRAKE:
+            pending.leftTrigger = trigger(code, value);
+            break;
+        case ABS_RZ:
+        case ABS_GAS:
+            pending.rightTrigger = trigger(code, value);
+            break;
+        case ABS_HAT0X:
+            pending.buttons &= ~(JOY_DPAD_LEFT | JOY_DPAD_RIGHT);
+            if (value < 0)
+                pending.buttons |= JOY_DPAD_LEFT;
+            else if (value > 0)
+                pending.buttons |= JOY_DPAD_RIGHT;
+            break;
+        case ABS_HAT0Y:
+            pending.buttons &= ~(JOY_DPAD_UP | JOY_DPAD_DOWN);
+            if (value < 0)
+                pending.buttons |= JOY_DPAD_UP;
+            else if (value > 0)
+                pending.buttons |= JOY_DPAD_DOWN;
+            break;
+        }
+    }
+    return false;
+}
+
+//-------------------------------------------------------------------------------------------------------
+
+static void wakeFd(int fd)
+{
+    uint64_t one = 1;
+    if (::write(fd, &one, sizeof(one)) < 0)
+        dbg("Failed to wake");
+}
+
+static void clearFd(int fd)
+{
+    uint64_t cnt;
+    while (::read(fd, &cnt, sizeof(cnt)) > 0)
+        ;
+}
+
+#define EVDEV_BITS(n) (((n) + 7) / 8)
+
+static bool testBit(const unsigned char *bits, int n)
+{
+    return (bits[n / 8] >> (n % 8)) & 1;
+}
+
+//-------------------------------------------------------------------------------------------------------
+// Game pads take the free pad numbers in the order they are found (event nodes sorted by
+// number) and keep them until they are unplugged. The nodes are scanned again every
+// JOY_RETRY_TIME seconds while a pad number is free.
+
+class EvdevInput : public JoyInput
+{
+public:
+    EvdevInput();
+    ~EvdevInput();
+
+    virtual long read(unsigned mask, JoyChange *out, long max, double timeout);
+    virtual bool isPolled() const { return false; }
+    virtual unsigned connected() const { return found; }
+    virtual void wake() { wakeFd(evfd); }
+
+private:
+    struct Pad
+    {
+        Pad() : fd(-1), pos(0), len(0) {}
+
+        int fd;
+        std::string path;
+        JoyEvdevDecoder decoder;
+        struct input_event buf[64]; // read from the kernel, not decoded yet
+        long pos, len;
+    };
+
+    void scan();
+    bool open(int p, const std::string& path);
+    void close(int p);
+    void sync(int p);
+    long decode(int p, unsigned mask, JoyChange *out, long max);
+
+    int ep;   // epoll instance
+    int evfd; // eventfd for wake()
+    Pad pads[JOY_MAX_PADS];
+    unsigned found;    // pads with a device
+    unsigned reported; // pads whose state was reported since they were selected
+    double nextScan;
+};
+
+EvdevInput::EvdevInput()
+    : found(0), reported(0), nextScan(0)
+{
+    ep = epoll_create1(EPOLL_CLOEXEC);
+    evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = JOY_MAX_PADS; // wake
+    epoll_ctl(ep, EPOLL_CTL_ADD, evfd, &ev);
+}
+
+EvdevInput::~EvdevInput()
+{
+    for (int p = 0; p < JOY_MAX_PADS; p++)
+        close(p);
+    ::close(evfd);
+    ::close(ep);
+}
+
+void EvdevInput::scan()
+{
+    std::vector<std::string> nodes;
+    DIR *dir = opendir("/dev/input");
+    if (dir)
+    {
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != 0)
+        {
+            if (!strncmp(ent->d_name, "event", 5))
+                nodes.push_back(ent->d_name);
+        }
+        closedir(dir);
+    }
+    std::sort(nodes.begin(), nodes.end(), [](const std::string& a, const std::string& b)
+        { return atol(a.c_str() + 5) < atol(b.c_str() + 5); });
+
+    for (size_t i = 0; (i < nodes.size()) && (found != (1u << JOY_MAX_PADS) - 1); i++)
+    {
+        std::string path = "/dev/input/" + nodes[i];
+        bool open_ = false;
+        int free = -1;
+        for (int p = 0; p < JOY_MAX_PADS; p++)
+        {
+            if (pads[p].fd >= 0)
+                open_ |= (pads[p].path == path);
+            else if (free < 0)
+                free = p;
+        }
+        if (!open_ && (free >= 0))
+            open(free, path);
+    }
+}
+
+bool EvdevInput::open(int p, const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return false; // no permission, or not a device
+
+    // a game pad has the gamepad buttons and at least one stick
+    unsigned char keys[EVDEV_BITS(KEY_CNT)], abs[EVDEV_BITS(ABS_CNT)];
+    memset(keys, 0, sizeof(keys));
+    memset(abs, 0, sizeof(abs));
+    if ((ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) < 0)
+        || (ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(abs)), abs) < 0)
+        || !testBit(keys, BTN_GAMEPAD) || !testBit(abs, ABS_X))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    // event times on the clock of pizTimeNow() (steady_clock is CLOCK_MONOTONIC)
+    int clk = CLOCK_MONOTONIC;
+    if (ioctl(fd, EVIOCSCLOCKID, &clk) < 0)
+        dbg("Joystick " << path << ": no monotonic time stamps");
+
+    Pad& pad = pads[p];
+    pad.fd = fd;
+    pad.path = path;
+    pad.pos = pad.len = 0;
+    pad.decoder.reset();
+    for (int code = 0; code < JOY_EVDEV_ABS; code++)
+    {
+        struct input_absinfo info;
+        if (testBit(abs, code) && (ioctl(fd, EVIOCGABS(code), &info) == 0))
+            pad.decoder.setAbsRange(code, info.minimum, info.maximum);
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = p;
+    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+
+    sync(p);
+    found |= 1u << p;
+    reported &= ~(1u << p);
+    dbg("Joystick " << (p+1) << ": " << path);
+    return true;
+}
+
+void EvdevInput::close(int p)
+{
+    Pad& pad = pads[p];
+    if (pad.fd < 0)
+        return;
+    epoll_ctl(ep, EPOLL_CTL_DEL, pad.fd, 0);
+    ::close(pad.fd);
+    pad.fd = -1;
+    pad.path.clear();
+    found &= ~(1u << p);
+    reported &= ~(1u << p);
+}
+
+// reads the full state from the device, after opening and after SYN_DROPPED
+void EvdevInput::sync(int p)
+{
+    Pad& pad = pads[p];
+    pad.decoder.event(EV_SYN, SYN_REPORT, 0); // ends SYN_DROPPED
+
+    unsigned char keys[EVDEV_BITS(KEY_CNT)];
+    memset(keys, 0, sizeof(keys));
+    ioctl(pad.fd, EVIOCGKEY(sizeof(keys)), keys);
+    for (int code = BTN_MISC; code < BTN_TRIGGER_HAPPY; code++)
+        pad.decoder.event(EV_KEY, code, testBit(keys, code));
+
+    for (int code = 0; code < JOY_EVDEV_ABS; code++)
+    {
+        struct input_absinfo info;
+        if (ioctl(pad.fd, EVIOCGABS(code), &info) == 0)
+            pad.decoder.event(EV_ABS, code, info.value);
+    }
+    pad.decoder.event(EV_SYN, SYN_REPORT, 0);
+}
+
+// the buffered events of a pad, one change per report that changed its state
+long EvdevInput::decode(int p, unsigned mask, JoyChange *out, long max)
+{
+    Pad& pad = pads[p];
+    long n = 0;
+    while ((pad.pos < pad.len) && (n < max))
+    {
+        const struct input_event& ev = pad.buf[pad.pos++];
+        bool dropped = (ev.type == EV_SYN) && (ev.code == SYN_DROPPED);
+        if (pad.decoder.event(ev.type, ev.code, ev.value) && (mask & (1u << p)))
+        {
+            out[n].time = ev.input_event_sec + ev.input_event_usec * 1e-6;
+            out[n].pad = (unsigned char)p;
+            out[n].state = pad.decoder.getState();
+            n++;
+        }
+        if (dropped)
+        {
+            // the events still in the kernel buffer are stale as well
+            struct input_event skip[64];
+            while (::read(pad.fd, skip, sizeof(skip)) > 0)
+                ;
+            pad.pos = pad.len = 0;
+            sync(p);
+            reported &= ~(1u << p); // report the state read
+        }
+    }
+    return n;
+}
+
+long EvdevInput::read(unsigned mask, JoyChange *out, long max, double timeout)
+{
+    long n = 0;
+    double now = pizTimeNow();
+    if ((found != (1u << JOY_MAX_PADS) - 1) && (now >= nextScan))
+    {
+        scan();
+        nextScan = now + JOY_RETRY_TIME;
+    }
+
+    // leftovers of the last call, and the current state of newly selected pads
+    reported &= mask;
+    bool pending = false;
+    for (int p = 0; p < JOY_MAX_PADS; p++)
+    {
+        unsigned bit = 1u << p;
+        if (n < max)
+            n += decode(p, mask, out + n, max - n);
+        if ((found & mask & bit) && !(reported & bit) && (n < max))
+        {
+            out[n].time = now;
+            out[n].pad = (unsigned char)p;
+            out[n].state = pads[p].decoder.getState();
+            reported |= bit;
+            n++;
+        }
+        pending |= (pads[p].pos < pads[p].len);
+    }
+    if (n || pending)
+        return n;
+
+    // wait for input, for a wake() or for the next scan
+    double until = now + std::max(timeout, 0.0);
+    if (found != (1u << JOY_MAX_PADS) - 1)
+        until = std::min(until, nextScan);
+    int ms = (int)ceil(std::max(until - now, 0.0) * 1000.0);
+
+    struct epoll_event evs[JOY_MAX_PADS + 1];
+    int cnt = epoll_wait(ep, evs, JOY_MAX_PADS + 1, ms);
+    for (int i = 0; i < cnt; i++)
+    {
+        int p = evs[i].data.u32;
+        if (p == JOY_MAX_PADS)
+        {
+            clearFd(evfd);
+            continue;
+        }
+
+        Pad& pad = pads[p];
+        if (pad.fd < 0)
+            continue;
+        ssize_t len = ::read(pad.fd, pad.buf, sizeof(pad.buf));
+        if (len == 0)
+            continue;
+        if (len < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EINTR))
+                continue;
+            dbg("Joystick " << (p+1) << " removed");
+            close(p); // ENODEV: unplugged
+            continue;
+        }
+        pad.pos = 0;
+        pad.len = (long)(len / sizeof(struct input_event));
+        if (n < max)
+            n += decode(p, mask, out + n, max - n);
+    }
+    return n;
+}
+
+JoyInput *JoyInput::create()
+{
+    return new EvdevInput();
+}
+
+#endif
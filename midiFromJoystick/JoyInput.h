@@ -0,0 +1,64 @@
+/*-----------------------------------------------------------------------------
+JoyInput
+game pad input backends for midiFromJoystick (XInput, Linux evdev)
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#ifndef JOYINPUT_H
+#define JOYINPUT_H
+
+#include "JoyPoller.h"
+
+//-------------------------------------------------------------------------------------------------------
+// Source of pad states, called from the poller thread only (except wake()).
+//
+// A polled backend (XInput) queries the pads on every read() and returns right away, the
+// poller calls it at the poll rate. An event driven backend (evdev) waits in read() until
+// the kernel reports input, its changes carry the time the kernel took the events.
+// Either way, one JoyChange is reported per new state of a pad.
+
+class JoyInput
+{
+public:
+    virtual ~JoyInput() {}
+
+    // changes of the pads in mask, at most max; waits up to timeout seconds if event driven
+    virtual long read(unsigned mask, JoyChange *out, long max, double timeout) = 0;
+
+    virtual bool isPolled() const = 0;
+    virtual unsigned connected() const = 0; // bit n for pad n
+    virtual void wake() = 0;                // any thread, ends a waiting read()
+
+    static JoyInput *create(); // backend of this platform
+};
+
+#ifndef _WIN32
+//-------------------------------------------------------------------------------------------------------
+// Turns the events of a Linux input device (EV_KEY, EV_ABS, EV_SYN) into pad states, kept
+// apart from the device so that it can be fed from memory.
+
+#define JOY_EVDEV_ABS 0x20 // axis codes handled
+
+class JoyEvdevDecoder
+{
+public:
+    JoyEvdevDecoder();
+
+    void reset();
+    void setAbsRange(int code, long min, long max); // as reported by EVIOCGABS
+
+    bool event(unsigned short type, unsigned short code, long value); // true: a report gave a new state
+    const JoyState& getState() const { return state; }
+
+private:
+    short stick(int code, long value, bool invert) const;
+    unsigned char trigger(int code, long value) const;
+
+    JoyState state;   // as of the last report
+    JoyState pending; // events since
+    bool dropping;    // events lost, ignored up to the next report
+    long absMin[JOY_EVDEV_ABS];
+    long absMax[JOY_EVDEV_ABS];
+};
+#endif
+
+#endif
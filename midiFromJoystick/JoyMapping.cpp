@@ -0,0 +1,575 @@
+/*-----------------------------------------------------------------------------
+JoyMapping
+controller to MIDI mapping of midiFromJoystick
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#include "JoyMapping.h"
+#include "../common/MIDI.h"
+#include "../common/pizvstbase.h"
+#include "../common/PizTextFile.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+// the hardwired mapping of earlier versions
+static const char *defaultMapping =
+    "button A      note 48\n" // C4
+    "button B      note 50\n" // D4
+    "button X      note 52\n" // E4
+    "button Y      note 53\n" // F4
+    "button DOWN   note 55\n" // G4
+    "button RIGHT  note 57\n" // A4
+    "button LEFT   note 59\n" // H4
+    "button UP     note 60\n" // C5
+    "button LB     program -1\n"
+    "button RB     program +1\n"
+    "button START  program reset\n"
+    "axis   LY     pitchbend\n"
+    "axis   RT     pressure\n"
+    "axis   LT     cc 1\n";
+
+struct JoyName
+{
+    const char *name;
+    unsigned short value;
+};
+
+static const JoyName buttonNames[] =
+{
+    { "A",      JOY_A },
+    { "B",      JOY_B },
+    { "X",      JOY_X },
+    { "Y",      JOY_Y },
+    { "UP",     JOY_DPAD_UP },
+    { "DOWN",   JOY_DPAD_DOWN },
+    { "LEFT",   JOY_DPAD_LEFT },
+    { "RIGHT",  JOY_DPAD_RIGHT },
+    { "START",  JOY_START },
+    { "BACK",   JOY_BACK },
+    { "LB",     JOY_LEFT_SHOULDER },
+    { "RB",     JOY_RIGHT_SHOULDER },
+    { "LTHUMB", JOY_LEFT_THUMB },
+    { "RTHUMB", JOY_RIGHT_THUMB },
+    { 0, 0 } // terminator
+};
+
+static const JoyName axisNames[] =
+{
+    { "LX", kJoyLX },
+    { "LY", kJoyLY },
+    { "RX", kJoyRX },
+    { "RY", kJoyRY },
+    { "LT", kJoyLT },
+    { "RT", kJoyRT },
+    { 0, 0 } // terminator
+};
+
+static inline bool isStick(int axis)
+{
+    return axis < kJoyLT;
+}
+
+//-------------------------------------------------------------------------------------------------------
+void JoyMapState::reset()
+{
+    buttons = 0;
+    program = 0;
+    nrpn = -1;
+    for (int i = 0; i < kJoyNumAxes; i++)
+    {
+        axis[i] = -1;
+        raw[i] = 0;
+        time[i] = 0;
+        pending[i] = -1;
+    }
+}
+
+//-------------------------------------------------------------------------------------------------------
+JoyMapping::JoyMapping()
+{
+    setDefault();
+}
+
+void JoyMapping::clear()
+{
+    memset(first, 0, sizeof(first));
+    memset(count, 0, sizeof(count));
+    numActions = 0;
+    mappedButtons = 0;
+    for (int i = 0; i < kJoyNumAxes; i++)
+        axes[i].type = kOutNone;
+    rules = 0;
+}
+
+void JoyMapping::setDefault()
+{
+    compile(defaultMapping);
+}
+
+bool JoyMapping::load(const char *path)
+{
+    std::vector<char> text;
+    if (!pizLoadText(path, text))
+        return false;
+
+    if (!compile(&text[0]))
+        dbg("JoyMapping: errors in " << path);
+    return true;
+}
+
+//-------------------------------------------------------------------------------------------------------
+// Parsed rules are first collected per button edge, then stored in button order, so that
+// each button edge owns one contiguous range of actions.
+
+struct JoyMapping::ParsedAction
+{
+    int key; // bit * 2 + edge
+    int order;
+    unsigned char type, data1, data2;
+    signed char step;
+
+    bool operator<(const ParsedAction& o) const { return (key != o.key) ? (key < o.key) : (order < o.order); }
+};
+
+bool JoyMapping::compile(const char *text)
+{
+    clear();
+
+    std::vector<ParsedAction> collected;
+
+    bool ok = true;
+    PizTextLines lines(text);
+    while (char *line = lines.next())
+    {
+        if (!parseLine(line, collected))
+        {
+            dbg("JoyMapping: line " << lines.getNumber() << " not understood");
+            ok = false;
+        }
+    }
+
+    if ((long)collected.size() > JOY_MAX_ACTIONS)
+    {
+        dbg("JoyMapping: too many rules");
+        collected.resize(JOY_MAX_ACTIONS);
+        ok = false;
+    }
+    std::sort(collected.begin(), collected.end());
+    for (size_t i = 0; i < collected.size(); i++)
+    {
+        const ParsedAction& pa = collected[i];
+        int bit = pa.key / 2;
+        int edge = pa.key % 2;
+        if (!count[bit][edge])
+            first[bit][edge] = (unsigned char)i;
+        count[bit][edge]++;
+        mappedButtons |= (unsigned short)(1 << bit);
+
+        Action& a = actions[i];
+        a.type = pa.type;
+        a.data1 = pa.data1;
+        a.data2 = pa.data2;
+        a.step = pa.step;
+    }
+    numActions = (long)collected.size();
+    return ok;
+}
+
+bool JoyMapping::parseLine(char *line, std::vector<ParsedAction>& parsed)
+{
+    char *pos = line;
+    char *kind = pizNextWord(pos);
+    if (!kind)
+        return true; // empty or comment
+
+    char *name = pizNextWord(pos);
+    char *what = pizNextWord(pos);
+    if (!name || !what)
+        return false;
+
+    unsigned short id;
+    if (!strcmp(kind, "BUTTON"))
+    {
+        if (!pizFindName(buttonNames, name, id))
+            return false;
+        int bit = 0;
+        while (!(id & (1 << bit)))
+            bit++;
+
+        ParsedAction press, release;
+        memset(&press, 0, sizeof(press));
+        press.key = bit * 2;
+        press.order = (int)parsed.size();
+        release = press;
+        release.key = bit * 2 + 1;
+
+        long v1, v2;
+        char *arg1 = pizNextWord(pos);
+        char *arg2 = pizNextWord(pos);
+        if (!strcmp(what, "NOTE"))
+        {
+            if (!pizParseNumber(arg1, 0, 127, v1))
+                return false;
+            if (!arg2)
+                v2 = 64;
+            else if (!pizParseNumber(arg2, 1, 127, v2))
+                return false;
+            press.type = release.type = kActNote;
+            press.data1 = release.data1 = (unsigned char)v1;
+            press.data2 = (unsigned char)v2;
+            release.data2 = 0; // note off
+        }
+        else if (!strcmp(what, "CC"))
+        {
+            long off = 0;
+            if (!pizParseNumber(arg1, 0, 127, v1))
+                return false;
+            if (!arg2)
+                v2 = 127;
+            else if (!pizParseNumber(arg2, 0, 127, v2))
+                return false;
+            char *arg3 = pizNextWord(pos);
+            if (arg3 && !pizParseNumber(arg3, 0, 127, off))
+                return false;
+            press.type = release.type = kActCC;
+            press.data1 = release.data1 = (unsigned char)v1;
+            press.data2 = (unsigned char)v2;
+            release.data2 = (unsigned char)off;
+        }
+        else if (!strcmp(what, "PROGRAM"))
+        {
+            if (arg1 && !strcmp(arg1, "RESET"))
+                v1 = 0;
+            else if (!pizParseNumber(arg1, -127, 127, v1) || !v1)
+                return false;
+            press.type = kActProgram;
+            press.step = (signed char)v1;
+            parsed.push_back(press);
+            rules++;
+            return !arg2;
+        }
+        else
+            return false;
+
+        parsed.push_back(press);
+        parsed.push_back(release);
+        rules++;
+        return !pizNextWord(pos);
+    }
+
+    if (!strcmp(kind, "AXIS"))
+    {
+        if (!pizFindName(axisNames, name, id))
+            return false;
+
+        Axis& a = axes[id];
+        a.number = 0;
+        a.hysteresis = isStick(id) ? 128 : 2;
+        a.interval = 0;
+        long deadZone = isStick(id) ? 1024 : 0;
+        long steps = 0;
+        int curve = kCurveLinear;
+        bool invert = false;
+
+        if (!strcmp(what, "PITCHBEND"))
+        {
+            a.type = kOutPitchBend;
+            a.outMax = (1 << 14) - 1;
+        }
+        else if (!strcmp(what, "PRESSURE"))
+        {
+            a.type = kOutPressure;
+            a.outMax = 127;
+        }
+        else if (!strcmp(what, "CC"))
+        {
+            long cc;
+            if (!pizParseNumber(pizNextWord(pos), 0, 127, cc))
+                return false;
+            a.type = kOutCC;
+            a.number = (unsigned short)cc;
+            a.outMax = 127;
+        }
+        else if (!strcmp(what, "CC14"))
+        {
+            long cc;
+            if (!pizParseNumber(pizNextWord(pos), 0, MIDI_LSB - 1, cc))
+                return false;
+            a.type = kOutCC14;
+            a.number = (unsigned short)cc;
+            a.outMax = (1 << 14) - 1;
+        }
+        else if (!strcmp(what, "NRPN"))
+        {
+            long param;
+            if (!pizParseNumber(pizNextWord(pos), 0, (1 << 14) - 1, param))
+                return false;
+            a.type = kOutNrpn;
+            a.number = (unsigned short)param;
+            a.outMax = (1 << 14) - 1;
+        }
+        else
+            return false;
+
+        bool ok = true;
+        for (char *opt = pizNextWord(pos); opt && ok; opt = pizNextWord(pos))
+        {
+            long v = 0;
+            if (!strcmp(opt, "INVERT"))
+                invert = true;
+            else if (!strcmp(opt, "DEADZONE"))
+                ok = pizParseNumber(pizNextWord(pos), 0, isStick(id) ? 32767 : 255, deadZone);
+            else if (!strcmp(opt, "CURVE"))
+            {
+                char *c = pizNextWord(pos);
+                if (c && !strcmp(c, "LINEAR"))    curve = kCurveLinear;
+                else if (c && !strcmp(c, "SOFT")) curve = kCurveSoft;
+                else if (c && !strcmp(c, "HARD")) curve = kCurveHard;
+                else if (c && !strcmp(c, "S"))    curve = kCurveS;
+                else ok = false;
+            }
+            else if (!strcmp(opt, "STEPS"))
+                ok = pizParseNumber(pizNextWord(pos), 2, a.outMax + 1, steps);
+            else if (!strcmp(opt, "HYSTERESIS"))
+                ok = pizParseNumber(pizNextWord(pos), 0, isStick(id) ? 32767 : 255, a.hysteresis);
+            else if (!strcmp(opt, "INTERVAL"))
+            {
+                ok = pizParseNumber(pizNextWord(pos), 0, 1000, v);
+                a.interval = v * 0.001;
+            }
+            else
+                ok = false;
+        }
+        if (!ok)
+        {
+            a.type = kOutNone;
+            return false;
+        }
+
+        buildTable(a, isStick(id), deadZone, curve, steps, invert);
+        rules++;
+        return true;
+    }
+    return false;
+}
+
+//-------------------------------------------------------------------------------------------------------
+// The whole conditioning of an axis is one table, indexed by the raw value: sticks map
+// onto the output range with the center in the middle, triggers from 0. Inside the dead
+// zone the output stays at the center (sticks) or 0 (triggers), the rest of the travel
+// goes through the response curve and is quantized to the given number of steps.
+
+static double applyCurve(int curve, double u) // 0..1 -> 0..1
+{
+    switch (curve)
+    {
+    case JoyMapping::kCurveSoft: return u * u;              // fine control around the center
+    case JoyMapping::kCurveHard: return sqrt(u);            // quick response
+    case JoyMapping::kCurveS:    return u * u * (3 - 2 * u); // soft at both ends
+    }
+    return u;
+}
+
+void JoyMapping::buildTable(Axis& a, bool stick, long deadZone, int curve, long steps, bool invert)
+{
+    long size = stick ? 65536 : 256;
+    long full = stick ? 32768 : 256;
+    double half = (a.outMax + 1) / 2.0;
+    a.lut.resize(size);
+
+    for (long i = 0; i < size; i++)
+    {
+        long x = stick ? i - 32768 : i;
+        if (invert)
+            x = stick ? -1 - x : 255 - x;
+
+        long mag = (x >= 0) ? x : -x;
+        double u = (mag <= deadZone) ? 0 : (double)(mag - deadZone) / (full - deadZone);
+        double c = applyCurve(curve, std::min(u, 1.0));
+        if (steps) // per side of a stick, so the center stays where it is
+        {
+            long k = stick ? std::max(1L, steps / 2) : steps - 1;
+            c = floor(c * k + 0.5) / k;
+        }
+
+        double v;
+        if (stick)
+            v = (x >= 0) ? half + c * half : half - c * half;
+        else
+            v = c * (a.outMax + 1);
+        a.lut[i] = (unsigned short)std::max(0L, std::min((long)v, a.outMax));
+    }
+    a.rest = a.lut[stick ? 32768 : (invert ? 255 : 0)];
+}
+
+static inline long rawIndex(int n, const JoyState& state) // of the axis table
+{
+    switch (n)
+    {
+    case kJoyLX: return state.thumbLX + 32768;
+    case kJoyLY: return state.thumbLY + 32768;
+    case kJoyRX: return state.thumbRX + 32768;
+    case kJoyRY: return state.thumbRY + 32768;
+    case kJoyLT: return state.leftTrigger;
+    }
+    return state.rightTrigger;
+}
+
+//-------------------------------------------------------------------------------------------------------
+// A new axis value is only sent when the raw value moved further than the hysteresis from
+// where the last value was sent (noise of a resting stick never gets through), except for
+// the rest position and the ends, which are always reached. Within the minimum interval a
+// new value waits, flush() sends the latest one when the interval is over.
+
+static inline void putCC(JoyMidiMsg *out, long& n, unsigned char channel, int cc, long value)
+{
+    unsigned char *m = out[n++].data;
+    m[0] = MIDI_CONTROLCHANGE | channel;
+    m[1] = (unsigned char)cc;
+    m[2] = (unsigned char)(value & 0x7F);
+}
+
+// the messages of a new value; 14-bit controllers and NRPNs leave out the bytes the
+// receiver already has: the MSB if only the LSB changed, the parameter number if the
+// same NRPN is still selected (prev: value sent before, -1 for none)
+long JoyMapping::putAxis(int i, long v, long prev, unsigned char channel, long& nrpn, JoyMidiMsg *out) const
+{
+    const Axis& a = axes[i];
+    long n = 0;
+    bool msb = (prev < 0) || ((v >> 7) != (prev >> 7));
+
+    switch (a.type)
+    {
+    case kOutPitchBend:
+        out[n].data[0] = MIDI_PITCHBEND | channel;
+        out[n].data[1] =  v       & 0x7F; // lsb
+        out[n].data[2] = (v >> 7) & 0x7F; // msb
+        n++;
+        break;
+    case kOutPressure:
+        out[n].data[0] = MIDI_CHANNELPRESSURE | channel;
+        out[n].data[1] = v & 0x7F;
+        out[n].data[2] = 0;
+        n++;
+        break;
+    case kOutCC:
+        putCC(out, n, channel, a.number, v);
+        break;
+    case kOutCC14:
+        if (msb)
+            putCC(out, n, channel, a.number, v >> 7);
+        putCC(out, n, channel, MIDI_LSB + a.number, v);
+        break;
+    case kOutNrpn:
+        if (nrpn != a.number)
+        {
+            if ((nrpn < 0) || ((nrpn >> 7) != (a.number >> 7)))
+                putCC(out, n, channel, MIDI_NONREG_PARAM_NUM_MSB, a.number >> 7);
+            putCC(out, n, channel, MIDI_NONREG_PARAM_NUM_LSB, a.number);
+            nrpn = a.number;
+            msb = true; // the receiver's value is of another parameter
+        }
+        if (msb)
+            putCC(out, n, channel, MIDI_DATA_ENTRY, v >> 7);
+        putCC(out, n, channel, MIDI_LSB + MIDI_DATA_ENTRY, v);
+        break;
+    }
+    return n;
+}
+
+double JoyMapping::nextDue(const JoyMapState& last) const
+{
+    double due = 1e30;
+    for (int i = 0; i < kJoyNumAxes; i++)
+        if (last.pending[i] >= 0)
+            due = std::min(due, last.time[i] + axes[i].interval);
+    return due;
+}
+
+long JoyMapping::flush(JoyMapState& last, double time, unsigned char channel, JoyMidiMsg *out) const
+{
+    long n = 0;
+    channel &= 0x0F;
+    for (int i = 0; i < kJoyNumAxes; i++)
+    {
+        if ((last.pending[i] < 0) || (time < last.time[i] + axes[i].interval))
+            continue;
+        n += putAxis(i, last.pending[i], last.axis[i], channel, last.nrpn, &out[n]);
+        last.axis[i] = last.pending[i];
+        last.time[i] = time;
+        last.pending[i] = -1;
+    }
+    return n;
+}
+
+long JoyMapping::process(const JoyState& state, JoyMapState& last, unsigned char channel, double time, JoyMidiMsg *out) const
+{
+    long n = 0;
+    channel &= 0x0F;
+
+    // buttons
+    unsigned short changed = (state.buttons ^ last.buttons) & mappedButtons;
+    for (int bit = 0; changed; bit++, changed >>= 1)
+    {
+        if (!(changed & 1))
+            continue;
+
+        int edge = (state.buttons & (1 << bit)) ? 0 : 1; // press, release
+        const Action *a = &actions[first[bit][edge]];
+        for (int i = 0; i < count[bit][edge]; i++, a++)
+        {
+            unsigned char *m = out[n++].data;
+            switch (a->type)
+            {
+            case kActNote:
+                m[0] = MIDI_NOTEON | channel;
+                m[1] = a->data1;
+                m[2] = a->data2;
+                break;
+            case kActCC:
+                m[0] = MIDI_CONTROLCHANGE | channel;
+                m[1] = a->data1;
+                m[2] = a->data2;
+                break;
+            case kActProgram:
+                last.program = a->step ? (short)std::max(0, std::min(127, last.program + a->step)) : 0;
+                m[0] = MIDI_PROGRAMCHANGE | channel;
+                m[1] = (unsigned char)last.program;
+                m[2] = 0;
+                break;
+            }
+        }
+    }
+    last.buttons = state.buttons;
+
+    // axes
+    for (int i = 0; i < kJoyNumAxes; i++)
+    {
+        const Axis& a = axes[i];
+        if (a.type == kOutNone)
+            continue;
+
+        long raw = rawIndex(i, state);
+        long v = a.lut[raw];
+        bool edge = (v == a.rest) || (v == 0) || (v == a.outMax);
+        if (!edge && (last.axis[i] >= 0) && (labs(raw - last.raw[i]) <= a.hysteresis))
+            continue; // jitter
+        last.raw[i] = raw;
+
+        if (v == ((last.pending[i] >= 0) ? last.pending[i] : last.axis[i]))
+            continue; // same value
+
+        if ((last.axis[i] >= 0) && (time < last.time[i] + a.interval))
+        {
+            last.pending[i] = (v != last.axis[i]) ? v : -1; // wait
+            continue;
+        }
+        n += putAxis(i, v, last.axis[i], channel, last.nrpn, &out[n]);
+        last.axis[i] = v;
+        last.time[i] = time;
+        last.pending[i] = -1;
+    }
+    return n;
+}
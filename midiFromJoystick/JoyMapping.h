@@ -0,0 +1,136 @@
+/*-----------------------------------------------------------------------------
+JoyMapping
+controller to MIDI mapping of midiFromJoystick
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#ifndef JOYMAPPING_H
+#define JOYMAPPING_H
+
+#include "JoyPoller.h"
+#include <vector>
+
+//-------------------------------------------------------------------------------------------------------
+// Mapping rules, one per line ('#' starts a comment):
+//
+//   button <name> note <key> [velocity]        note on while pressed (default velocity 64)
+//   button <name> cc <controller> [on] [off]   on value when pressed, off value when released (127/0)
+//   button <name> program <+n|-n|reset>        steps the program number when pressed
+//   axis <name> pitchbend [options]
+//   axis <name> pressure [options]             channel pressure
+//   axis <name> cc <controller> [options]
+//   axis <name> cc14 <controller 0..31> [options]  14 bit, MSB on the controller, LSB on controller + 32
+//   axis <name> nrpn <parameter 0..16383> [options] 14 bit, data entry MSB and LSB
+//
+// buttons: A B X Y UP DOWN LEFT RIGHT START BACK LB RB LTHUMB RTHUMB
+// axes:    LX LY RX RY (sticks, centered) LT RT (triggers)
+// options: deadzone <raw>      no output change near the center or the rest position
+//                               (default 1024 for sticks, 0 for triggers)
+//          curve <linear|soft|hard|s>  response (soft: x^2, hard: sqrt(x), s: smooth step)
+//          steps <n>           output resolution
+//          hysteresis <raw>    minimum movement for a new value (default 128 / 2)
+//          interval <ms>       minimum time between two values, the latest one is sent later
+//          invert
+//
+// A button may carry several rules, an axis only one. The rules are compiled into flat
+// tables: per button bit the actions for press and release, per axis the scaling and the
+// message template. A new pad state then costs one lookup per changed button and one
+// comparison per mapped axis, however large the mapping.
+
+#define JOY_NUM_BUTTONS   16
+#define JOY_MAX_ACTIONS   128 // in total
+#define JOY_MAX_MSGS      (JOY_MAX_ACTIONS + 4 * kJoyNumAxes) // per state change
+
+enum
+{
+    kJoyLX,
+    kJoyLY,
+    kJoyRX,
+    kJoyRY,
+    kJoyLT,
+    kJoyRT,
+
+    kJoyNumAxes
+};
+
+struct JoyMidiMsg
+{
+    unsigned char data[3];
+};
+
+// what an instance remembers between two states
+struct JoyMapState
+{
+    JoyMapState() { reset(); }
+    void reset();
+
+    unsigned short buttons;
+    short  program;             // 0..127
+    long   nrpn;                // NRPN selected on the channel, -1 for none yet
+    long   axis[kJoyNumAxes];    // last value sent, -1 for none yet
+    long   raw[kJoyNumAxes];     // raw value it was taken from
+    double time[kJoyNumAxes];    // when it was sent
+    long   pending[kJoyNumAxes]; // waiting for the interval, -1 for none
+};
+
+class JoyMapping
+{
+public:
+    JoyMapping();
+
+    bool compile(const char *text); // false if a line was not understood (the others are used)
+    bool load(const char *path);    // false if not found
+    void setDefault();              // the mapping of the original proof-of-concept
+
+    // messages for a new state at time (s), returns their number (at most JOY_MAX_MSGS)
+    long process(const JoyState& state, JoyMapState& last, unsigned char channel, double time, JoyMidiMsg *out) const;
+
+    // axis values held back by their interval: when the next one is due, and the ones due at time
+    double nextDue(const JoyMapState& last) const;
+    long flush(JoyMapState& last, double time, unsigned char channel, JoyMidiMsg *out) const;
+
+    long numRules() const { return rules; }
+
+    enum { kCurveLinear, kCurveSoft, kCurveHard, kCurveS };
+
+private:
+    enum { kActNote, kActCC, kActProgram };
+    enum { kOutNone, kOutPitchBend, kOutPressure, kOutCC, kOutCC14, kOutNrpn };
+
+    struct Action
+    {
+        unsigned char type;
+        unsigned char data1; // key or controller
+        unsigned char data2; // velocity or value
+        signed char   step;  // program: +-n, 0 for reset
+    };
+
+    struct Axis
+    {
+        unsigned char type;       // kOut...
+        unsigned short number;    // controller or NRPN
+        long   outMax;            // 127 or 16383
+        long   rest;              // output at the rest position
+        long   hysteresis;        // raw
+        double interval;          // s
+        std::vector<unsigned short> lut; // raw value (sticks offset by 32768) -> output
+    };
+
+    struct ParsedAction;
+
+    void clear();
+    bool parseLine(char *line, std::vector<ParsedAction>& parsed);
+    void buildTable(Axis& a, bool stick, long deadZone, int curve, long steps, bool invert);
+    long putAxis(int i, long v, long prev, unsigned char channel, long& nrpn, JoyMidiMsg *out) const;
+
+    // per button bit: actions on press [0] and release [1], as a range of actions[]
+    unsigned char first[JOY_NUM_BUTTONS][2];
+    unsigned char count[JOY_NUM_BUTTONS][2];
+    Action actions[JOY_MAX_ACTIONS];
+    long numActions;
+    unsigned short mappedButtons;
+
+    Axis axes[kJoyNumAxes];
+    long rules;
+};
+
+#endif
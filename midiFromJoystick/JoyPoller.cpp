@@ -0,0 +1,164 @@
+/*-----------------------------------------------------------------------------
+JoyPoller
+background polling of the game pad for midiFromJoystick
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+
+#include "JoyPoller.h"
+#include "JoyInput.h"
+#include "JoyRecord.h"
+#include "../common/PizClock.h"
+#include <chrono>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+// No MFC
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include <mmsystem.h>
+
+#pragma comment(lib, "winmm.lib") // timeBeginPeriod
+#endif
+
+//-------------------------------------------------------------------------------------------------------
+JoyPoller::JoyPoller(JoyInput *input)
+    : dropped(0), input(input ? input : JoyInput::create()), recorder(new JoyRecorder()), recordStamped(true), recordWanted(false), recordState(kRecordOff), quit(false), connected(0), pads(1), rate(JOY_POLL_RATE)
+{
+    recordFile[0] = 0;
+}
+
+JoyPoller::~JoyPoller()
+{
+    stop();
+    delete recorder;
+    delete input;
+}
+
+void JoyPoller::start()
+{
+    if (thread.joinable())
+        return;
+
+    quit = false;
+#ifdef _WIN32
+    timeBeginPeriod(1); // 1ms wait granularity
+#endif
+    thread = std::thread(&JoyPoller::run, this);
+}
+
+void JoyPoller::stop()
+{
+    if (thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        input->wake();
+        thread.join();
+#ifdef _WIN32
+        timeEndPeriod(1);
+#endif
+    }
+}
+
+void JoyPoller::setPads(unsigned mask)
+{
+    if (pads.exchange(mask) != mask)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        wake.notify_all(); // query the new pads right away
+        input->wake();
+    }
+}
+
+void JoyPoller::setRecordFile(const char *path, bool stamped)
+{
+    strncpy(recordFile, path, JOY_PATH_MAX - 32);
+    recordFile[JOY_PATH_MAX - 32] = 0;
+    recordStamped = stamped;
+}
+
+// Poller thread, every pass after the read: the request is picked up before the states
+// just read are written, so none after it are missed. The file is written buffered, so
+// recording costs the audio thread only the flag. After a failure, the request has to be
+// switched off and on again for another try.
+void JoyPoller::updateRecording()
+{
+    bool wanted = recordWanted;
+    int state = recordState;
+    if (!wanted && (state != kRecordOff))
+    {
+        recorder->close();
+        recordState = kRecordOff;
+    }
+    else if (wanted && (state == kRecordOff))
+    {
+        char path[JOY_PATH_MAX];
+        strcpy(path, recordFile);
+        if (recordStamped)
+        {
+            time_t now = time(0);
+            strftime(&path[strlen(path)], 32, "-%Y%m%d-%H%M%S.joyrec", localtime(&now));
+        }
+        recordState = recorder->open(path) ? kRecordOn : kRecordFailed;
+    }
+}
+
+void JoyPoller::setRate(long hz)
+{
+    rate = (hz > 0) ? hz : JOY_POLL_RATE;
+}
+
+void JoyPoller::waitUntil(double time, unsigned mask)
+{
+    using namespace std::chrono;
+    steady_clock::time_point until(duration_cast<steady_clock::duration>(duration<double>(time)));
+
+    std::unique_lock<std::mutex> lock(mutex);
+    wake.wait_until(lock, until, [this, time, mask] { return quit || (pads != mask) || (pizTimeNow() >= time); });
+}
+
+//-------------------------------------------------------------------------------------------------------
+
+void JoyPoller::run()
+{
+    JoyChange buf[64];
+    double next = pizTimeNow();
+
+    while (!quit)
+    {
+        unsigned mask = pads;
+        long n = input->read(mask, buf, 64, JOY_RETRY_TIME);
+        for (long i = 0; i < n; i++)
+        {
+            if (!changes.push(buf[i]))
+                dropped++;
+        }
+        updateRecording();
+        if (n && recorder->isOpen())
+        {
+            for (long i = 0; i < n; i++)
+                recorder->write(buf[i]);
+        }
+        unsigned found = input->connected();
+        connected = found;
+
+        if (!input->isPolled() || (n == 64))
+            continue; // the next read() waits, or more to come
+
+        double now = pizTimeNow();
+        if (found & mask)
+        {
+            next += 1.0 / rate;
+            if (next < now)
+                next = now; // fell behind, do not catch up
+        }
+        else
+            next = now + JOY_RETRY_TIME; // missing pads are not queried before
+        waitUntil(next, mask);
+    }
+}
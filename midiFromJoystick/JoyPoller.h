@@ -0,0 +1,114 @@
+/*-----------------------------------------------------------------------------
+JoyPoller
+background polling of the game pad for midiFromJoystick
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#ifndef JOYPOLLER_H
+#define JOYPOLLER_H
+
+#include "../common/PizRing.h"
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+//-------------------------------------------------------------------------------------------------------
+// State of one pad, in XInput layout.
+
+struct JoyState
+{
+    unsigned short buttons;      // XINPUT_GAMEPAD_... bits
+    unsigned char  leftTrigger;  // 0..255
+    unsigned char  rightTrigger;
+    short thumbLX;               // -32768..32767
+    short thumbLY;
+    short thumbRX;
+    short thumbRY;
+};
+
+// button bits, as XINPUT_GAMEPAD_...
+#define JOY_DPAD_UP        0x0001
+#define JOY_DPAD_DOWN      0x0002
+#define JOY_DPAD_LEFT      0x0004
+#define JOY_DPAD_RIGHT     0x0008
+#define JOY_START          0x0010
+#define JOY_BACK           0x0020
+#define JOY_LEFT_THUMB     0x0040
+#define JOY_RIGHT_THUMB    0x0080
+#define JOY_LEFT_SHOULDER  0x0100
+#define JOY_RIGHT_SHOULDER 0x0200
+#define JOY_A              0x1000
+#define JOY_B              0x2000
+#define JOY_X              0x4000
+#define JOY_Y              0x8000
+
+// a new state, as seen by the poller
+struct JoyChange
+{
+    double time;       // when the state was taken, on the clock of pizTimeNow()
+    unsigned char pad; // 0..3
+    JoyState state;
+};
+
+#define JOY_MAX_PADS    4    // as XInput
+#define JOY_POLL_RATE   1000 // Hz, default
+#define JOY_RETRY_TIME  2.0  // s, querying a missing pad is slow
+#define JOY_PATH_MAX    512
+
+class JoyInput;
+class JoyRecorder;
+
+//-------------------------------------------------------------------------------------------------------
+// Reads the selected pads on its own thread, so that the audio thread never waits for the
+// driver and changes are not quantized to the block size. A polled input (XInput) is
+// queried at a fixed rate, all pads in one pass; an event driven one (evdev) is waited on.
+// Every change is queued with its pad and time stamp; the audio thread places it at the
+// matching sample position. A missing pad is only looked for every JOY_RETRY_TIME
+// seconds, without holding up the others.
+
+class JoyPoller
+{
+public:
+    JoyPoller(JoyInput *input = 0); // takes ownership, default: the backend of this platform
+    ~JoyPoller();
+
+    void start();
+    void stop();
+
+    void setPads(unsigned mask); // any thread, bit n for pad n
+    void setRate(long hz);       // any thread, polled input only
+    unsigned getConnected() const { return connected.load(); } // bit n for pad n
+
+    // Recording of the changes to a file (see JoyRecord.h). record() only sets a flag; the
+    // poller thread names, opens, writes and closes the file on its next pass.
+    enum { kRecordOff, kRecordOn, kRecordFailed };
+
+    void setRecordFile(const char *path, bool stamped = true); // before start(), with stamped
+                                                                // -<date>-<time>.joyrec is added
+    void record(bool on) { recordWanted = on; } // any thread
+    int getRecordState() const { return recordState.load(); }
+
+    PizRing<JoyChange, 256> changes; // consumed by audio thread
+    std::atomic<long> dropped;       // changes lost, the audio thread did not keep up
+
+private:
+    void run();
+    void waitUntil(double time, unsigned mask); // or until stopped or other pads are selected
+    void updateRecording();
+
+    JoyInput *input;
+    JoyRecorder *recorder; // poller thread only
+    char recordFile[JOY_PATH_MAX];
+    bool recordStamped;
+    std::atomic<bool> recordWanted;
+    std::atomic<int> recordState;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::atomic<bool> quit;
+    std::atomic<unsigned> connected;
+    std::atomic<unsigned> pads;
+    std::atomic<long> rate;
+};
+
+#endif
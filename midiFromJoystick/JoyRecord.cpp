@@ -0,0 +1,300 @@
+/*-----------------------------------------------------------------------------
+JoyRecord
+recording and replay of pad states for midiFromJoystick
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#include "JoyRecord.h"
+#include "../common/PizClock.h"
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+enum
+{
+    kFieldButtons = 0x01,
+    kFieldLT = 0x02,
+    kFieldRT = 0x04,
+    kFieldLX = 0x08,
+    kFieldLY = 0x10,
+    kFieldRX = 0x20,
+    kFieldRY = 0x40,
+    kFieldPad = 0x80
+};
+
+static unsigned long zigzag(long v)
+{
+    return (v < 0) ? ((unsigned long)(-(v + 1)) << 1) | 1 : (unsigned long)v << 1;
+}
+
+static long unzigzag(unsigned long v)
+{
+    return (v & 1) ? -(long)(v >> 1) - 1 : (long)(v >> 1);
+}
+
+//-------------------------------------------------------------------------------------------------------
+JoyRecorder::JoyRecorder()
+    : file(0), lastPad(0), start(0), us(0), count(0)
+{
+}
+
+bool JoyRecorder::open(const char *path)
+{
+    close();
+    file = fopen(path, "wb");
+    if (!file)
+        return false;
+
+    fwrite(JOY_RECORD_MAGIC, 1, 4, file);
+    memset(last, 0, sizeof(last));
+    lastPad = 0;
+    us = 0;
+    count = 0;
+    return true;
+}
+
+void JoyRecorder::close()
+{
+    if (file)
+    {
+        fclose(file);
+        file = 0;
+    }
+}
+
+void JoyRecorder::putVar(unsigned long v)
+{
+    while (v >= 0x80)
+    {
+        putc((int)(v & 0x7F) | 0x80, file);
+        v >>= 7;
+    }
+    putc((int)v, file);
+}
+
+void JoyRecorder::write(const JoyChange& ch)
+{
+    if (!file || (ch.pad >= JOY_MAX_PADS))
+        return;
+
+    if (!count)
+        start = ch.time;
+    long long t = (long long)((ch.time - start) * 1e6 + 0.5);
+    if (t < us)
+        t = us; // pads time stamped apart may come slightly out of order
+    putVar((unsigned long)(t - us));
+    us = t;
+
+    const JoyState& s = ch.state;
+    JoyState& l = last[ch.pad];
+    int fields = 0;
+    if (s.buttons != l.buttons)           fields |= kFieldButtons;
+    if (s.leftTrigger != l.leftTrigger)   fields |= kFieldLT;
+    if (s.rightTrigger != l.rightTrigger) fields |= kFieldRT;
+    if (s.thumbLX != l.thumbLX)           fields |= kFieldLX;
+    if (s.thumbLY != l.thumbLY)           fields |= kFieldLY;
+    if (s.thumbRX != l.thumbRX)           fields |= kFieldRX;
+    if (s.thumbRY != l.thumbRY)           fields |= kFieldRY;
+    if (ch.pad != lastPad)                fields |= kFieldPad;
+
+    putc(fields, file);
+    if (fields & kFieldPad)
+        putc(ch.pad, file);
+    if (fields & kFieldButtons)
+    {
+        putc(s.buttons & 0xFF, file);
+        putc(s.buttons >> 8, file);
+    }
+    if (fields & kFieldLT) putc(s.leftTrigger, file);
+    if (fields & kFieldRT) putc(s.rightTrigger, file);
+    if (fields & kFieldLX) putVar(zigzag((long)s.thumbLX - l.thumbLX));
+    if (fields & kFieldLY) putVar(zigzag((long)s.thumbLY - l.thumbLY));
+    if (fields & kFieldRX) putVar(zigzag((long)s.thumbRX - l.thumbRX));
+    if (fields & kFieldRY) putVar(zigzag((long)s.thumbRY - l.thumbRY));
+
+    l = s;
+    lastPad = ch.pad;
+    count++;
+}
+
+//-------------------------------------------------------------------------------------------------------
+JoyPlayer::JoyPlayer()
+    : file(0), lastPad(0), us(0)
+{
+}
+
+bool JoyPlayer::open(const char *path)
+{
+    close();
+    file = fopen(path, "rb");
+    if (!file)
+        return false;
+
+    char magic[4];
+    if ((fread(magic, 1, 4, file) != 4) || memcmp(magic, JOY_RECORD_MAGIC, 4))
+    {
+        close();
+        return false;
+    }
+    rewind();
+    return true;
+}
+
+void JoyPlayer::close()
+{
+    if (file)
+    {
+        fclose(file);
+        file = 0;
+    }
+}
+
+void JoyPlayer::rewind()
+{
+    if (file)
+        fseek(file, 4, SEEK_SET);
+    memset(last, 0, sizeof(last));
+    lastPad = 0;
+    us = 0;
+}
+
+bool JoyPlayer::getVar(unsigned long& v)
+{
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        int c = getc(file);
+        if (c == EOF)
+            return false;
+        v |= (unsigned long)(c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+bool JoyPlayer::next(JoyChange& ch)
+{
+    unsigned long dt, d;
+    int fields;
+    if (!file || !getVar(dt) || ((fields = getc(file)) == EOF))
+        return false;
+
+    int pad = lastPad;
+    if (fields & kFieldPad)
+    {
+        pad = getc(file);
+        if ((pad == EOF) || (pad >= JOY_MAX_PADS))
+            return false;
+    }
+
+    JoyState s = last[pad];
+    if (fields & kFieldButtons)
+    {
+        int lo = getc(file);
+        int hi = getc(file);
+        if (hi == EOF)
+            return false;
+        s.buttons = (unsigned short)(lo | (hi << 8));
+    }
+    if (fields & kFieldLT)
+    {
+        int c = getc(file);
+        if (c == EOF)
+            return false;
+        s.leftTrigger = (unsigned char)c;
+    }
+    if (fields & kFieldRT)
+    {
+        int c = getc(file);
+        if (c == EOF)
+            return false;
+        s.rightTrigger = (unsigned char)c;
+    }
+    short *thumbs[4] = { &s.thumbLX, &s.thumbLY, &s.thumbRX, &s.thumbRY };
+    for (int i = 0; i < 4; i++)
+    {
+        if (!(fields & (kFieldLX << i)))
+            continue;
+        if (!getVar(d))
+            return false;
+        *thumbs[i] = (short)(*thumbs[i] + unzigzag(d));
+    }
+
+    us += dt;
+    last[pad] = s;
+    lastPad = pad;
+    ch.time = us * 1e-6;
+    ch.pad = (unsigned char)pad;
+    ch.state = s;
+    return true;
+}
+
+//-------------------------------------------------------------------------------------------------------
+JoyReplayInput::JoyReplayInput(double speed)
+    : speed(speed), start(0), have(false), done(false), seen(0), woken(false)
+{
+}
+
+void JoyReplayInput::wake()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        woken = true;
+    }
+    cond.notify_all();
+}
+
+long JoyReplayInput::read(unsigned mask, JoyChange *out, long max, double timeout)
+{
+    double now = pizTimeNow();
+    if (start == 0)
+        start = now;
+
+    long n = 0;
+    while (n < max)
+    {
+        if (!have && !(have = player.next(ch)))
+        {
+            done = true;
+            break;
+        }
+
+        double due = start + ((speed > 0) ? ch.time / speed : ch.time);
+        if ((speed > 0) && (due > now))
+        {
+            if (n)
+                break;
+
+            // nothing due yet, wait for the next state
+            using namespace std::chrono;
+            double until = std::min(due, now + timeout);
+            steady_clock::time_point tp(duration_cast<steady_clock::duration>(duration<double>(until)));
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait_until(lock, tp, [this, until] { return woken || (pizTimeNow() >= until); });
+            bool wasWoken = woken;
+            woken = false;
+            now = pizTimeNow();
+            if (wasWoken || (now < due))
+                break;
+        }
+
+        have = false;
+        seen |= 1u << ch.pad;
+        if (mask & (1u << ch.pad))
+        {
+            out[n] = ch;
+            out[n].time = due;
+            n++;
+        }
+    }
+
+    if (done && !n)
+    {
+        // the end, idle until woken
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!woken)
+            cond.wait_for(lock, std::chrono::duration<double>(timeout));
+        woken = false;
+    }
+    return n;
+}
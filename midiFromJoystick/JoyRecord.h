@@ -0,0 +1,109 @@
+/*-----------------------------------------------------------------------------
+JoyRecord
+recording and replay of pad states for midiFromJoystick
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#ifndef JOYRECORD_H
+#define JOYRECORD_H
+
+#include "JoyInput.h"
+#include <stdio.h>
+
+//-------------------------------------------------------------------------------------------------------
+// File format (.joyrec): the magic "PJR1", then one record per pad state
+//
+//   time     varint, us since the record before (0 for the first one)
+//   fields   byte, bit 0..6: buttons LT RT LX LY RX RY changed, bit 7: pad byte follows
+//   pad      byte, only if another pad than in the record before (initially pad 0)
+//   buttons  2 bytes, little endian
+//   LT, RT   1 byte each
+//   LX..RY   zigzag varint, difference to the value before
+//
+// Only the fields which changed against the last state of the same pad are stored (all
+// states start at zero), so a stick moving at 1000 Hz takes about 6 bytes per state.
+
+#define JOY_RECORD_MAGIC "PJR1"
+
+class JoyRecorder
+{
+public:
+    JoyRecorder();
+    ~JoyRecorder() { close(); }
+
+    bool open(const char *path);
+    void close();
+    bool isOpen() const { return file != 0; }
+
+    void write(const JoyChange& ch);
+    long getCount() const { return count; }
+
+private:
+    void putVar(unsigned long v);
+
+    FILE *file;
+    JoyState last[JOY_MAX_PADS];
+    int lastPad;
+    double start; // time of the first state
+    long long us; // time of the record before, since start
+    long count;
+};
+
+//-------------------------------------------------------------------------------------------------------
+// Reads a recording back, state by state. ch.time is in seconds since the recording started.
+
+class JoyPlayer
+{
+public:
+    JoyPlayer();
+    ~JoyPlayer() { close(); }
+
+    bool open(const char *path); // false if missing or not a recording
+    void close();
+    void rewind();
+
+    bool next(JoyChange& ch); // false at the end (or on a truncated record)
+
+private:
+    bool getVar(unsigned long& v);
+
+    FILE *file;
+    JoyState last[JOY_MAX_PADS];
+    int lastPad;
+    long long us;
+};
+
+//-------------------------------------------------------------------------------------------------------
+// Input backend replaying a recording, e.g. for JoyPoller. With speed 1 the states come at
+// their recorded distance, with speed n n times faster; the time stamps are those of the
+// replay. With speed 0 all states are returned right away, stamped with the recorded time
+// (from the start of the replay), so that a headless run through the mapping behaves the
+// same as the real one, only faster; read() is then called directly, as the poller's queue
+// would overflow.
+
+class JoyReplayInput : public JoyInput
+{
+public:
+    JoyReplayInput(double speed = 1.0);
+
+    bool open(const char *path) { return player.open(path); }
+    bool finished() const { return done; }
+
+    virtual long read(unsigned mask, JoyChange *out, long max, double timeout);
+    virtual bool isPolled() const { return false; }
+    virtual unsigned connected() const { return seen; }
+    virtual void wake();
+
+private:
+    JoyPlayer player;
+    double speed;
+    double start;  // of the replay, 0 before the first read()
+    JoyChange ch;  // next state
+    bool have;     // in ch
+    bool done;
+    unsigned seen; // pads replayed so far
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool woken;
+};
+
+#endif
@@ -7,20 +7,24 @@ specific implementation by H.R.Graf
 // No MFC
 #define WIN32_LEAN_AND_MEAN
 
-// We need the Windows Header and the XInput Header
 #include <windows.h>
-#include <XInput.h>
 #include <stdio.h>
-
-#pragma comment(lib, "Xinput.lib")
+#include <time.h>
 
 #include "../common/PizMidi.h"
+#include "../common/PizClock.h"
+#include "JoyPoller.h"
+#include "JoyMapping.h"
 
 enum
 {
     kChannel,
     kXInput,
     kPower,
+    kPollRate,
+    kLatency,
+    kAllPads,
+    kRecord,
 
     kNumParams,
     kNumPrograms = 4
@@ -36,6 +40,9 @@ private:
     float fChannel;
     float fXInput;
     float fPower;
+    float fPollRate;
+    float fLatency;
+    float fAllPads;
     char name[kVstMaxProgNameLen];
 };
 
@@ -56,16 +63,49 @@ public:
     virtual void   getParameterDisplay(VstInt32 index, char *text);
     virtual void   getParameterName(VstInt32 index, char *text);
 
+    virtual void   resume();
+
 protected:
     float fChannel;
     float fXInput;
     float fPower;
+    float fPollRate;
+    float fLatency;
+    float fAllPads;
+    float fRecord; // deliberately not part of the programs (nor of the default bank): a saved
+                   // project or a program change should never start writing a recording
 
     virtual void processMidiEvents(VstMidiEventVec *inputs, VstMidiEventVec *outputs, VstInt32 sampleFrames);
 
     MidiFromJoystickProgram *programs;
+
+private:
+    void loadMapping();
+    void initRecordPath();
+    void flushAxes(int pad, double until);
+    void output(const JoyMidiMsg *msgs, long n, double time);
+    int  getPad() const { return roundToInt(fXInput * 3.0f); } // 0..3
+    unsigned getPads() const { return (fAllPads >= 0.5f) ? (1u << JOY_MAX_PADS) - 1 : 1u << getPad(); }
+    unsigned char getChannel(int pad) const; // outgoing midi channel
+    long getPollRate() const;
+
+    JoyPoller poller;
+    JoyMapping mapping;
+    JoyMapState padState[JOY_MAX_PADS];
+    PizClockDll clock;     // monotonic clock -> sample timeline
+    VstMidiEventVec queue; // events not yet due, at most JOY_QUEUE_SIZE
+    long queueDropped;     // events lost, the queue was full
 };
 
+// polling rates
+static const long pollRates[] = { 125, 250, 500, 1000, 2000 };
+#define NUM_POLL_RATES (sizeof(pollRates) / sizeof(pollRates[0]))
+
+// Events held back by the latency, reserved up front so that the audio thread never
+// allocates: 100 ms at 2000 Hz of four pads with both sticks moving (4 messages per state)
+// is 3200. Beyond that events are dropped and counted, like in the poller's ring.
+#define JOY_QUEUE_SIZE 4096
+
 
 //-------------------------------------------------------------------------------------------------------
 AudioEffect* createEffectInstance(audioMasterCallback audioMaster) {
@@ -78,6 +118,9 @@ MidiFromJoystickProgram::MidiFromJoystickProgram()
     fChannel = 0.0f;
     fXInput = 0.0f;
     fPower = 1.0f;
+    fPollRate = 3.0f / (NUM_POLL_RATES - 1); // 1000 Hz
+    fLatency = 0.1f; // 10ms
+    fAllPads = 0.0f;
 
     // default program name
     strcpy(name, "Default");
@@ -85,8 +128,10 @@ MidiFromJoystickProgram::MidiFromJoystickProgram()
 
 //-----------------------------------------------------------------------------
 MidiFromJoystick::MidiFromJoystick(audioMasterCallback audioMaster)
-    : PizMidi(audioMaster, kNumPrograms, kNumParams), programs(0)
+    : PizMidi(audioMaster, kNumPrograms, kNumParams), fRecord(0.0f), programs(0), queueDropped(0)
 {
+    queue.reserve(JOY_QUEUE_SIZE);
+
     programs = new MidiFromJoystickProgram[numPrograms];
 
     if (programs) {
@@ -97,6 +142,9 @@ MidiFromJoystick::MidiFromJoystick(audioMasterCallback audioMaster)
                     programs[i].fChannel = defaultBank->GetProgParm(i, 0);
                     programs[i].fXInput = defaultBank->GetProgParm(i, 1);
                     programs[i].fPower = defaultBank->GetProgParm(i, 2);
+                    programs[i].fPollRate = defaultBank->GetProgParm(i, 3);
+                    programs[i].fLatency = defaultBank->GetProgParm(i, 4);
+                    programs[i].fAllPads = defaultBank->GetProgParm(i, 5);
                     strcpy(programs[i].name, defaultBank->GetProgramName(i));
                 }
             }
@@ -119,12 +167,16 @@ MidiFromJoystick::MidiFromJoystick(audioMasterCallback audioMaster)
         setProgram(0);
     }
 
+    loadMapping();
+    initRecordPath();
+    poller.start();
     init();
 }
 
 
 //-----------------------------------------------------------------------------------------
 MidiFromJoystick::~MidiFromJoystick() {
+    poller.stop();
     if (programs) 
         delete[] programs;
 }
@@ -138,6 +190,9 @@ void MidiFromJoystick::setProgram(VstInt32 program)
     setParameter(kChannel, ap->fChannel);
     setParameter(kXInput,  ap->fXInput);
     setParameter(kPower,   ap->fPower);
+    setParameter(kPollRate, ap->fPollRate);
+    setParameter(kLatency, ap->fLatency);
+    setParameter(kAllPads, ap->fAllPads);
 }
 
 //------------------------------------------------------------------------
@@ -170,8 +225,12 @@ void MidiFromJoystick::setParameter(VstInt32 index, float value) {
 
     switch (index) {
     case kChannel: fChannel = ap->fChannel = value; break;
-    case kXInput:  fXInput  = ap->fXInput  = value; break;
+    case kXInput:  fXInput  = ap->fXInput  = value; poller.setPads(getPads()); break;
     case kPower:   fPower   = ap->fPower   = value;  break;
+    case kPollRate: fPollRate = ap->fPollRate = value; poller.setRate(getPollRate()); break;
+    case kLatency: fLatency = ap->fLatency = value; break;
+    case kAllPads: fAllPads = ap->fAllPads = value; poller.setPads(getPads()); break;
+    case kRecord:  fRecord = value; poller.record(fRecord >= 0.5f); break; // only a flag, see initRecordPath
     }
 }
 
@@ -183,6 +242,10 @@ float MidiFromJoystick::getParameter(VstInt32 index) {
     case kChannel:   v = fChannel; break;
     case kXInput:    v = fXInput;  break;
     case kPower:     v = fPower;   break;
+    case kPollRate:  v = fPollRate; break;
+    case kLatency:   v = fLatency; break;
+    case kAllPads:   v = fAllPads; break;
+    case kRecord:    v = fRecord;  break;
     }
     return v;
 }
@@ -193,6 +256,10 @@ void MidiFromJoystick::getParameterName(VstInt32 index, char *label) {
     case kChannel:  strcpy(label, "Channel Out"); break;
     case kXInput:   strcpy(label, "Joystick");    break;
     case kPower:    strcpy(label, "Power");       break;
+    case kPollRate: strcpy(label, "Poll Rate");   break;
+    case kLatency:  strcpy(label, "Latency");     break;
+    case kAllPads:  strcpy(label, "All Pads");    break;
+    case kRecord:   strcpy(label, "Record");      break;
     }
 }
 
@@ -202,170 +269,155 @@ void MidiFromJoystick::getParameterDisplay(VstInt32 index, char *text) {
     case kChannel: sprintf(text, "%d", FLOAT_TO_CHANNEL015(fChannel) + 1); break;
     case kXInput:  sprintf(text, "%d", roundToInt(fXInput * 3.0f)  + 1); break;
     case kPower:   strcpy(text, (fPower < 0.5f) ? "off" : "on"); break;
+    case kPollRate: sprintf(text, "%ld Hz", getPollRate()); break;
+    case kLatency: sprintf(text, "%d ms", roundToInt(fLatency * 100.0f)); break;
+    case kAllPads: strcpy(text, (fAllPads < 0.5f) ? "off" : "on"); break;
+    case kRecord:  strcpy(text, (fRecord < 0.5f) ? "off" : ((poller.getRecordState() == JoyPoller::kRecordFailed) ? "failed" : "on")); break;
     }
 }
 
-//-----------------------------------------------------------------------------------------
-
-typedef struct
-{
-    WORD button;
-    BYTE vel;
-    BYTE key;
-} JoyNote;
-
-static const JoyNote joyNote[] =
+// with "All Pads" on, pad n sends on the selected channel + n
+unsigned char MidiFromJoystick::getChannel(int pad) const
 {
-  { XINPUT_GAMEPAD_A             , 0x40, 0x30 }, // C4
-  { XINPUT_GAMEPAD_B             , 0x40, 0x32 }, // D4
-  { XINPUT_GAMEPAD_X             , 0x40, 0x34 }, // E4
-  { XINPUT_GAMEPAD_Y             , 0x40, 0x35 }, // F4
-  { XINPUT_GAMEPAD_DPAD_DOWN     , 0x40, 0x37 }, // G4
-  { XINPUT_GAMEPAD_DPAD_RIGHT    , 0x40, 0x39 }, // A4
-  { XINPUT_GAMEPAD_DPAD_LEFT     , 0x40, 0x3B }, // H4
-  { XINPUT_GAMEPAD_DPAD_UP       , 0x40, 0x3C }, // C5
-  { 0, 0, 0 } // terminator
-};
-
-/*
-XINPUT_GAMEPAD_BACK,
-XINPUT_GAMEPAD_LEFT_THUMB,
-XINPUT_GAMEPAD_RIGHT_THUMB,
-*/
+    int channel = FLOAT_TO_CHANNEL015(fChannel);
+    if (fAllPads >= 0.5f)
+        channel += pad;
+    return (unsigned char)(channel & 0x0F);
+}
 
-static inline long linmap(long x, long in_min, long in_max, long out_min, long out_max) 
+long MidiFromJoystick::getPollRate() const
 {
-    if (x < in_min)
-        return out_min;
-    return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+    return pollRates[roundToInt(fPollRate * (NUM_POLL_RATES - 1))];
 }
 
-void MidiFromJoystick::processMidiEvents(VstMidiEventVec *inputs, VstMidiEventVec *outputs, VstInt32 sampleFrames)
+//-----------------------------------------------------------------------------------------
+// The mapping is read from midiFromJoystick.map (next to the plug-in, or in the pizmidi
+// folder of the application data, like the default bank), see JoyMapping.h for the rules.
+// Without a file, the built-in mapping is used. The file is read again on every resume,
+// so a layout can be changed without restarting the host.
+
+void MidiFromJoystick::loadMapping()
 {
-    static DWORD pktNum = 0;
-    static WORD  lastButtons = 0;
-    static SHORT progNum = 0;
-    static SHORT lastPitch = 0;
-    static BYTE  lastPress = 0;
-    static BYTE  lastExpr = 0;
-
-    static DWORD timeOut = 0;
-    if (timeOut)
+    char path[512];
+    char name[512];
+    char adpath[512];
+    getInstancePath(path, name, false);
+    strcat(name, ".map");
+    strcat(path, name);
+    bool found = false;
+    if (getAppDataPath(adpath, "pizmidi"))
     {
-        if (GetTickCount() > timeOut)
-            timeOut = 0;
-        else
-            return; // skip
+        strcat(adpath, name);
+        found = mapping.load(adpath);
     }
+    if (!found && !mapping.load(path))
+        mapping.setDefault();
+    dbg("JoyMapping: " << mapping.numRules() << " rules");
+}
 
-    XINPUT_STATE state;
-    ZeroMemory(&state, sizeof(XINPUT_STATE));
-    SHORT joystick = roundToInt(fXInput * 3.0f); // 0..3
-    if (XInputGetState(joystick, &state) == ERROR_SUCCESS)
-    {
-        if (state.dwPacketNumber != pktNum) // changed
-        {
-            WORD newButtons = state.Gamepad.wButtons;
+//-----------------------------------------------------------------------------------------
+// "Record" captures the raw pad states to midiFromJoystick-<date>-<time>.joyrec in the
+// pizmidi folder of the application data (or next to the plug-in), see JoyRecord.h.
+// A recording can be replayed through JoyReplayInput, e.g. by JoyBench. The parameter
+// only sets a flag (it may change on the audio thread); the poller names, opens and
+// closes the file.
 
-            // output enabled
-            if (fPower >= 0.5f)
-            {
-                WORD changed = newButtons ^ lastButtons;
+void MidiFromJoystick::initRecordPath()
+{
+    char path[512];
+    char name[512];
+    char adpath[512];
+    getInstancePath(path, name, false);
+    if (getAppDataPath(adpath, "pizmidi"))
+        strcpy(path, adpath);
+    strcat(path, name);
+    poller.setRecordFile(path);
+}
 
-                VstMidiEvent me;
-                memset(&me, 0, sizeof(me));
+void MidiFromJoystick::resume()
+{
+    loadMapping();
+    PizMidi::resume();
+}
 
-                SHORT channel = FLOAT_TO_CHANNEL015(fChannel) & 0x0F; //outgoing midi channel
+//-----------------------------------------------------------------------------------------
+// The poller queues every new pad state with the time it was seen. Each one is placed
+// at the matching sample position plus a fixed latency, which keeps the timing of fast
+// presses (a double tap within one block gives two notes) and turns the block size
+// jitter into a constant delay. Events due in a later block are held back.
+// Axis values held back by their minimum interval are placed at the time they are due.
 
-                // handle notes
-                for (DWORD i = 0; ; i++)
-                {
-                    JoyNote note = joyNote[i];
-                    DWORD button = note.button;
-                    if (!button) // terminator found
-                        break;
-
-                    if (button & changed)
-                    {
-                        me.midiData[0] = MIDI_NOTEON | channel;
-                        me.midiData[1] = note.key;
-                        me.midiData[2] = (button & newButtons) ? note.vel : 0x00; // velocity
-                        outputs[0].push_back(me);
-                    }
-                }
+void MidiFromJoystick::processMidiEvents(VstMidiEventVec *inputs, VstMidiEventVec *outputs, VstInt32 sampleFrames)
+{
+    double now = pizTimeNow();
+    clock.update(now, sampleFrames, getSampleRate());
 
-                // handle program change
-                {
-                    SHORT delta = 0;
-                    if (XINPUT_GAMEPAD_LEFT_SHOULDER & changed & newButtons)
-                        delta = -1;
-                    if (XINPUT_GAMEPAD_RIGHT_SHOULDER & changed & newButtons)
-                        delta = 1;
-                    if (XINPUT_GAMEPAD_START & changed & newButtons)
-                        delta = -128;
-
-                    if (delta)
-                    {
-                        progNum += delta;
-                        if (progNum > 127)
-                            progNum = 127;
-                        if (progNum < 0)
-                            progNum = 0;
-
-                        // program change
-                        me.midiData[0] = MIDI_PROGRAMCHANGE | channel;
-                        me.midiData[1] = progNum & 0x7F;
-                        me.midiData[2] = 0;
-                        outputs[0].push_back(me);
-                    }
-                }
+    unsigned pads = getPads();
+    JoyMidiMsg msgs[JOY_MAX_MSGS];
 
-                // handle controllers
-                SHORT pitch = state.Gamepad.sThumbLY; // 16bit
-                if (pitch >= 0)
-                    pitch = (SHORT)linmap(pitch, 1024, (1 << 15), 0, (1 << 13));
-                else
-                    pitch = (SHORT)-linmap(-pitch, 1024, (1 << 15), 0, (1 << 13));
-                pitch += (1 << 13); // 14bit, zero offset
-                if (pitch != lastPitch)
-                {
-                    me.midiData[0] = MIDI_PITCHBEND | channel;
-                    me.midiData[1] =  pitch       & 0x7F; // lsb
-                    me.midiData[2] = (pitch >> 7) & 0x7F; // msb
-                    outputs[0].push_back(me);
-                }
-                lastPitch = pitch;
+    JoyChange ch;
+    while (poller.changes.pop(ch))
+    {
+        if (!(pads & (1u << ch.pad)))
+            continue; // queued before another pad was selected
 
-                BYTE press = state.Gamepad.bRightTrigger / 2; // 7bit
-                if (press != lastPress)
-                {
-                    me.midiData[0] = MIDI_CHANNELPRESSURE | channel;
-                    me.midiData[1] = press & 0x7F;
-                    me.midiData[2] = 0;
-                    outputs[0].push_back(me);
-                }
-                lastPress = press;
+        flushAxes(ch.pad, ch.time);
+        long n = mapping.process(ch.state, padState[ch.pad], getChannel(ch.pad), ch.time, msgs);
+        output(msgs, n, ch.time);
+    }
+    for (int pad = 0; pad < JOY_MAX_PADS; pad++)
+        if (pads & (1u << pad))
+            flushAxes(pad, now);
 
-                BYTE expr = state.Gamepad.bLeftTrigger / 2; // 7bit
-                if (expr != lastExpr)
-                {
-                    me.midiData[0] = MIDI_CONTROLCHANGE | channel;
-                    me.midiData[1] = MIDI_MODULATION_WHEEL; // CC1
-                    me.midiData[2] = expr & 0x7F;
-                    outputs[0].push_back(me);
-                }
-                lastExpr = expr;
+    size_t n = 0;
+    while ((n < queue.size()) && (queue[n].deltaFrames < sampleFrames))
+        outputs[0].push_back(queue[n++]);
 
-            }
+    queue.erase(queue.begin(), queue.begin() + n);
+    for (size_t i = 0; i < queue.size(); i++)
+        queue[i].deltaFrames -= sampleFrames;
+}
 
-            lastButtons = newButtons;
-        }
-    }
-    else
+void MidiFromJoystick::flushAxes(int pad, double until)
+{
+    JoyMidiMsg msgs[JOY_MAX_MSGS];
+    double due;
+    while ((due = mapping.nextDue(padState[pad])) <= until)
     {
-        dbg("XInput Joystick " << (joystick+1) << " not found");
-        timeOut = GetTickCount() + 2000; // 2s
+        long n = mapping.flush(padState[pad], due, getChannel(pad), msgs);
+        output(msgs, n, due);
     }
 }
 
-//-----------------------------------------------------------------------------------------
+void MidiFromJoystick::output(const JoyMidiMsg *msgs, long n, double time)
+{
+    // output enabled
+    if ((fPower < 0.5f) || !n)
+        return;
+
+    double latency = fLatency * 0.1 / clock.samplePeriod(); // 0..100ms in samples
+    double maxDelta = 1.0 / clock.samplePeriod(); // never hold back more than 1s
+    double pos = clock.samplesFromBlockStart(time) + latency;
+    if (pos < 0)
+        pos = 0; // too late, as soon as possible
+    if (pos > maxDelta)
+        pos = maxDelta;
+
+    VstMidiEvent me;
+    memset(&me, 0, sizeof(me));
+    me.deltaFrames = (VstInt32)pos;
+    if (!queue.empty() && (me.deltaFrames < queue.back().deltaFrames))
+        me.deltaFrames = queue.back().deltaFrames; // keep order
+
+    for (long i = 0; i < n; i++)
+    {
+        if (queue.size() >= JOY_QUEUE_SIZE)
+        {
+            queueDropped += n - i;
+            break;
+        }
+        for (int j = 0; j < 3; j++)
+            me.midiData[j] = (char)msgs[i].data[j];
+        queue.push_back(me);
+    }
+}
@@ -0,0 +1,145 @@
+/*-----------------------------------------------------------------------------
+ProgDecoder
+relative encoder decoding of midiProgramChange
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#include "ProgDecoder.h"
+#include "../common/pizvstbase.h"
+#include "../common/PizTextFile.h"
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// the Arturia controls, hardwired in earlier versions
+static const char *defaultRules =
+    "cc 112 bank signmag\n"     // turn category
+    "cc 113 resetbank\n"        // press category
+    "cc 114 program signmag\n"  // turn preset
+    "cc 115 resetprogram\n";    // press preset
+
+struct ProgName
+{
+    const char *name;
+    unsigned char value;
+};
+
+static const ProgName actionNames[] =
+{
+    { "PROGRAM",      ProgDecoder::kProgram },
+    { "BANK",         ProgDecoder::kBank },
+    { "RESETPROGRAM", ProgDecoder::kResetProgram },
+    { "RESETBANK",    ProgDecoder::kResetBank },
+    { "FILTER",       ProgDecoder::kFilter },
+    { "PASS",         ProgDecoder::kPass },
+    { 0, 0 } // terminator
+};
+
+static const ProgName encodingNames[] =
+{
+    { "SIGNMAG", ProgDecoder::kSignMag },
+    { "TWOS",    ProgDecoder::kTwos },
+    { "OFFSET",  ProgDecoder::kOffset },
+    { "INC",     ProgDecoder::kInc },
+    { "DEC",     ProgDecoder::kDec },
+    { 0, 0 } // terminator
+};
+
+static const ProgName curveNames[] =
+{
+    { "NONE",   ProgDecoder::kCurveNone },
+    { "LINEAR", ProgDecoder::kCurveLinear },
+    { "FAST",   ProgDecoder::kCurveFast },
+    { 0, 0 } // terminator
+};
+
+//-------------------------------------------------------------------------------------------------------
+ProgDecoder::ProgDecoder()
+{
+    for (int v = 0; v < 128; v++)
+    {
+        decode[kSignMag][v] = (signed char)((v < 64) ? v : 64 - v);
+        decode[kTwos][v]    = (signed char)((v < 64) ? v : v - 128);
+        decode[kOffset][v]  = (signed char)(v - 64);
+        decode[kInc][v]     = 1;
+        decode[kDec][v]     = -1;
+    }
+    for (int s = 0; s <= 64; s++)
+    {
+        curves[kCurveNone][s]   = (unsigned char)(s ? 1 : 0);
+        curves[kCurveLinear][s] = (unsigned char)s;
+        curves[kCurveFast][s]   = (unsigned char)((s * s < 127) ? s * s : 127);
+    }
+    setDefault();
+}
+
+void ProgDecoder::setDefault()
+{
+    compile(defaultRules);
+}
+
+bool ProgDecoder::load(const char *path)
+{
+    std::vector<char> text;
+    if (!pizLoadText(path, text))
+        return false;
+
+    if (!compile(&text[0]))
+        dbg("ProgDecoder: errors in " << path);
+    return true;
+}
+
+bool ProgDecoder::compile(const char *text)
+{
+    memset(table, 0, sizeof(table)); // kPass
+    rules = 0;
+
+    bool ok = true;
+    PizTextLines lines(text);
+    while (char *line = lines.next())
+    {
+        if (!parseLine(line))
+        {
+            dbg("ProgDecoder: line " << lines.getNumber() << " not understood");
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+bool ProgDecoder::parseLine(char *line)
+{
+    char *pos = line;
+    char *word = pizNextWord(pos);
+    if (!word)
+        return true; // empty line
+
+    long controller;
+    Rule rule = { kPass, kSignMag, kCurveNone };
+    if (strcmp(word, "CC") || !pizParseNumber(pizNextWord(pos), 0, 127, controller)
+        || !(word = pizNextWord(pos)) || !pizFindName(actionNames, word, rule.action))
+        return false;
+
+    long channel = 0; // all
+    bool relative = (rule.action == kProgram) || (rule.action == kBank);
+    while ((word = pizNextWord(pos)) != 0)
+    {
+        if (!strcmp(word, "CHANNEL"))
+        {
+            if (!pizParseNumber(pizNextWord(pos), 1, PROG_NUM_CHANNELS, channel))
+                return false;
+        }
+        else if (relative && !strcmp(word, "ACCEL"))
+        {
+            if (!(word = pizNextWord(pos)) || !pizFindName(curveNames, word, rule.curve))
+                return false;
+        }
+        else if (!relative || !pizFindName(encodingNames, word, rule.encoding))
+            return false;
+    }
+
+    for (int ch = 0; ch < PROG_NUM_CHANNELS; ch++)
+        if (!channel || (ch == channel - 1))
+            table[ch][controller] = rule;
+    rules++;
+    return true;
+}
@@ -0,0 +1,76 @@
+/*-----------------------------------------------------------------------------
+ProgDecoder
+relative encoder decoding of midiProgramChange
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#ifndef PROGDECODER_H
+#define PROGDECODER_H
+
+//-------------------------------------------------------------------------------------------------------
+// Decoder rules, one per line ('#' starts a comment):
+//
+//   cc <controller> program [encoding] [accel <curve>] [channel <1..16>]  steps the program
+//   cc <controller> bank [encoding] [accel <curve>] [channel <1..16>]     steps the bank (program 0)
+//   cc <controller> resetprogram [channel <1..16>]  program 0 on press (value >= 64), release filtered
+//   cc <controller> resetbank [channel <1..16>]     bank and program 0 on press, release filtered
+//   cc <controller> filter [channel <1..16>]        removed
+//   cc <controller> pass [channel <1..16>]          passed through unchanged (as without a rule)
+//
+// encodings of the turn direction and the number of steps (default signmag):
+//   signmag   1..63 up, 65..127 down by value - 64 (Arturia)
+//   twos      1..63 up, 127..64 down by 128 - value (two's complement)
+//   offset    65..127 up by value - 64, 63..0 down by 64 - value (binary offset)
+//   inc, dec  one step up (or down) per message, for increment/decrement pairs
+// curves of the steps (default none):
+//   none      one step per message, whatever the encoder sends
+//   linear    as many steps as the encoder sends
+//   fast      steps squared, for fast turns
+//
+// Without a channel, a rule applies to all channels; later rules override earlier ones.
+// The rules are compiled into a flat table per channel and controller, so decoding a
+// controller costs one lookup whatever the number of rules. A value of 0 steps (e.g. 64 in
+// offset encoding) is not a turn and passes through unchanged, as any other controller.
+
+#define PROG_NUM_CHANNELS 16
+
+class ProgDecoder
+{
+public:
+    enum { kPass, kFilter, kProgram, kBank, kResetProgram, kResetBank };
+    enum { kSignMag, kTwos, kOffset, kInc, kDec, kNumEncodings };
+    enum { kCurveNone, kCurveLinear, kCurveFast, kNumCurves };
+
+    struct Rule
+    {
+        unsigned char action;   // k...
+        unsigned char encoding; // relative actions only
+        unsigned char curve;
+    };
+
+    ProgDecoder();
+
+    bool compile(const char *text); // false if a line was not understood (the others are used)
+    bool load(const char *path);    // false if not found
+    void setDefault();              // the Arturia controls of earlier versions
+
+    const Rule& getRule(int channel, int controller) const { return table[channel & 0x0F][controller & 0x7F]; }
+
+    // signed steps of a relative rule for a controller value
+    int getSteps(const Rule& rule, int value) const
+    {
+        int d = decode[rule.encoding][value & 0x7F];
+        return (d < 0) ? -curves[rule.curve][-d] : curves[rule.curve][d];
+    }
+
+    long numRules() const { return rules; }
+
+private:
+    bool parseLine(char *line);
+
+    Rule table[PROG_NUM_CHANNELS][128];
+    signed char decode[kNumEncodings][128]; // value -> -64..63
+    unsigned char curves[kNumCurves][65];   // |steps| -> steps
+    long rules;
+};
+
+#endif
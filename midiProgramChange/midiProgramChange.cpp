@@ -4,14 +4,16 @@ original framework by Reuben Vinal
 specific implementation by H.R.Graf
 -----------------------------------------------------------------------------*/
 #include "../common/PizMidi.h"
+#include "ProgDecoder.h"
 
 enum
 {
     kPower,
+    kCoalesce,
 
     kNumParams,
     kNumMidiCh = 16,
-    kNumPrograms = 1 // built-in configuration for Arturia MIDI keyboards
+    kNumPrograms = 1 // built-in configuration for Arturia MIDI keyboards, see ProgDecoder.h
 };
 
 //-----------------------------------------------------------------------------
@@ -23,6 +25,7 @@ public:
     ~MidiProgramChangeProgram() {}
 private:
     float fPower;
+    float fCoalesce;
     char name[kVstMaxProgNameLen];
 };
 
@@ -43,17 +46,37 @@ public:
     virtual void   getParameterDisplay(VstInt32 index, char *text);
     virtual void   getParameterName(VstInt32 index, char *text);
 
+    virtual void   resume();
+
 protected:
     float fPower;
+    float fCoalesce;
 
     short progNum[kNumMidiCh]; // individual for every MIDI channel
-    short bankNum[kNumMidiCh]; // individual for every MIDI channel
+    short bankNum[kNumMidiCh]; // individual for every MIDI channel, 0..16383 (MSB * 128 + LSB)
+    short sentMsb[kNumMidiCh]; // bank select as last seen by the receiver, -1 unknown
+    short sentLsb[kNumMidiCh];
+    long  pendWait[kNumMidiCh]; // samples from block start until the coalesced change is sent, -1 for none
+    bool  pendBank[kNumMidiCh]; // with a bank change
 
     virtual void processMidiEvents(VstMidiEventVec *inputs, VstMidiEventVec *outputs, VstInt32 sampleFrames);
 
     MidiProgramChangeProgram *programs;
+
+private:
+    void loadDecoder();
+    long getSettle(); // samples, -1 off, 0 end of block
+    void sendChange(VstMidiEventVec& out, int channel, bool bank, VstInt32 deltaFrames);
+    void sendPending(VstMidiEventVec& out, VstInt32 until);
+
+    ProgDecoder decoder;
 };
 
+//-------------------------------------------------------------------------------------------------------
+// settle times of "Coalesce", ms
+static const long settleTimes[] = { -1, 0, 20, 50, 100, 200, 500 }; // off, end of block, ...
+#define NUM_SETTLE_TIMES (sizeof(settleTimes) / sizeof(settleTimes[0]))
+
 //-------------------------------------------------------------------------------------------------------
 AudioEffect* createEffectInstance(audioMasterCallback audioMaster) 
 {
@@ -64,6 +87,7 @@ MidiProgramChangeProgram::MidiProgramChangeProgram()
 {
     // default Program Values
     fPower = 1.0f;
+    fCoalesce = 0.0f; // off
 
     // default program name
     strcpy(name, "Default");
@@ -78,6 +102,10 @@ MidiProgramChange::MidiProgramChange(audioMasterCallback audioMaster)
     {
         progNum[i] = 0;
         bankNum[i] = 0;
+        pendWait[i] = -1;
+        pendBank[i] = false;
+        sentMsb[i] = -1;
+        sentLsb[i] = -1;
     }
 
     programs = new MidiProgramChangeProgram[numPrograms];
@@ -88,6 +116,7 @@ MidiProgramChange::MidiProgramChange(audioMasterCallback audioMaster)
             if ((VstInt32)defaultBank->GetFxID() == PLUG_IDENT) {
                 for (int i = 0; i < kNumPrograms; i++) {
                     programs[i].fPower = defaultBank->GetProgParm(i, 0);
+                    programs[i].fCoalesce = defaultBank->GetProgParm(i, 1);
                     strcpy(programs[i].name, defaultBank->GetProgramName(i));
                 }
             }
@@ -109,6 +138,7 @@ MidiProgramChange::MidiProgramChange(audioMasterCallback audioMaster)
         setProgram(0);
     }
 
+    loadDecoder();
     init();
 }
 
@@ -127,6 +157,7 @@ void MidiProgramChange::setProgram(VstInt32 program)
 
     curProgram = program;
     setParameter(kPower, ap->fPower);
+    setParameter(kCoalesce, ap->fCoalesce);
 }
 
 //------------------------------------------------------------------------
@@ -159,6 +190,7 @@ void MidiProgramChange::setParameter(VstInt32 index, float value)
 
     switch (index) {
     case kPower:    fPower  = ap->fPower  = value;  break;
+    case kCoalesce: fCoalesce = ap->fCoalesce = value; break;
     }
 }
 
@@ -169,6 +201,7 @@ float MidiProgramChange::getParameter(VstInt32 index)
 
     switch (index) {
     case kPower:     v = fPower;   break;
+    case kCoalesce:  v = fCoalesce; break;
     }
     return v;
 }
@@ -178,6 +211,7 @@ void MidiProgramChange::getParameterName(VstInt32 index, char *label)
 {
     switch (index) {
     case kPower:    strcpy(label, "Power");       break;
+    case kCoalesce: strcpy(label, "Coalesce");    break;
     }
 }
 
@@ -191,23 +225,132 @@ void MidiProgramChange::getParameterDisplay(VstInt32 index, char *text)
         else
             strcpy(text, "on"); 
         break;
+    case kCoalesce:
+    {
+        long ms = settleTimes[roundToInt(fCoalesce * (NUM_SETTLE_TIMES - 1))];
+        if (ms < 0)
+            strcpy(text, "off");
+        else if (ms == 0)
+            strcpy(text, "block");
+        else
+            sprintf(text, "%ld ms", ms);
+        break;
+    }
     }
 }
 
-//-----------------------------------------------------------------------------
-// Arturia Control Change Constants
+//-----------------------------------------------------------------------------------------
+void MidiProgramChange::resume()
+{
+    // the receiver may have been reset meanwhile, and a change held back for coalescing
+    // would come out with a stale wait (counted from a block before the pause)
+    for (int i = 0; i < kNumMidiCh; i++)
+    {
+        sentMsb[i] = -1;
+        sentLsb[i] = -1;
+        pendWait[i] = -1;
+        pendBank[i] = false;
+    }
+    loadDecoder();
+    PizMidi::resume();
+}
 
-#define CC_ID_TURN_CAT          112
-#define CC_ID_PRESS_CAT         113
-#define CC_ID_TURN_PRESET       114
-#define CC_ID_PRESS_PRESET      115
+//-----------------------------------------------------------------------------------------
+// The decoder rules are read from midiProgramChange.map (next to the plug-in, or in the
+// pizmidi folder of the application data, like the default bank), see ProgDecoder.h.
+// Without a file, the Arturia controls are decoded. The file is read again on every
+// resume, so another keyboard can be set up without restarting the host.
 
-#define CC_VAL_TURN_INC           1
-#define CC_VAL_TURN_DEC          65
+void MidiProgramChange::loadDecoder()
+{
+    char path[512];
+    char name[512];
+    char adpath[512];
+    getInstancePath(path, name, false);
+    strcat(name, ".map");
+    strcat(path, name);
+    bool found = false;
+    if (getAppDataPath(adpath, "pizmidi"))
+    {
+        strcat(adpath, name);
+        found = decoder.load(adpath);
+    }
+    if (!found && !decoder.load(path))
+        decoder.setDefault();
+    dbg("ProgDecoder: " << decoder.numRules() << " rules");
+}
 
-#define CC_VAL_PRESS_DOWN       127
-#define CC_VAL_PRESS_RELEASE      0
+long MidiProgramChange::getSettle()
+{
+    long ms = settleTimes[roundToInt(fCoalesce * (NUM_SETTLE_TIMES - 1))];
+    if (ms <= 0)
+        return ms;
+    return (long)(ms * 0.001 * getSampleRate()) + 1;
+}
+
+void MidiProgramChange::sendChange(VstMidiEventVec& out, int channel, bool bank, VstInt32 deltaFrames)
+{
+    VstMidiEvent me;
+    memset(&me, 0, sizeof(me));
+    me.deltaFrames = deltaFrames;
+
+    // bank select MSB and LSB, only those the receiver does not have yet
+    short msb = (bankNum[channel] >> 7) & 127;
+    short lsb = bankNum[channel] & 127;
+    if (bank && (msb != sentMsb[channel]))
+    {
+        me.midiData[0] = MIDI_CONTROLCHANGE | channel;
+        me.midiData[1] = MIDI_BANK_CHANGE;
+        me.midiData[2] = (char)msb;
+        out.push_back(me);
+        sentMsb[channel] = msb;
+    }
+    if (bank && (lsb != sentLsb[channel]))
+    {
+        me.midiData[0] = MIDI_CONTROLCHANGE | channel;
+        me.midiData[1] = MIDI_BANK_CHANGE | MIDI_LSB;
+        me.midiData[2] = (char)lsb;
+        out.push_back(me);
+        sentLsb[channel] = lsb;
+    }
+
+    me.midiData[0] = MIDI_PROGRAMCHANGE | channel;
+    me.midiData[1] = progNum[channel] & 127;
+    me.midiData[2] = 0;
+    out.push_back(me);
+}
+
+// coalesced changes due up to sample position until, in time order
+void MidiProgramChange::sendPending(VstMidiEventVec& out, VstInt32 until)
+{
+    while (true)
+    {
+        int next = -1;
+        for (int ch = 0; ch < kNumMidiCh; ch++)
+            if ((pendWait[ch] >= 0) && (pendWait[ch] <= until) && ((next < 0) || (pendWait[ch] < pendWait[next])))
+                next = ch;
+        if (next < 0)
+            return;
+
+        if (fPower >= 0.5f)
+            sendChange(out, next, pendBank[next], pendWait[next]);
+        pendWait[next] = -1;
+        pendBank[next] = false;
+    }
+}
 
+//-----------------------------------------------------------------------------
+// Every controller is looked up in the decoder table of its channel; controllers without
+// a rule pass through.
+//
+// With "Coalesce" on, turning the knob only updates the program (and bank) kept per channel;
+// a single change with the final values is sent at the end of the block or once the knob
+// has rested for the settle time, so that the receiver does not start loading every patch
+// on the way. A press (reset) is sent right away, together with a bank change still pending.
+//
+// Banks are addressed with 14 bits (bank select MSB and LSB). Of the two, only the byte which
+// differs from what the receiver got last is sent, so a turn within the same MSB costs one
+// controller and a program reset none.
 
 void MidiProgramChange::processMidiEvents(VstMidiEventVec *inputs, VstMidiEventVec *outputs, VstInt32 sampleFrames)
 {
@@ -216,6 +359,7 @@ void MidiProgramChange::processMidiEvents(VstMidiEventVec *inputs, VstMidiEventV
     {
         //copying event "i" from input (with all its fields)
         VstMidiEvent me = inputs[0][i];
+        sendPending(outputs[0], me.deltaFrames);
 
         short status  = me.midiData[0] & 0xF0;  // scraping  channel
         short channel = me.midiData[0] & 0x0F;  // isolating channel (0-15)
@@ -224,70 +368,68 @@ void MidiProgramChange::processMidiEvents(VstMidiEventVec *inputs, VstMidiEventV
 
         short filter = 0;
         short change = 0;
+        bool  press  = false;
         short num    = progNum[channel];
         short bank   = bankNum[channel];
 
         if (status == MIDI_CONTROLCHANGE)
         {
-            short id  = me.midiData[1] & 0x7f;
             short val = me.midiData[2] & 0x7f;
+            const ProgDecoder::Rule& rule = decoder.getRule(channel, me.midiData[1]);
 
-            if (id == CC_ID_TURN_PRESET)
+            switch (rule.action)
             {
-                if (val == CC_VAL_TURN_INC)
-                {
-                    change = 1;
-                    if (num < 127)
-                      num++;
-                }
-                else if (val == CC_VAL_TURN_DEC)
-                {
-                    change = 1;
-                    if (num > 0)
-                        num--;
-                }
+            case ProgDecoder::kProgram:
+            {
+                int steps = decoder.getSteps(rule, val);
+                if (!steps)
+                    break; // not a turn, passed through
+                change = 1;
+                num += steps;
+                if (num < 0)
+                    num = 0;
+                if (num > 127)
+                    num = 127;
+                break;
             }
-            else if (id == CC_ID_PRESS_PRESET)
+            case ProgDecoder::kBank:
             {
-                if (val == CC_VAL_PRESS_DOWN)
+                int steps = decoder.getSteps(rule, val);
+                if (!steps)
+                    break; // not a turn, passed through
+                change = 2;
+                num    = 0;
+                bank  += steps;
+                if (bank < 0)
+                    bank = 0;
+                if (bank > 16383)
+                    bank = 16383;
+                break;
+            }
+            case ProgDecoder::kResetProgram:
+                if (val >= 64) // press
                 {
+                    press  = true;
                     change = 1;
                     num    = 0;
                 }
-                else if (val == CC_VAL_PRESS_RELEASE)
-                {
+                else
                     filter = 1;
-                }
-            }
-            else if (id == CC_ID_TURN_CAT)
-            {
-                if (val == CC_VAL_TURN_INC)
-                {
-                    change = 2;
-                    num    = 0;
-                    if (bank < 127)
-                        bank++;
-                }
-                else if (val == CC_VAL_TURN_DEC)
-                {
-                    change = 2;
-                    num = 0;
-                    if (bank > 0)
-                        bank--;
-                }
-            }
-            else if (id == CC_ID_PRESS_CAT)
-            {
-                if (val == CC_VAL_PRESS_DOWN)
+                break;
+            case ProgDecoder::kResetBank:
+                if (val >= 64)
                 {
+                    press  = true;
                     change = 2;
                     num    = 0;
                     bank   = 0;
                 }
-                else if (val == CC_VAL_PRESS_RELEASE)
-                {
+                else
                     filter = 1;
-                }
+                break;
+            case ProgDecoder::kFilter:
+                filter = 1;
+                break;
             }
 
             progNum[channel] = num; // write back
@@ -296,25 +438,38 @@ void MidiProgramChange::processMidiEvents(VstMidiEventVec *inputs, VstMidiEventV
 
         if (change && (fPower >= 0.5f))
         {
-            if (change == 2) // bank change
+            long settle = getSettle();
+            bool withBank = (change == 2) || pendBank[channel];
+            if ((settle < 0) || press)
             {
-                me.midiData[0] = MIDI_CONTROLCHANGE | channel;
-                me.midiData[1] = MIDI_BANK_CHANGE | MIDI_LSB;
-                me.midiData[2] = bank & 127;
-                me.midiData[3] = 0;
-                outputs[0].push_back(me);
+                pendWait[channel] = -1;
+                pendBank[channel] = false;
+                sendChange(outputs[0], channel, withBank, me.deltaFrames);
             }
-
-            // program change
-            me.midiData[0] = MIDI_PROGRAMCHANGE | channel;
-            me.midiData[1] = num & 127;
-            me.midiData[2] = 0;
-            me.midiData[3] = 0;
+            else
+            {
+                // restarted by every turn
+                pendWait[channel] = settle ? me.deltaFrames + settle : sampleFrames - 1;
+                pendBank[channel] = withBank;
+            }
+            filter = 1; // replaced by the program change
         }
 
         if (! filter)
+        {
+            // bank selects passed through are seen by the receiver as well
+            if ((status == MIDI_CONTROLCHANGE) && (me.midiData[1] == MIDI_BANK_CHANGE))
+                sentMsb[channel] = me.midiData[2] & 0x7f;
+            else if ((status == MIDI_CONTROLCHANGE) && (me.midiData[1] == (MIDI_BANK_CHANGE | MIDI_LSB)))
+                sentLsb[channel] = me.midiData[2] & 0x7f;
             outputs[0].push_back(me);
+        }
     }
+
+    sendPending(outputs[0], sampleFrames - 1);
+    for (int ch = 0; ch < kNumMidiCh; ch++)
+        if (pendWait[ch] >= 0)
+            pendWait[ch] -= sampleFrames;
 }
 
 //-----------------------------------------------------------------------------
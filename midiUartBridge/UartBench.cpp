@@ -0,0 +1,1164 @@
+/*-----------------------------------------------------------------------------
+UartBench
+loopback soak benchmark of the midiUartBridge I/O worker
+by H.R.Graf
+
+Drives the worker (scheduler, serial backend and parser) the way the plug-in's
+audio thread does, block by block, against a device model on the other end of a
+pseudo-terminal. The model emulates the wire at the selected baud rate (a pty
+itself ignores it), decodes what arrives and echoes every byte back, so the
+receive path is loaded as well. Reported per workload, protocol, baud rate and
+block size:
+
+  ev/s     messages delivered to the device per second (sysex dumps count once)
+  eff      MIDI bytes delivered / bytes on the wire
+  p50..max delay of delivered messages behind their scheduled time in ms
+           (sysex excluded, for the clock and flood workloads the clock or notes only)
+  merged   controller values superseded in the transmit queue
+  dropped  queue or sysex buffer overflow
+  lost     sent, but neither delivered nor merged (or still queued 1 s after the run)
+  rx       echoed messages received back by the worker
+
+Workloads are generated from the block times only (no randomness), so runs are
+reproducible apart from the scheduling of the host OS.
+
+The same tool is the test rig of the serial backend, playing the device side on a pty:
+
+  rig echo [protocol]              echoes all bytes, for the plug-in itself with
+  rig generate [msg/s] [protocol]  PIZMIDI_UART_PORTS set to the printed path, or sends
+                                   notes (and counts what comes back), until Ctrl-C
+  parse [messages] [protocol]      checks the worker's parser: the device sends all kinds
+                                   of channel messages with clock in between (inside messages
+                                   with raw MIDI) and damages every 97th (a byte dropped, or
+                                   a frame corrupted). Every undamaged message has to arrive
+                                   unchanged and in order, a damage may corrupt at most one
+                                   message and lose clocks only next to it (framed: none
+                                   corrupt, no clock lost); prints throughput and latency.
+  negotiate                        runs the baud rate negotiation against a device answering
+                                   F5 (raw MIDI): each rate of the list, a device without
+                                   negotiation, one refusing a rate and one failing at it.
+                                   The device hears the bridge only while the pty is set to
+                                   its own rate, and the chosen rate has to pass a probe.
+
+protocol: raw, cables or framed (default raw)
+
+Build (POSIX, with the VST SDK on the include path like the plug-in):
+  g++ -O2 -std=c++14 -I<vstsdk2.4> UartBench.cpp UartWorker.cpp UartSerial.cpp -lpthread -lutil -o uartbench
+Run:
+  ./uartbench [seconds per run (0.3)] [workload]
+  ./uartbench rig|parse|negotiate ...
+-----------------------------------------------------------------------------*/
+#include "UartWorker.h"
+#include "../common/PizClock.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <map>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <termios.h>
+#include <signal.h>
+#if defined(__APPLE__)
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+
+#define BENCH_SAMPLE_RATE 48000.0
+#define BENCH_TX_LATENCY  0.005 // as the plug-in's default "TX Latency"
+
+static unsigned int makeKey(const unsigned char *msg)
+{
+    short len = getUartMsgLen(msg[0]);
+    unsigned int key = msg[0] << 16;
+    if (len > 1) key |= msg[1] << 8;
+    if (len > 2) key |= msg[2];
+    return key;
+}
+
+// messages of one lane are delivered in order, on the value lane the latest value only
+static unsigned int getLane(unsigned int key)
+{
+    switch ((key >> 16) & 0xF0)
+    {
+    case MIDI_CONTROLCHANGE:
+    case MIDI_POLYKEYPRESSURE: return key & 0xFFFF00;
+    case MIDI_PITCHBEND:
+    case MIDI_CHANNELPRESSURE: return key & 0xFF0000;
+    }
+    return key;
+}
+
+//-------------------------------------------------------------------------------------------------------
+// The device end: emulates the wire (one byte every 10 bits), decodes the protocol and echoes.
+
+struct Delivery
+{
+    unsigned int key;
+    double time; // on the wire
+};
+
+class DeviceModel
+{
+public:
+    DeviceModel(int fd, int protocol, long baud)
+        : wireBytes(0), midiBytes(0), sysexBytes(0), badFrames(0),
+          fd(fd), protocol(protocol), byteTime(10.0 / baud), quit(false),
+          wireEnd(0), echoEnd(0), echoPos(0), status(0), pos(0), len(0), inSysex(false), sysexPos(0), sysexId(0), framePos(0) {}
+
+    void start() { thread = std::thread(&DeviceModel::run, this); }
+    void stop()  { quit = true; thread.join(); }
+
+    std::vector<Delivery> deliveries; // read after stop()
+    long wireBytes;
+    long midiBytes;  // of the delivered messages
+    long sysexBytes;
+    long badFrames;
+
+private:
+    struct Echo { double time; unsigned char c; };
+
+    void run();
+    void received(unsigned char c, double time);
+    void message(const unsigned char *msg, short n, double time);
+    void sysex(const unsigned char *bytes, short n, double time);
+    void frame(double time);
+
+    int fd;
+    int protocol;
+    double byteTime;
+    std::atomic<bool> quit;
+    std::thread thread;
+
+    double wireEnd; // when the last byte received is through
+    double echoEnd;
+    std::vector<Echo> echo; // bytes to send back, in time order
+    size_t echoPos;
+
+    unsigned char msg[4]; // raw MIDI and cables
+    unsigned char status;
+    short pos;
+    short len;
+    bool  inSysex;
+    long  sysexPos;
+    unsigned char sysexId; // first data byte of the dump, identifies it
+    unsigned char frameBuf[UART_FRAME_ENCODED];
+    short framePos;
+};
+
+void DeviceModel::run()
+{
+    unsigned char buf[1024];
+    while (!quit)
+    {
+        double now = pizTimeNow();
+
+        // echo what is due, paced like the wire
+        size_t n = 0;
+        unsigned char out[1024];
+        while ((echoPos < echo.size()) && (echo[echoPos].time <= now) && (n < sizeof(out)))
+            out[n++] = echo[echoPos++].c;
+        if (n && (write(fd, out, n) < 0))
+            break;
+        if (echoPos == echo.size())
+        {
+            echo.clear();
+            echoPos = 0;
+        }
+
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        ::poll(&pfd, 1, 1);
+        long got = read(fd, buf, sizeof(buf));
+        now = pizTimeNow();
+        for (long i = 0; i < got; i++)
+        {
+            wireEnd = std::max(wireEnd, now) + byteTime;
+            wireBytes++;
+            received(buf[i], wireEnd);
+
+            echoEnd = std::max(echoEnd, wireEnd) + byteTime;
+            Echo e = { echoEnd, buf[i] };
+            echo.push_back(e);
+        }
+    }
+}
+
+void DeviceModel::message(const unsigned char *m, short n, double time)
+{
+    Delivery d = { makeKey(m), time };
+    deliveries.push_back(d);
+    midiBytes += n;
+}
+
+void DeviceModel::sysex(const unsigned char *bytes, short n, double time)
+{
+    for (short i = 0; i < n; i++)
+    {
+        unsigned char c = bytes[i];
+        sysexBytes++;
+        if (c == MIDI_SYSEX)
+        {
+            inSysex = true;
+            sysexPos = 0;
+        }
+        else if (inSysex && (sysexPos++ == 0))
+            sysexId = c;
+        if ((c == MIDI_EOX) && inSysex)
+        {
+            Delivery d = { (unsigned int)((MIDI_SYSEX << 16) | (sysexId << 8)), time };
+            deliveries.push_back(d);
+            inSysex = false;
+        }
+    }
+}
+
+void DeviceModel::received(unsigned char c, double time)
+{
+    if (protocol == kUartFramed)
+    {
+        if (c != 0)
+        {
+            if (framePos < UART_FRAME_ENCODED)
+                frameBuf[framePos++] = c;
+            return;
+        }
+        frame(time);
+        framePos = 0;
+        return;
+    }
+
+    if (protocol == kUartCables)
+    {
+        msg[pos++] = c;
+        if (pos < UART_CABLE_PACKET)
+            return;
+        pos = 0;
+        int cin = msg[0] & 0x0F;
+        if ((cin >= 4) && (cin <= 7)) // sysex
+            sysex(&msg[1], (cin == 4) ? 3 : cin - 4, time);
+        else if (isCablePacket(msg))
+            message(&msg[1], getUartMsgLen(msg[1]), time);
+        else
+            badFrames++;
+        return;
+    }
+
+    // raw MIDI
+    if (isRealTime(c))
+    {
+        message(&c, 1, time);
+        return;
+    }
+    if ((c == MIDI_SYSEX) || ((c == MIDI_EOX) && inSysex) || (inSysex && !(c & 0x80)))
+    {
+        sysex(&c, 1, time);
+        return;
+    }
+    if (c & 0x80)
+    {
+        status = c;
+        len = getUartMsgLen(c);
+        msg[0] = c;
+        pos = 1;
+    }
+    else if ((pos > 0) && (pos < len))
+        msg[pos++] = c;
+    if ((len > 0) && (pos == len))
+    {
+        message(msg, len, time);
+        pos = 0;
+    }
+}
+
+void DeviceModel::frame(double time)
+{
+    unsigned char pkt[UART_FRAME_ENCODED];
+    long n = cobsDecode(frameBuf, framePos, pkt);
+    if ((n < UART_FRAME_HEADER + 2) || (uartCrc16(pkt, n - 2) != (pkt[n - 2] | (pkt[n - 1] << 8))))
+    {
+        badFrames++;
+        return;
+    }
+    n -= 2;
+    for (long i = UART_FRAME_HEADER; i + 1 < n; )
+    {
+        unsigned char s = pkt[i + 1];
+        if (s == MIDI_SYSEX) // fragment
+        {
+            short k = pkt[i + 2];
+            sysex(&pkt[i + 3], k, time);
+            i += 3 + k;
+            continue;
+        }
+        short k = getUartMsgLen(s);
+        if ((k <= 0) || (i + 1 + k > n))
+            break;
+        message(&pkt[i + 1], k, time);
+        i += 1 + k;
+    }
+}
+
+//-------------------------------------------------------------------------------------------------------
+// One run: the "audio thread" hands each block's events to the worker at the block start.
+
+struct Sent
+{
+    unsigned int key;
+    double time; // scheduled
+};
+
+class Bench
+{
+public:
+    Bench(UartWorker& io, double start) : io(io), start(start), dumps(0) {}
+
+    void send(const unsigned char *msg, short len, double t) // t: seconds after start
+    {
+        Sent s = { makeKey(msg), start + t + BENCH_TX_LATENCY };
+        sent.push_back(s);
+        io.send(0, (const char *)msg, len, s.time);
+    }
+
+    void sendSysex(long len, double t)
+    {
+        std::vector<unsigned char> dump(len, 0x55);
+        dump[0] = MIDI_SYSEX;
+        dump[1] = (unsigned char)(dumps++ & 0x7F);
+        dump[len - 1] = MIDI_EOX;
+        Sent s = { (unsigned int)((MIDI_SYSEX << 16) | (dump[1] << 8)), start + t };
+        sent.push_back(s);
+        io.sendSysex(0, &dump[0], len);
+    }
+
+    UartWorker& io;
+    double start;
+    long dumps;
+    std::vector<Sent> sent;
+};
+
+// events with times in [t0, t1), n per second, as event k at k / n
+#define FOR_EVENTS(rate) for (long k = (long)ceil(t0 * (rate)); k < (long)ceil(t1 * (rate)); k++)
+
+static void notes(Bench& b, double t0, double t1) // 3000 notes/s on one channel, on and off
+{
+    FOR_EVENTS(3000)
+    {
+        unsigned char m[3] = { (unsigned char)((k & 1) ? MIDI_NOTEOFF : MIDI_NOTEON), (unsigned char)(36 + (k / 2) % 64), 100 };
+        b.send(m, 3, k / 3000.0);
+    }
+}
+
+static void sweeps(Bench& b, double t0, double t1) // 8 controllers, each at 1 kHz
+{
+    FOR_EVENTS(1000)
+    {
+        for (int cc = 0; cc < 8; cc++)
+        {
+            unsigned char m[3] = { MIDI_CONTROLCHANGE, (unsigned char)(16 + cc), (unsigned char)((k + cc * 16) & 0x7F) };
+            b.send(m, 3, k / 1000.0);
+        }
+    }
+}
+
+static void dumps(Bench& b, double t0, double t1) // 1 KB dump every 100 ms, 100 notes/s in between
+{
+    FOR_EVENTS(10)
+        b.sendSysex(1024, k / 10.0);
+    FOR_EVENTS(100)
+    {
+        unsigned char m[3] = { (unsigned char)((k & 1) ? MIDI_NOTEOFF : MIDI_NOTEON), (unsigned char)(48 + (k / 2) % 24), 100 };
+        b.send(m, 3, k / 100.0);
+    }
+}
+
+static void clocks(Bench& b, double t0, double t1) // 24 ppq at 120 bpm, under 4 controllers at 1 kHz
+{
+    FOR_EVENTS(48)
+    {
+        unsigned char m[1] = { MIDI_TIMINGCLOCK };
+        b.send(m, 1, k / 48.0);
+    }
+    FOR_EVENTS(1000)
+    {
+        for (int cc = 0; cc < 4; cc++)
+        {
+            unsigned char m[3] = { MIDI_CONTROLCHANGE, (unsigned char)(16 + cc), (unsigned char)(k & 0x7F) };
+            b.send(m, 3, k / 1000.0);
+        }
+    }
+}
+
+static void flood(Bench& b, double t0, double t1) // 200 notes/s under 8 controllers at 1 kHz
+{
+    FOR_EVENTS(200)
+    {
+        unsigned char m[3] = { (unsigned char)((k & 1) ? MIDI_NOTEOFF : MIDI_NOTEON), (unsigned char)(36 + (k / 2) % 64), 100 };
+        b.send(m, 3, k / 200.0);
+    }
+    sweeps(b, t0, t1);
+}
+
+struct Workload
+{
+    const char *name;
+    void (*generate)(Bench& b, double t0, double t1);
+};
+
+static const Workload workloads[] =
+{
+    { "notes",  notes  },
+    { "sweeps", sweeps },
+    { "sysex",  dumps  },
+    { "clock",  clocks },
+    { "flood",  flood  },
+};
+
+//-------------------------------------------------------------------------------------------------------
+
+static double percentile(std::vector<double>& v, double p)
+{
+    if (v.empty())
+        return 0;
+    size_t i = std::min(v.size() - 1, (size_t)(p * v.size()));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+static bool runOnce(const Workload& w, int protocol, long baud, long block, double seconds)
+{
+    int master, slave;
+    char name[128];
+    if (openpty(&master, &slave, name, 0, 0) != 0)
+    {
+        perror("openpty");
+        return false;
+    }
+    struct termios tio;
+    tcgetattr(master, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(master, TCSANOW, &tio);
+    fcntl(master, F_SETFL, O_NONBLOCK);
+
+    UartWorker io;
+    io.setProtocol(protocol);
+    io.start(0);
+    UartSerial *port = UartSerial::create();
+    if (!port->open(name, baud))
+        return false;
+    io.attach(0, port, baud);
+
+    DeviceModel device(master, protocol, baud);
+    device.start();
+
+    // audio thread
+    double blockTime = block / BENCH_SAMPLE_RATE;
+    double start = pizTimeNow() + 0.01;
+    Bench b(io, start);
+    long rx = 0;
+    long blocks = (long)(seconds / blockTime);
+    for (long i = 0; i < blocks; i++)
+    {
+        double t0 = i * blockTime;
+        double wait = start + t0 - pizTimeNow();
+        if (wait > 0)
+            std::this_thread::sleep_for(std::chrono::microseconds((long)(wait * 1e6)));
+        w.generate(b, t0, t0 + blockTime);
+
+        UartRxEvent ev;
+        while (io.rx.pop(ev))
+            rx++;
+    }
+
+    // drain, at most 1 s
+    double end = pizTimeNow() + 1.0;
+    while ((io.txQueue(0).depth > 0 || io.sysexTx(0).pending() > 0) && (pizTimeNow() < end))
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    UartRxEvent ev;
+    while (io.rx.pop(ev))
+        rx++;
+
+    device.stop();
+    long merged = io.txQueue(0).merged;
+    long dropped = io.txQueue(0).dropped + io.sysexTx(0).rejected;
+    io.attach(0, 0);
+    io.stop();
+    port->close();
+    delete port;
+    close(master);
+    close(slave);
+
+    // match deliveries to what was sent: other messages in order per message, controllers
+    // per controller, where the value delivered supersedes the ones before it and the delay
+    // counts from the oldest of them (how long the device lagged behind)
+    std::map<unsigned int, std::vector<Sent> > pending;
+    for (size_t i = 0; i < b.sent.size(); i++)
+        pending[getLane(b.sent[i].key)].push_back(b.sent[i]);
+    std::map<unsigned int, size_t> next;
+
+    bool clockOnly = (w.generate == clocks);
+    bool notesOnly = (w.generate == flood);
+    std::vector<double> delays;
+    long delivered = 0;
+    for (size_t i = 0; i < device.deliveries.size(); i++)
+    {
+        const Delivery& d = device.deliveries[i];
+        std::vector<Sent>& lane = pending[getLane(d.key)];
+        size_t& j = next[getLane(d.key)];
+        size_t k = j;
+        while ((k < lane.size()) && (lane[k].key != d.key))
+            k++;
+        if (k == lane.size())
+            continue; // not sent by us
+        delivered++;
+        bool sysex = ((d.key >> 16) == MIDI_SYSEX);
+        int type = (d.key >> 16) & 0xF0;
+        if (!sysex && (!clockOnly || ((d.key >> 16) == MIDI_TIMINGCLOCK))
+            && (!notesOnly || (type == MIDI_NOTEON) || (type == MIDI_NOTEOFF)))
+            delays.push_back((d.time - lane[j].time) * 1e3);
+        j = k + 1;
+    }
+    long lost = (long)b.sent.size() - delivered - merged - dropped;
+
+    printf("%-7s %-7s %8ld %6ld %8.0f %5.2f %7.2f %7.2f %7.2f %7.2f %7ld %7ld %6ld %7ld\n",
+           w.name, getUartProtocolName(protocol), baud, block,
+           delivered / seconds, device.wireBytes ? (double)(device.midiBytes + device.sysexBytes) / device.wireBytes : 0,
+           percentile(delays, 0.5), percentile(delays, 0.9), percentile(delays, 0.99), percentile(delays, 1.0),
+           merged, dropped, std::max(lost, 0L), rx);
+    if (device.badFrames)
+        printf("        %ld damaged packets\n", device.badFrames);
+    return true;
+}
+
+
+//-------------------------------------------------------------------------------------------------------
+// Test rig: the device end of a pty pair, encoding like the device does.
+
+static volatile sig_atomic_t interrupted = 0;
+static void onInterrupt(int) { interrupted = 1; }
+
+struct PtyPair
+{
+    PtyPair() : master(-1), slave(-1) { name[0] = 0; }
+    ~PtyPair() { close(); }
+
+    bool open()
+    {
+        if (openpty(&master, &slave, name, 0, 0) != 0)
+        {
+            perror("openpty");
+            return false;
+        }
+        struct termios tio;
+        tcgetattr(master, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(master, TCSANOW, &tio);
+        fcntl(master, F_SETFL, O_NONBLOCK);
+        return true;
+    }
+
+    void close()
+    {
+        if (master >= 0) ::close(master);
+        if (slave >= 0)  ::close(slave); // kept open until then, the master reads EIO without
+        master = slave = -1;
+    }
+
+    bool writeAll(const unsigned char *buf, size_t len) // waits while the pty is full
+    {
+        while (len > 0)
+        {
+            long n = write(master, buf, len);
+            if (n < 0)
+            {
+                if ((errno != EAGAIN) || interrupted)
+                    return false;
+                struct pollfd pfd = { master, POLLOUT, 0 };
+                ::poll(&pfd, 1, 10);
+                continue;
+            }
+            buf += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    int master;
+    int slave;
+    char name[128];
+};
+
+// messages as the device sends them; framed: several per frame until flush()
+class DeviceWriter
+{
+public:
+    DeviceWriter(int protocol) : protocol(protocol), seq(0), pktLen(0), pktTime(0) {}
+
+    void add(const unsigned char *msg, short len, double time)
+    {
+        if (protocol == kUartCables)
+        {
+            unsigned char pkt[UART_CABLE_PACKET];
+            makeCablePacket(pkt, 0, (const char *)msg, len);
+            out.insert(out.end(), pkt, pkt + UART_CABLE_PACKET);
+        }
+        else if (protocol == kUartFramed)
+        {
+            if (pktLen + 1 + len + 2 > UART_FRAME_MAX)
+                flush();
+            if (pktLen == 0)
+            {
+                pktLen = UART_FRAME_HEADER;
+                pktTime = time;
+            }
+            pkt[pktLen++] = getFrameDt(time - pktTime);
+            memcpy(&pkt[pktLen], msg, len);
+            pktLen += len;
+        }
+        else
+            out.insert(out.end(), msg, msg + len);
+    }
+
+    void flush()
+    {
+        if (pktLen == 0)
+            return;
+        unsigned int t = (unsigned int)(long long)(pktTime * 1e6);
+        pkt[0] = seq++;
+        pkt[1] = (unsigned char)t;
+        pkt[2] = (unsigned char)(t >> 8);
+        pkt[3] = (unsigned char)(t >> 16);
+        pkt[4] = (unsigned char)(t >> 24);
+        unsigned short crc = uartCrc16(pkt, pktLen);
+        pkt[pktLen++] = (unsigned char)crc;
+        pkt[pktLen++] = (unsigned char)(crc >> 8);
+
+        unsigned char enc[UART_FRAME_ENCODED];
+        long n = cobsEncode(pkt, pktLen, enc);
+        enc[n++] = 0; // delimiter
+        out.insert(out.end(), enc, enc + n);
+        pktLen = 0;
+    }
+
+    std::vector<unsigned char> out;
+
+private:
+    int protocol;
+    unsigned char seq;
+    unsigned char pkt[UART_FRAME_MAX];
+    size_t pktLen;
+    double pktTime;
+};
+
+static int parseProtocol(const char *name)
+{
+    if (!name || !strcmp(name, "raw"))
+        return kUartRaw;
+    if (!strcmp(name, "cables"))
+        return kUartCables;
+    if (!strcmp(name, "framed"))
+        return kUartFramed;
+    return -1;
+}
+
+// device for the plug-in: echo, or notes at a rate
+static int runRig(bool generate, double rate, int protocol)
+{
+    PtyPair pty;
+    if (!pty.open())
+        return 1;
+    printf("device side (%s) on %s, run the host with PIZMIDI_UART_PORTS=%s\n",
+           getUartProtocolName(protocol), pty.name, pty.name);
+    fflush(stdout);
+    signal(SIGINT, onInterrupt);
+
+    DeviceWriter dev(protocol);
+    double start = pizTimeNow();
+    double lastReport = start;
+    long sent = 0, received = 0;
+    while (!interrupted)
+    {
+        unsigned char buf[1024];
+        struct pollfd pfd = { pty.master, POLLIN, 0 };
+        ::poll(&pfd, 1, 1);
+        long n = read(pty.master, buf, sizeof(buf));
+        if (n > 0)
+        {
+            received += n;
+            if (!generate && !pty.writeAll(buf, n)) // unchanged, probes included
+                break;
+        }
+
+        double now = pizTimeNow();
+        if (generate)
+        {
+            long due = (long)((now - start) * rate);
+            for (; sent < due; sent++)
+            {
+                unsigned char m[3] = { (unsigned char)((sent & 1) ? MIDI_NOTEOFF : MIDI_NOTEON), (unsigned char)(36 + (sent / 2) % 64), 100 };
+                dev.add(m, 3, start + sent / rate);
+            }
+            dev.flush();
+            if (!dev.out.empty() && !pty.writeAll(&dev.out[0], dev.out.size()))
+                break;
+            dev.out.clear();
+        }
+        if (now - lastReport >= 1.0)
+        {
+            printf("%8.0f s  %8ld messages sent  %8ld bytes received\n", now - start, sent, received);
+            fflush(stdout);
+            lastReport = now;
+        }
+    }
+    return 0;
+}
+
+// message i of the parse check, all kinds of channel messages
+static short makeTestMessage(long i, unsigned char *m)
+{
+    static const unsigned char types[] = { MIDI_NOTEON, MIDI_NOTEOFF, MIDI_CONTROLCHANGE, MIDI_PROGRAMCHANGE,
+                                           MIDI_PITCHBEND, MIDI_CHANNELPRESSURE, MIDI_POLYKEYPRESSURE };
+    m[0] = (unsigned char)(types[i % 7] | ((i / 7) & 0x0F));
+    m[1] = (unsigned char)((i >> 4) & 0x7F);
+    m[2] = (unsigned char)((i >> 11) & 0x7F);
+    return getMidiEvLen(m[0]);
+}
+
+#define PARSE_DAMAGE 97 // every n-th message
+#define PARSE_CLOCK  7  // clock every n-th message
+#define PARSE_FRAME  4  // messages per frame
+#define PARSE_RATE   10000.0 // messages/s, about half of the wire at PARSE_BAUD
+#define PARSE_BAUD   1000000 // PARSE_FRAME messages are written at a time, when they would be through
+                             // the wire, so the times the parser infers from the baud rate hold
+#define PARSE_SEARCH 64 // messages a received one may be ahead of the next expected one
+
+static int runParse(long count, int protocol)
+{
+    PtyPair pty;
+    if (!pty.open())
+        return 1;
+
+    UartWorker io;
+    io.setProtocol(protocol);
+    io.start(0);
+    UartSerial *port = UartSerial::create();
+    if (!port->open(pty.name, PARSE_BAUD))
+        return 1;
+    io.attach(0, port, PARSE_BAUD);
+
+    // device: PARSE_FRAME messages at a time at PARSE_RATE
+    std::vector<double> sentTime(count);
+    std::vector<bool> exposed(count + PARSE_FRAME + 1, false); // damaged, or lost with a damaged one
+    std::vector<bool> damaged(count, false);
+    long clocks = 0, damages = 0;
+    std::atomic<bool> done(false);
+    std::thread device([&]
+    {
+        DeviceWriter dev(protocol);
+        double start = pizTimeNow();
+        double wire = start; // when the bytes written so far are through
+        for (long i = 0; i < count; )
+        {
+            double wait = start + i / PARSE_RATE - pizTimeNow();
+            if (wait > 0)
+                std::this_thread::sleep_for(std::chrono::microseconds((long)(wait * 1e6)));
+            double now = pizTimeNow();
+            for (long end = std::min(count, i + PARSE_FRAME); i < end; i++)
+            {
+                unsigned char m[3];
+                short len = makeTestMessage(i, m);
+                sentTime[i] = now;
+                bool clock = (i % PARSE_CLOCK == 0);
+                bool damage = (i % PARSE_DAMAGE == PARSE_DAMAGE / 2);
+                size_t pos = dev.out.size();
+                if (clock)
+                {
+                    unsigned char c = MIDI_TIMINGCLOCK;
+                    clocks++;
+                    if (protocol == kUartRaw) // within the message
+                    {
+                        dev.out.push_back(m[0]);
+                        dev.out.push_back(c);
+                        dev.out.insert(dev.out.end(), m + 1, m + len);
+                        continue;
+                    }
+                    dev.add(&c, 1, now);
+                    dev.flush();
+                }
+                dev.add(m, len, now);
+                if (protocol == kUartFramed)
+                {
+                    if ((i % PARSE_FRAME == PARSE_FRAME - 1) || damage)
+                    {
+                        pos = dev.out.size();
+                        dev.flush();
+                    }
+                    if (damage) // corrupt a byte of the frame, all its messages are lost
+                    {
+                        unsigned char& c = dev.out[pos + 3];
+                        c ^= (c == 0x40) ? 0x20 : 0x40;
+                        for (long k = i; (k >= 0) && (i - k < PARSE_FRAME); k--)
+                        {
+                            exposed[k] = true;
+                            if (k % PARSE_FRAME == 0)
+                                break;
+                        }
+                        damaged[i] = true;
+                        damages++;
+                    }
+                }
+                else if (damage) // the last byte goes missing, a message of cables may take the next one along
+                {
+                    dev.out.pop_back();
+                    exposed[i] = exposed[i + 1] = true;
+                    damaged[i] = true;
+                    damages++;
+                }
+            }
+            dev.flush();
+            wire = std::max(wire, now) + dev.out.size() * 10.0 / PARSE_BAUD;
+            wait = wire - pizTimeNow();
+            if (wait > 0)
+                std::this_thread::sleep_for(std::chrono::microseconds((long)(wait * 1e6)));
+            if (!pty.writeAll(&dev.out[0], dev.out.size()))
+                break;
+            dev.out.clear();
+        }
+        done = true;
+    });
+
+    std::vector<UartRxEvent> events;
+    double quiet = 0;
+    for (;;)
+    {
+        UartRxEvent ev;
+        bool got = false;
+        while (io.rx.pop(ev))
+        {
+            events.push_back(ev);
+            got = true;
+        }
+        double now = pizTimeNow();
+        if (got || !done)
+            quiet = now;
+        else if (now - quiet > 0.2)
+            break;
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    device.join();
+    long rxBad = io.stats(0).rxBad, rxLost = io.stats(0).rxLost;
+    io.attach(0, 0);
+    io.stop();
+    port->close();
+    delete port;
+
+    // In order, skipping lost ones. Between two matched messages (a gap), corrupt messages
+    // are only accepted up to the number of damages in the gap or just before it (the
+    // damaged message taking a byte of the next packet along, or a two-byte message of
+    // cables which still decodes and the next packet losing its header), and clocks may
+    // only go missing there; a clock is due in the gap of the message it is sent before
+    // (or within). Overall, a damage may cost at most one corrupt message.
+    long matched = 0, corrupt = 0, lost = 0, exposedLost = 0, rxClocks = 0;
+    long gapCorrupt = 0, gapClocks = 0, clocksLost = 0, unexplained = 0;
+    std::vector<double> delays;
+    long j = 0;
+    for (size_t e = 0; e <= events.size(); e++)
+    {
+        long k = count; // the gap after the last match
+        if (e < events.size())
+        {
+            const UartRxEvent& ev = events[e];
+            if ((unsigned char)ev.data[0] == MIDI_TIMINGCLOCK)
+            {
+                rxClocks++;
+                gapClocks++;
+                continue;
+            }
+            for (k = j; (k < count) && (k < j + PARSE_SEARCH); k++)
+            {
+                unsigned char m[3];
+                short len = makeTestMessage(k, m);
+                if (!memcmp(m, ev.data, len))
+                    break;
+            }
+            if ((k >= count) || (k >= j + PARSE_SEARCH))
+            {
+                corrupt++;
+                gapCorrupt++;
+                continue;
+            }
+            matched++;
+            delays.push_back((ev.time - sentTime[k]) * 1e3);
+        }
+
+        long gapDamages = ((j > 0) && damaged[j - 1]) ? 1 : 0, gapClocksDue = 0;
+        for (long i = j; (i <= k) && (i < count); i++)
+        {
+            if (damaged[i])
+                gapDamages++;
+            if (i % PARSE_CLOCK == 0)
+                gapClocksDue++;
+        }
+        if ((gapCorrupt > gapDamages) || (gapClocks > gapClocksDue) || ((gapClocks < gapClocksDue) && !gapDamages))
+            unexplained++;
+        clocksLost += std::max(0L, gapClocksDue - gapClocks);
+        gapCorrupt = gapClocks = 0;
+
+        for (; j < k; j++)
+            (exposed[j] ? exposedLost : lost)++;
+        j = k + 1;
+    }
+
+    double elapsed = events.empty() ? 0 : events.back().time - sentTime[0];
+    bool ok = (lost == 0) && (unexplained == 0) && (corrupt <= damages) && ((protocol != kUartFramed) || ((corrupt == 0) && (clocksLost == 0)));
+    printf("%-8s %8ld sent  %6ld damaged  %8ld matched  %6ld lost with them  %4ld corrupt  %4ld lost  clock %ld/%ld\n",
+           getUartProtocolName(protocol), count, damages, matched, exposedLost, corrupt, lost, rxClocks, clocks);
+    printf("         %ld clocks lost next to damage, %ld gaps with more corrupt messages than damages or clocks lost without\n",
+           clocksLost, unexplained);
+    if (protocol == kUartFramed)
+        printf("         frames: %ld bad, %ld missing in sequence\n", rxBad, rxLost);
+    printf("         %.0f messages/s, delay p50 %.3f ms, max %.3f ms: %s\n",
+           elapsed > 0 ? matched / elapsed : 0, percentile(delays, 0.5), percentile(delays, 1.0), ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+//-------------------------------------------------------------------------------------------------------
+// Baud rate negotiation: a device answering link control like doc/ArduMidiFramed.ino
+
+struct NegScenario
+{
+    const char *name;
+    int  mask;   // rates offered, 0: no answer to the query
+    int  refuse; // offered, but not switched to (no acknowledge)
+    int  fail;   // acknowledged, but the device cannot receive at it
+    long expect;
+};
+
+class NegDevice
+{
+public:
+    NegDevice(int fd, const NegScenario& sc) : rate(0), fd(fd), sc(sc), quit(false), heard(0), pos(0), len(0) {}
+
+    void start() { heard = pizTimeNow(); thread = std::thread(&NegDevice::run, this); }
+    void stop()  { quit = true; thread.join(); }
+
+    std::atomic<int> rate; // index into uartRates
+
+private:
+    bool inSync() // bridge end set to the device's rate
+    {
+        struct termios tio;
+        if (tcgetattr(fd, &tio) != 0)
+            return false;
+        return cfgetospeed(&tio) == baudToSpeed(uartRates[rate]);
+    }
+
+    static speed_t baudToSpeed(long baud)
+    {
+        switch (baud)
+        {
+        case 115200: return B115200;
+        case 230400: return B230400;
+        case 460800: return B460800;
+        case 500000: return B500000;
+        case 921600: return B921600;
+        case 1000000: return B1000000;
+        case 2000000: return B2000000;
+        }
+        return B0;
+    }
+
+    // after the wire time of the message received and of the reply, which a pty skips
+    void send(unsigned char a, unsigned char b, unsigned char c, short n)
+    {
+        unsigned char m[3] = { a, b, c };
+        double wire = (len + n) * 10.0 / uartRates[rate];
+        std::this_thread::sleep_for(std::chrono::microseconds((long)(wire * 1e6) + 1));
+        if (inSync() && (write(fd, m, n) != n))
+            perror("write");
+    }
+
+    void message(const unsigned char *m, double now)
+    {
+        heard = now;
+        if (m[0] == UART_PROBE)
+            send(UART_PROBE, m[1], 0, 2);
+        else if ((m[0] == UART_CONTROL) && (m[1] == kUartQuery) && sc.mask)
+            send(UART_CONTROL, kUartRates, (unsigned char)sc.mask, 3);
+        else if ((m[0] == UART_CONTROL) && (m[1] == kUartSwitch) && (m[2] < UART_NUM_RATES)
+                 && (sc.mask & (1 << m[2])) && !(sc.refuse & (1 << m[2])))
+        {
+            send(UART_CONTROL, kUartSwitched, m[2], 3); // at the old rate
+            rate = m[2];
+        }
+    }
+
+    void run()
+    {
+        while (!quit)
+        {
+            unsigned char buf[256];
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            ::poll(&pfd, 1, 1);
+            long n = read(fd, buf, sizeof(buf));
+            double now = pizTimeNow();
+            bool deaf = !inSync() || (sc.fail & (1 << rate));
+            for (long i = 0; i < n; i++)
+            {
+                unsigned char c = buf[i];
+                if (deaf) // noise at the wrong rate
+                    continue;
+                if (c & 0x80)
+                {
+                    len = getUartMsgLen(c);
+                    pos = 0;
+                }
+                if ((len <= 0) || ((pos == 0) && !(c & 0x80)))
+                    continue;
+                msg[pos++] = c;
+                if (pos == len)
+                {
+                    message(msg, now);
+                    pos = 0;
+                }
+            }
+            if ((rate != 0) && (now - heard > 1.0)) // nothing valid for 1 s, back to the start
+            {
+                rate = 0;
+                heard = now;
+            }
+        }
+    }
+
+    int fd;
+    NegScenario sc;
+    std::atomic<bool> quit;
+    std::thread thread;
+    double heard; // last valid message
+    unsigned char msg[3];
+    short pos;
+    short len;
+};
+
+static bool runNegotiate(const NegScenario& sc)
+{
+    PtyPair pty;
+    if (!pty.open())
+        return false;
+
+    NegDevice device(pty.master, sc);
+    device.start();
+
+    UartWorker io;
+    io.setProtocol(kUartRaw);
+    io.start(0);
+    UartSerial *port = UartSerial::create();
+    if (!port->open(pty.name, UART_BAUD_RATE))
+        return false;
+    double start = pizTimeNow();
+    io.attach(0, port, 0); // negotiate
+
+    while ((io.stats(0).baud == 0) && (pizTimeNow() - start < 5.0))
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    double settled = pizTimeNow() - start;
+    long baud = io.stats(0).baud;
+
+    io.setProbe(true); // both ends at the same rate
+    double until = pizTimeNow() + 0.5;
+    while ((io.stats(0).rttMax == 0) && (pizTimeNow() < until))
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    bool echo = (io.stats(0).rttMax > 0);
+    long devBaud = uartRates[device.rate];
+
+    io.attach(0, 0);
+    io.stop();
+    port->close();
+    delete port;
+    device.stop();
+
+    bool ok = (baud == sc.expect) && (devBaud == sc.expect) && echo;
+    printf("%-12s %8ld %8ld %8ld %7.2f  %-4s %s\n",
+           sc.name, sc.expect, baud, devBaud, settled, echo ? "yes" : "no", ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static int runNegotiations()
+{
+    std::vector<NegScenario> scenarios;
+    NegScenario silent = { "silent", 0, 0, 0, UART_BAUD_RATE };
+    scenarios.push_back(silent);
+    static char names[UART_NUM_RATES][16];
+    for (int n = 1; n < UART_NUM_RATES; n++) // each rate of the list
+    {
+        sprintf(names[n], "only %ld", uartRates[n]);
+        NegScenario only = { names[n], 1 | (1 << n), 0, 0, uartRates[n] };
+        scenarios.push_back(only);
+    }
+    int all = (1 << UART_NUM_RATES) - 1;
+    NegScenario fastest = { "all", all, 0, 0, uartRates[UART_NUM_RATES - 1] };
+    NegScenario refuse  = { "refuse", all, 1 << (UART_NUM_RATES - 1), 0, uartRates[UART_NUM_RATES - 2] };
+    NegScenario fail    = { "fail", all, 0, 3 << (UART_NUM_RATES - 2), uartRates[UART_NUM_RATES - 3] };
+    NegScenario sketch  = { "sketch", 0x69, 1 << 6, 0, 1000000 }; // 2 Mbaud refused
+    scenarios.push_back(fastest);
+    scenarios.push_back(refuse);
+    scenarios.push_back(fail);
+    scenarios.push_back(sketch);
+
+    printf("%-12s %8s %8s %8s %7s  %-4s\n", "device", "expect", "bridge", "device", "time", "echo");
+    bool ok = true;
+    for (size_t i = 0; i < scenarios.size(); i++)
+        ok = runNegotiate(scenarios[i]) && ok;
+    return ok ? 0 : 1;
+}
+
+//-------------------------------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    if ((argc > 1) && !strcmp(argv[1], "negotiate"))
+        return runNegotiations();
+
+    if ((argc > 1) && (!strcmp(argv[1], "rig") || !strcmp(argv[1], "parse")))
+    {
+        bool parse = !strcmp(argv[1], "parse");
+        bool generate = !parse && (argc > 2) && !strcmp(argv[2], "generate");
+        const char *arg = (argc > 3) ? argv[3] : 0; // rate of generate, protocol of echo
+        if (parse)
+            arg = (argc > 2) ? argv[2] : 0;
+        const char *proto = (parse || generate) ? ((argc > 3) ? argv[3] : 0) : arg;
+        if (generate)
+            proto = (argc > 4) ? argv[4] : 0;
+        int protocol = parseProtocol(proto);
+        if (protocol < 0)
+        {
+            fprintf(stderr, "unknown protocol %s\n", proto);
+            return 1;
+        }
+        if (parse)
+            return runParse(arg ? atol(arg) : 100000, protocol);
+        return runRig(generate, (generate && arg) ? atof(arg) : 1000, protocol);
+    }
+
+    double seconds = (argc > 1) ? atof(argv[1]) : 0.3;
+    const char *only = (argc > 2) ? argv[2] : 0;
+
+    static const long bauds[] = { 115200, 1000000 };
+    static const long blocks[] = { 64, 1024 };
+
+    printf("%-7s %-7s %8s %6s %8s %5s %7s %7s %7s %7s %7s %7s %6s %7s\n",
+           "load", "proto", "baud", "block", "ev/s", "eff", "p50", "p90", "p99", "max", "merged", "dropped", "lost", "rx");
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+    {
+        if (only && strcmp(only, workloads[w].name))
+            continue;
+        for (int p = 0; p < kNumUartProtocols; p++)
+            for (size_t r = 0; r < sizeof(bauds) / sizeof(bauds[0]); r++)
+                for (size_t k = 0; k < sizeof(blocks) / sizeof(blocks[0]); k++)
+                    if (!runOnce(workloads[w], p, bauds[r], blocks[k], seconds))
+                        return 1;
+    }
+    return 0;
+}
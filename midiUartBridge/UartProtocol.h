@@ -0,0 +1,228 @@
+/*-----------------------------------------------------------------------------
+UartProtocol
+wire formats of midiUartBridge
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#ifndef UARTPROTOCOL_H
+#define UARTPROTOCOL_H
+
+#include "../common/MIDI.h"
+
+enum
+{
+    kUartRaw,    // plain MIDI bytes, one channel
+    kUartCables, // 4-byte event packets, 16 virtual cables
+    kUartFramed, // COBS frames with device time, sequence number and CRC
+
+    kNumUartProtocols
+};
+
+static inline const char *getUartProtocolName(int protocol)
+{
+    switch (protocol)
+    {
+    case kUartCables: return "Cables";
+    case kUartFramed: return "Framed";
+    }
+    return "Raw MIDI";
+}
+
+//-------------------------------------------------------------------------------------------------------
+
+static inline short getMidiEvLen(short status)
+{
+    short len = 0;
+    switch (status & 0xF0)
+    {
+    case MIDI_NOTEOFF:         len = 3; break;
+    case MIDI_NOTEON:          len = 3; break;
+    case MIDI_POLYKEYPRESSURE: len = 3; break;
+    case MIDI_CONTROLCHANGE:   len = 3; break;
+    case MIDI_PROGRAMCHANGE:   len = 2; break;
+    case MIDI_CHANNELPRESSURE: len = 2; break;
+    case MIDI_PITCHBEND:       len = 3; break;
+    }
+    return len;
+}
+
+// Clock and transport (real-time messages), single status bytes which may be sent
+// between the bytes of any other message
+static inline bool isRealTime(short status)
+{
+    switch (status & 0xFF)
+    {
+    case MIDI_TIMINGCLOCK:
+    case MIDI_START:
+    case MIDI_CONTINUE:
+    case MIDI_STOP:
+        return true;
+    }
+    return false;
+}
+
+//-------------------------------------------------------------------------------------------------------
+// Latency probe: [0xF4] [id], an undefined system common message, which the device
+// echoes unchanged (see doc/ArduMidiFramed.ino). Sent in the same way as any other
+// message with every protocol, and never forwarded to or from the host.
+
+#define UART_PROBE 0xF4
+
+//-------------------------------------------------------------------------------------------------------
+// Link control: [0xF5] [command] [value], another undefined system common message.
+// Baud rate negotiation, always started by the bridge at UART_BAUD_RATE:
+//
+//   bridge: kUartQuery       0      device: kUartRates  mask (bit n: uartRates[n] supported)
+//   bridge: kUartSwitch      n      device: kUartSwitched n, then both switch to uartRates[n]
+//   bridge: probe at the new rate   device: echo (see above)
+//
+// A device which gets no valid message within 1 s after switching falls back to UART_BAUD_RATE,
+// so does the bridge when the echo is missing, and then tries the next slower rate.
+//
+// Flow control of sysex (with "Flow Control" set to XON/XOFF), sent by the device:
+//
+//   device: kUartFlow 0 (stop) / 1 (go)
+//
+// or the plain bytes XOFF (0x13) / XON (0x11) between messages (raw MIDI and cables).
+
+#define UART_CONTROL 0xF5
+
+enum
+{
+    kUartQuery,
+    kUartRates,
+    kUartSwitch,
+    kUartSwitched,
+    kUartFlow
+};
+
+#define UART_XON  0x11
+#define UART_XOFF 0x13
+
+static const long uartRates[] = { 115200, 230400, 460800, 500000, 921600, 1000000, 2000000 }; // at most 7
+#define UART_NUM_RATES ((int)(sizeof(uartRates) / sizeof(uartRates[0])))
+
+static inline short getUartMsgLen(short status) // MIDI messages, probes and link control
+{
+    switch (status & 0xFF)
+    {
+    case UART_PROBE:   return 2;
+    case UART_CONTROL: return 3;
+    }
+    if (isRealTime(status))
+        return 1;
+    return getMidiEvLen(status);
+}
+
+//-------------------------------------------------------------------------------------------------------
+// Cable packets, similar to USB-MIDI event packets:
+//
+//   [cable << 4 | status >> 4] [status] [data1] [data2]
+//
+// Always 4 bytes, unused data bytes are 0. The low nibble of the header repeats the
+// message type (the USB-MIDI "code index number" of channel messages), which together
+// with the status bit of the second byte lets the receiver find the packet boundaries
+// again after a lost byte.
+
+#define UART_CABLE_PACKET 4
+
+static inline void makeCablePacket(unsigned char *pkt, short cable, const char *msg, short len)
+{
+    pkt[0] = (unsigned char)(((cable & 0x0F) << 4) | ((msg[0] >> 4) & 0x0F));
+    pkt[1] = (unsigned char)msg[0];
+    pkt[2] = (len > 1) ? (unsigned char)(msg[1] & 0x7F) : 0;
+    pkt[3] = (len > 2) ? (unsigned char)(msg[2] & 0x7F) : 0;
+}
+
+// sysex in packets of up to 3 bytes (USB-MIDI code index 4: start or continue, 5..7: end
+// with 1..3 bytes), the device collects them, other packets may come in between
+static inline void makeSysexPacket(unsigned char *pkt, short cable, const unsigned char *bytes, short len, bool end)
+{
+    pkt[0] = (unsigned char)(((cable & 0x0F) << 4) | (end ? 4 + len : 4));
+    for (short i = 0; i < 3; i++)
+        pkt[1 + i] = (i < len) ? bytes[i] : 0;
+}
+
+static inline bool isCablePacket(const unsigned char *pkt)
+{
+    return (pkt[1] & 0x80) && ((pkt[0] & 0x0F) == (pkt[1] >> 4)) && !((pkt[2] | pkt[3]) & 0x80);
+}
+
+//-------------------------------------------------------------------------------------------------------
+// Framed packets, COBS encoded and terminated by a 0x00 byte (see doc/ArduMidiFramed.ino):
+//
+//   [seq] [time0] [time1] [time2] [time3] { [dt] [status] [data1] [data2] } [crc0] [crc1]
+//
+// seq   packet counter, incremented for every packet sent (loss detection)
+// time  sender's clock in microseconds of the first message (little endian, wraps); the device
+//       stamps when it was generated, the bridge when it was scheduled for
+// dt    time of the message after the packet time, in 100 us units (0..255)
+// crc   CRC-16/CCITT of all preceding bytes (little endian)
+//
+// One packet carries one or more messages, the number of data bytes follows from the status.
+// A decoded packet never exceeds UART_FRAME_MAX bytes, so it fits small device buffers.
+// Sysex travels in fragments [dt] [0xF0] [n] [n bytes of the dump], the device collects them.
+
+#define UART_FRAME_HEADER  5
+#define UART_FRAME_MAX     64
+#define UART_FRAME_ENCODED (UART_FRAME_MAX + 2) // COBS overhead and delimiter
+#define UART_SYSEX_FRAGMENT (UART_FRAME_MAX - UART_FRAME_HEADER - 3 - 2) // per packet
+
+static inline unsigned char getFrameDt(double dt) // seconds after the packet time
+{
+    long n = (long)(dt * 1e4 + 0.5);
+    return (unsigned char)((n < 0) ? 0 : (n > 255) ? 255 : n);
+}
+
+static inline unsigned short uartCrc16(const unsigned char *buf, long len)
+{
+    unsigned short crc = 0xFFFF;
+    for (long i = 0; i < len; i++)
+    {
+        crc ^= (unsigned short)(buf[i] << 8);
+        for (int b = 0; b < 8; b++)
+            crc = (crc & 0x8000) ? (unsigned short)((crc << 1) ^ 0x1021) : (unsigned short)(crc << 1);
+    }
+    return crc;
+}
+
+// COBS encodes len bytes (at most 254), returns the encoded length (without delimiter)
+static inline long cobsEncode(const unsigned char *in, long len, unsigned char *out)
+{
+    long code = 0; // position of the current code byte
+    long n = 1;
+    out[code] = 1;
+    for (long i = 0; i < len; i++)
+    {
+        if (in[i])
+        {
+            out[n++] = in[i];
+            out[code]++;
+        }
+        else
+        {
+            code = n++;
+            out[code] = 1;
+        }
+    }
+    return n;
+}
+
+// decodes a COBS frame (without delimiter), returns the decoded length or -1 if malformed
+static inline long cobsDecode(const unsigned char *in, long len, unsigned char *out)
+{
+    long n = 0;
+    long i = 0;
+    while (i < len)
+    {
+        unsigned char code = in[i++];
+        if ((code == 0) || (i + code - 1 > len))
+            return -1;
+        for (int j = 1; j < code; j++)
+            out[n++] = in[i++];
+        if ((code < 0xFF) && (i < len))
+            out[n++] = 0;
+    }
+    return n;
+}
+
+#endif
@@ -0,0 +1,858 @@
+/*-----------------------------------------------------------------------------
+UartSerial
+serial port backends for midiUartBridge (Win32 overlapped I/O, POSIX termios/epoll)
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#include "UartSerial.h"
+#include "../common/pizvstbase.h" // dbg
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+//-------------------------------------------------------------------------------------------------------
+// natural sort order: COM2 before COM10, ttyACM0 before ttyUSB0
+
+static bool portLess(const std::string& a, const std::string& b)
+{
+    size_t na = a.find_last_not_of("0123456789") + 1;
+    size_t nb = b.find_last_not_of("0123456789") + 1;
+    int cmp = a.compare(0, na, b, 0, nb);
+    if (cmp != 0)
+        return cmp < 0;
+    return atol(a.c_str() + na) < atol(b.c_str() + nb);
+}
+
+#ifdef _WIN32
+//=======================================================================================================
+// Win32: overlapped I/O, so that reads can wait for data while writes are going on
+
+#include <dbt.h>
+
+#pragma comment(lib, "winmm.lib") // timeBeginPeriod
+
+extern HINSTANCE hInstance; // of this DLL, see vstplugmain.cpp
+
+class Win32Serial : public UartSerial
+{
+public:
+    Win32Serial();
+    ~Win32Serial();
+
+    virtual bool open(const char *name, long baud);
+    virtual void close();
+    virtual bool isOpen() const { return hCom != INVALID_HANDLE_VALUE; }
+    virtual bool setBaud(long baud);
+    virtual bool setFlowControl(bool rtsCts);
+    virtual long txQueued(bool& held);
+
+    virtual long read(unsigned char *buf, long maxlen);
+    virtual long write(const unsigned char *buf, long len);
+
+    virtual int  poll();
+
+    int    arm(); // issues the overlapped read, kReadable if data is already there
+    HANDLE readEvent() const { return ovRead.hEvent; }
+
+private:
+    HANDLE hCom;
+    OVERLAPPED ovRead;
+    OVERLAPPED ovWrite;
+    bool pending; // overlapped read outstanding
+    bool failed;  // read error, reported by poll()
+
+    unsigned char rxBuf[256]; // completed read, not yet consumed
+    long rxLen;
+    long rxPos;
+};
+
+Win32Serial::Win32Serial()
+    : hCom(INVALID_HANDLE_VALUE), pending(false), failed(false), rxLen(0), rxPos(0)
+{
+    memset(&ovRead, 0, sizeof(ovRead));
+    memset(&ovWrite, 0, sizeof(ovWrite));
+    ovRead.hEvent = CreateEvent(0, TRUE, FALSE, 0);
+    ovWrite.hEvent = CreateEvent(0, TRUE, FALSE, 0);
+}
+
+Win32Serial::~Win32Serial()
+{
+    close();
+    CloseHandle(ovRead.hEvent);
+    CloseHandle(ovWrite.hEvent);
+}
+
+bool Win32Serial::open(const char *name, long baud)
+{
+    close();
+
+    char path[32] = { 0 }; // com port id
+    snprintf(path, sizeof(path), "\\\\.\\%s", name);
+
+    hCom = ::CreateFile(path, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, 0);
+    if (hCom == INVALID_HANDLE_VALUE)
+    {
+        dbg("Failed to open " << name);
+        return false;
+    }
+
+    //Setting the Parameters for the SerialPort
+    if (!setBaud(baud))
+        dbg("Failed to set " << name << " state");
+
+
+    //Setting Timeouts: a read returns as soon as at least one byte is available
+    COMMTIMEOUTS timeouts;
+    memset((void *)&timeouts, 0, sizeof(timeouts));
+    timeouts.ReadIntervalTimeout = MAXDWORD;
+    timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+    timeouts.ReadTotalTimeoutConstant = 100; // then re-issued
+    timeouts.WriteTotalTimeoutConstant = 0;
+    timeouts.WriteTotalTimeoutMultiplier = 0;
+    if (!SetCommTimeouts(hCom, &timeouts))
+        dbg("Failed to set " << name << " timeouts");
+
+    rxLen = rxPos = 0;
+    pending = false;
+    failed = false;
+    return true;
+}
+
+void Win32Serial::close()
+{
+    if (hCom == INVALID_HANDLE_VALUE)
+        return;
+
+    if (pending)
+    {
+        DWORD len = 0;
+        CancelIo(hCom);
+        GetOverlappedResult(hCom, &ovRead, &len, TRUE);
+        pending = false;
+    }
+    CloseHandle(hCom);
+    hCom = INVALID_HANDLE_VALUE;
+}
+
+bool Win32Serial::setBaud(long baud)
+{
+    DCB dcbSerialParams = { 0 };
+    dcbSerialParams.DCBlength = sizeof(dcbSerialParams);
+    if (!GetCommState(hCom, &dcbSerialParams))
+        return false;
+
+    FlushFileBuffers(hCom); // pending bytes still go out at the old rate
+
+    dcbSerialParams.BaudRate = baud;
+    dcbSerialParams.ByteSize = 8;
+    dcbSerialParams.StopBits = ONESTOPBIT;
+    dcbSerialParams.Parity = NOPARITY;
+    return SetCommState(hCom, &dcbSerialParams) != 0;
+}
+
+bool Win32Serial::setFlowControl(bool rtsCts)
+{
+    DCB dcbSerialParams = { 0 };
+    dcbSerialParams.DCBlength = sizeof(dcbSerialParams);
+    if (!GetCommState(hCom, &dcbSerialParams))
+        return false;
+
+    dcbSerialParams.fOutxCtsFlow = rtsCts ? TRUE : FALSE;
+    dcbSerialParams.fRtsControl = rtsCts ? RTS_CONTROL_HANDSHAKE : RTS_CONTROL_ENABLE;
+    dcbSerialParams.fOutX = FALSE; // XON/XOFF is handled by the bridge, they are MIDI data bytes
+    dcbSerialParams.fInX = FALSE;
+    return SetCommState(hCom, &dcbSerialParams) != 0;
+}
+
+long Win32Serial::txQueued(bool& held)
+{
+    DWORD errors = 0;
+    COMSTAT stat;
+    held = false;
+    if (!ClearCommError(hCom, &errors, &stat))
+        return -1;
+    held = stat.fCtsHold != 0;
+    return stat.cbOutQue;
+}
+
+long Win32Serial::read(unsigned char *buf, long maxlen)
+{
+    long len = rxLen - rxPos;
+    if (len > maxlen)
+        len = maxlen;
+    if (len > 0)
+    {
+        memcpy(buf, &rxBuf[rxPos], len);
+        rxPos += len;
+    }
+    return len;
+}
+
+long Win32Serial::write(const unsigned char *buf, long len)
+{
+    DWORD written = 0;
+    ResetEvent(ovWrite.hEvent);
+    if (!WriteFile(hCom, buf, len, &written, &ovWrite))
+    {
+        if ((GetLastError() != ERROR_IO_PENDING) || !GetOverlappedResult(hCom, &ovWrite, &written, TRUE))
+        {
+            dbg("Failed to write to COM");
+            return -1;
+        }
+    }
+    return written;
+}
+
+int Win32Serial::arm()
+{
+    if (failed)
+        return -1;
+    if (rxPos < rxLen) // not consumed yet
+        return kReadable;
+    if (pending)
+        return 0;
+
+    DWORD len = 0;
+    rxLen = rxPos = 0;
+    ResetEvent(ovRead.hEvent);
+    if (ReadFile(hCom, rxBuf, sizeof(rxBuf), &len, &ovRead))
+    {
+        rxLen = len; // completed immediately
+        return (len > 0) ? kReadable : 0;
+    }
+    if (GetLastError() != ERROR_IO_PENDING)
+    {
+        dbg("Failed to read from COM");
+        failed = true;
+        return -1;
+    }
+    pending = true;
+    return 0;
+}
+
+int Win32Serial::poll()
+{
+    if (failed)
+        return -1;
+    if (rxPos < rxLen)
+        return kReadable;
+    if (!pending)
+        return 0;
+
+    DWORD len = 0;
+    if (!GetOverlappedResult(hCom, &ovRead, &len, FALSE))
+    {
+        if (GetLastError() == ERROR_IO_INCOMPLETE)
+            return 0; // still waiting
+        dbg("Failed to read from COM");
+        failed = true;
+        return -1;
+    }
+    pending = false; // read completed (or timed out)
+    rxLen = len;
+    return (len > 0) ? kReadable : 0;
+}
+
+UartSerial *UartSerial::create()
+{
+    return new Win32Serial;
+}
+
+//-------------------------------------------------------------------------------------------------------
+// waits on the overlapped reads of all ports and the wake event
+
+class Win32Poller : public UartPoller
+{
+public:
+    Win32Poller() { hWakeEvent = CreateEvent(0, FALSE, FALSE, 0); } // auto reset
+    ~Win32Poller() { CloseHandle(hWakeEvent); }
+
+    virtual bool add(UartSerial *port);
+    virtual void remove(UartSerial *port);
+
+    virtual int  wait(double timeout);
+    virtual void wake() { SetEvent(hWakeEvent); }
+
+private:
+    HANDLE hWakeEvent;
+    std::vector<Win32Serial *> ports;
+};
+
+bool Win32Poller::add(UartSerial *port)
+{
+    if (ports.size() >= MAXIMUM_WAIT_OBJECTS - 1)
+        return false;
+    ports.push_back((Win32Serial *)port);
+    return true;
+}
+
+void Win32Poller::remove(UartSerial *port)
+{
+    ports.erase(std::remove(ports.begin(), ports.end(), (Win32Serial *)port), ports.end());
+}
+
+int Win32Poller::wait(double timeout)
+{
+    HANDLE h[MAXIMUM_WAIT_OBJECTS];
+    DWORD n = 0;
+    bool ready = false;
+    for (size_t i = 0; i < ports.size(); i++)
+    {
+        if (ports[i]->arm() != 0) // data or error, poll() tells
+            ready = true;
+        h[n++] = ports[i]->readEvent();
+    }
+    h[n] = hWakeEvent;
+
+    // the sub-millisecond remainder of a timeout is spun by the caller
+    DWORD ms = (timeout < 0) ? INFINITE : (DWORD)(timeout * 1000.0);
+    if (ready)
+        ms = 0;
+
+    DWORD res = WaitForMultipleObjects(n + 1, h, FALSE, ms);
+    if (res < WAIT_OBJECT_0 + n) // a read completed (or timed out)
+        return UartSerial::kReadable;
+    if (res == WAIT_OBJECT_0 + n)
+        return UartSerial::kWoken;
+    return ready ? UartSerial::kReadable : 0;
+}
+
+UartPoller *UartPoller::create()
+{
+    return new Win32Poller;
+}
+
+//-------------------------------------------------------------------------------------------------------
+void listSerialPorts(std::vector<std::string>& names)
+{
+    names.clear();
+
+    std::vector<char> buf(65536);
+    long len = QueryDosDevice(0, &buf[0], (DWORD)buf.size());
+
+    for (long n = 0; n < len; n++)
+    {
+        if (strncmp(&buf[n], "COM", 3) == 0)
+            names.push_back(&buf[n]);
+
+        // find next null pointer
+        while (buf[n])
+            n++;
+    }
+    std::sort(names.begin(), names.end(), portLess);
+}
+
+//-------------------------------------------------------------------------------------------------------
+// message-only window receiving COM port arrival/removal notifications
+
+static const GUID GUID_DEVINTERFACE_COMPORT_ = { 0x86E0D1E0, 0x8089, 0x11D0, { 0x9C, 0xE4, 0x08, 0x00, 0x3E, 0x30, 0x1F, 0x73 } };
+
+class Win32PortWatcher : public UartPortWatcher
+{
+public:
+    Win32PortWatcher();
+    ~Win32PortWatcher();
+
+    virtual bool hasNotification() const { return hNotify != 0; }
+    virtual bool wait(double timeout);
+    virtual void wake() { SetEvent(hWakeEvent); }
+    virtual void detach();
+
+private:
+    void attach();
+    static LRESULT CALLBACK wndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam);
+
+    HANDLE hWakeEvent;
+    HWND hWnd;
+    HDEVNOTIFY hNotify;
+    bool attached;
+    bool changed;
+};
+
+Win32PortWatcher::Win32PortWatcher()
+    : hWnd(0), hNotify(0), attached(false), changed(false)
+{
+    hWakeEvent = CreateEvent(0, FALSE, FALSE, 0); // auto reset
+}
+
+Win32PortWatcher::~Win32PortWatcher()
+{
+    CloseHandle(hWakeEvent);
+}
+
+// the window belongs to the thread which creates it, so this runs on the waiting thread
+void Win32PortWatcher::attach()
+{
+    attached = true;
+
+    WNDCLASSEX wc;
+    memset(&wc, 0, sizeof(wc));
+    wc.cbSize = sizeof(wc);
+    wc.lpfnWndProc = wndProc;
+    wc.hInstance = hInstance;
+    wc.lpszClassName = "midiUartBridgeWatcher";
+    RegisterClassEx(&wc); // fails harmlessly if already registered by another instance
+
+    hWnd = CreateWindowEx(0, wc.lpszClassName, "", 0, 0, 0, 0, 0, HWND_MESSAGE, 0, hInstance, 0);
+    if (hWnd)
+    {
+        SetWindowLongPtr(hWnd, GWLP_USERDATA, (LONG_PTR)this);
+
+        DEV_BROADCAST_DEVICEINTERFACE filter;
+        memset(&filter, 0, sizeof(filter));
+        filter.dbcc_size = sizeof(filter);
+        filter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
+        filter.dbcc_classguid = GUID_DEVINTERFACE_COMPORT_;
+        hNotify = RegisterDeviceNotification(hWnd, &filter, DEVICE_NOTIFY_WINDOW_HANDLE);
+    }
+    if (!hNotify)
+        dbg("No device notifications, polling COM ports");
+}
+
+void Win32PortWatcher::detach()
+{
+    if (hNotify)
+        UnregisterDeviceNotification(hNotify);
+    if (hWnd)
+        DestroyWindow(hWnd);
+    hNotify = 0;
+    hWnd = 0;
+    attached = false;
+}
+
+LRESULT CALLBACK Win32PortWatcher::wndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
+{
+    if (msg == WM_DEVICECHANGE)
+    {
+        Win32PortWatcher *self = (Win32PortWatcher *)GetWindowLongPtr(hWnd, GWLP_USERDATA);
+        if (self && ((wParam == DBT_DEVICEARRIVAL) || (wParam == DBT_DEVICEREMOVECOMPLETE)))
+            self->changed = true;
+        return TRUE;
+    }
+    return DefWindowProc(hWnd, msg, wParam, lParam);
+}
+
+bool Win32PortWatcher::wait(double timeout)
+{
+    if (!attached)
+        attach();
+
+    DWORD ms = (timeout < 0) ? INFINITE : (DWORD)(timeout * 1000.0);
+    MsgWaitForMultipleObjects(1, &hWakeEvent, FALSE, ms, QS_ALLINPUT);
+
+    MSG msg;
+    while (PeekMessage(&msg, 0, 0, 0, PM_REMOVE))
+    {
+        TranslateMessage(&msg);
+        DispatchMessage(&msg);
+    }
+
+    bool res = changed;
+    changed = false;
+    return res;
+}
+
+UartPortWatcher *UartPortWatcher::create()
+{
+    return new Win32PortWatcher;
+}
+
+#else
+//=======================================================================================================
+// POSIX: non-blocking termios port, epoll for waiting (Linux)
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <dirent.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <stdint.h>
+
+static speed_t toSpeed(long baud)
+{
+    switch (baud)
+    {
+    case   9600: return B9600;
+    case  19200: return B19200;
+    case  38400: return B38400;
+    case  57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 500000: return B500000;
+    case 921600: return B921600;
+    case 1000000: return B1000000;
+    case 2000000: return B2000000;
+    }
+    return 0; // not supported
+}
+
+static void wakeFd(int fd)
+{
+    uint64_t one = 1;
+    if (::write(fd, &one, sizeof(one)) < 0)
+        dbg("Failed to wake");
+}
+
+static void clearFd(int fd)
+{
+    uint64_t cnt;
+    while (::read(fd, &cnt, sizeof(cnt)) > 0)
+        ;
+}
+
+class PosixSerial : public UartSerial
+{
+public:
+    PosixSerial();
+    ~PosixSerial();
+
+    virtual bool open(const char *name, long baud);
+    virtual void close();
+    virtual bool isOpen() const { return fd >= 0; }
+    virtual bool setBaud(long baud);
+    virtual bool setFlowControl(bool rtsCts);
+    virtual long txQueued(bool& held);
+
+    virtual long read(unsigned char *buf, long maxlen);
+    virtual long write(const unsigned char *buf, long len);
+
+    virtual int  poll() { int r = events; events = 0; return r; }
+
+private:
+    friend class PosixPoller;
+
+    int fd;     // tty (or pty slave)
+    int events; // set by PosixPoller::wait()
+};
+
+PosixSerial::PosixSerial()
+    : fd(-1), events(0)
+{
+}
+
+PosixSerial::~PosixSerial()
+{
+    close();
+}
+
+bool PosixSerial::open(const char *name, long baud)
+{
+    close();
+
+    fd = ::open(name, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+    {
+        dbg("Failed to open " << name);
+        return false;
+    }
+
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == 0)
+    {
+        cfmakeraw(&tio); // 8N1, no echo, no translation
+        tio.c_cflag |= CLOCAL | CREAD;
+        tio.c_cflag &= ~CSTOPB;
+        tio.c_cc[VMIN] = 0;
+        tio.c_cc[VTIME] = 0;
+        if (tcsetattr(fd, TCSANOW, &tio) != 0)
+            dbg("Failed to set " << name << " state");
+        if (!setBaud(baud))
+            dbg("Failed to set " << name << " to " << baud << " baud");
+        tcflush(fd, TCIOFLUSH);
+    }
+    else
+        dbg("Failed to get " << name << " state");
+
+    events = 0;
+    return true;
+}
+
+void PosixSerial::close()
+{
+    if (fd < 0)
+        return;
+
+    ::close(fd);
+    fd = -1;
+}
+
+bool PosixSerial::setBaud(long baud)
+{
+    speed_t speed = toSpeed(baud);
+    struct termios tio;
+    if (!speed || (tcgetattr(fd, &tio) != 0))
+        return false;
+
+    tcdrain(fd); // pending bytes still go out at the old rate
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+bool PosixSerial::setFlowControl(bool rtsCts)
+{
+    struct termios tio;
+    if (tcgetattr(fd, &tio) != 0)
+        return false;
+
+    if (rtsCts)
+        tio.c_cflag |= CRTSCTS;
+    else
+        tio.c_cflag &= ~CRTSCTS;
+    tio.c_iflag &= ~(IXON | IXOFF | IXANY); // XON/XOFF is handled by the bridge, they are MIDI data bytes
+    return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+long PosixSerial::txQueued(bool& held)
+{
+    held = false;
+    int queued = 0;
+    if (ioctl(fd, TIOCOUTQ, &queued) != 0)
+        return -1;
+
+    struct termios tio;
+    int lines = 0;
+    if ((tcgetattr(fd, &tio) == 0) && (tio.c_cflag & CRTSCTS) && (ioctl(fd, TIOCMGET, &lines) == 0))
+        held = !(lines & TIOCM_CTS);
+    return queued;
+}
+
+long PosixSerial::read(unsigned char *buf, long maxlen)
+{
+    ssize_t len = ::read(fd, buf, maxlen);
+    if (len < 0)
+    {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+            return 0;
+        dbg("Failed to read from " << fd);
+        return -1;
+    }
+    return (long)len;
+}
+
+long PosixSerial::write(const unsigned char *buf, long len)
+{
+    long done = 0;
+    while (done < len)
+    {
+        ssize_t n = ::write(fd, buf + done, len - done);
+        if (n >= 0)
+        {
+            done += (long)n;
+            continue;
+        }
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+        {
+            dbg("Failed to write to " << fd);
+            return -1;
+        }
+
+        // output buffer full, wait for the driver to drain it
+        struct pollfd pfd = { fd, POLLOUT, 0 };
+        if (::poll(&pfd, 1, 100) <= 0)
+            break;
+    }
+    return done;
+}
+
+UartSerial *UartSerial::create()
+{
+    return new PosixSerial;
+}
+
+//-------------------------------------------------------------------------------------------------------
+// one epoll instance for all ports, plus an eventfd for wake()
+
+class PosixPoller : public UartPoller
+{
+public:
+    PosixPoller();
+    ~PosixPoller();
+
+    virtual bool add(UartSerial *port);
+    virtual void remove(UartSerial *port);
+
+    virtual int  wait(double timeout);
+    virtual void wake() { wakeFd(evfd); }
+
+private:
+    int ep;   // epoll instance
+    int evfd; // eventfd for wake()
+};
+
+PosixPoller::PosixPoller()
+{
+    ep = epoll_create1(EPOLL_CLOEXEC);
+    evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = 0; // wake
+    epoll_ctl(ep, EPOLL_CTL_ADD, evfd, &ev);
+}
+
+PosixPoller::~PosixPoller()
+{
+    ::close(evfd);
+    ::close(ep);
+}
+
+bool PosixPoller::add(UartSerial *port)
+{
+    PosixSerial *p = (PosixSerial *)port;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = p;
+    p->events = 0;
+    return epoll_ctl(ep, EPOLL_CTL_ADD, p->fd, &ev) == 0;
+}
+
+void PosixPoller::remove(UartSerial *port)
+{
+    PosixSerial *p = (PosixSerial *)port;
+    if (p->fd >= 0)
+        epoll_ctl(ep, EPOLL_CTL_DEL, p->fd, 0);
+    p->events = 0;
+}
+
+int PosixPoller::wait(double timeout)
+{
+    // the sub-millisecond remainder of a timeout is spun by the caller
+    int ms = (timeout < 0) ? -1 : (int)(timeout * 1000.0);
+
+    struct epoll_event evs[16];
+    int n = epoll_wait(ep, evs, 16, ms);
+    if (n < 0)
+        return 0; // EINTR, caller loops
+
+    int res = 0;
+    for (int i = 0; i < n; i++)
+    {
+        PosixSerial *p = (PosixSerial *)evs[i].data.ptr;
+        if (!p)
+        {
+            clearFd(evfd);
+            res |= UartSerial::kWoken;
+        }
+        else if (evs[i].events & (EPOLLERR | EPOLLHUP))
+        {
+            p->events = -1; // device gone
+            res |= UartSerial::kReadable;
+        }
+        else if (evs[i].events & EPOLLIN)
+        {
+            p->events = UartSerial::kReadable;
+            res |= UartSerial::kReadable;
+        }
+    }
+    return res;
+}
+
+UartPoller *UartPoller::create()
+{
+    return new PosixPoller;
+}
+
+//-------------------------------------------------------------------------------------------------------
+// USB serial devices, plus additional ports (e.g. pseudo terminals) given in
+// the environment variable PIZMIDI_UART_PORTS, separated by ':'
+
+void listSerialPorts(std::vector<std::string>& names)
+{
+    names.clear();
+
+    DIR *dir = opendir("/dev");
+    if (dir)
+    {
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != 0)
+        {
+            if ((strncmp(ent->d_name, "ttyUSB", 6) == 0) || (strncmp(ent->d_name, "ttyACM", 6) == 0))
+                names.push_back(std::string("/dev/") + ent->d_name);
+        }
+        closedir(dir);
+    }
+
+    const char *extra = getenv("PIZMIDI_UART_PORTS");
+    while (extra && *extra)
+    {
+        const char *end = strchr(extra, ':');
+        size_t len = end ? (size_t)(end - extra) : strlen(extra);
+        if (len > 0)
+            names.push_back(std::string(extra, len));
+        extra = end ? end + 1 : 0;
+    }
+    std::sort(names.begin(), names.end(), portLess);
+}
+
+//-------------------------------------------------------------------------------------------------------
+// inotify on /dev for device nodes being created or removed
+
+class PosixPortWatcher : public UartPortWatcher
+{
+public:
+    PosixPortWatcher();
+    ~PosixPortWatcher();
+
+    virtual bool hasNotification() const { return wd >= 0; }
+    virtual bool wait(double timeout);
+    virtual void wake() { wakeFd(evfd); }
+
+private:
+    int infd; // inotify instance
+    int wd;   // watch on /dev
+    int evfd; // eventfd for wake()
+};
+
+PosixPortWatcher::PosixPortWatcher()
+    : wd(-1)
+{
+    evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    infd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (infd >= 0)
+        wd = inotify_add_watch(infd, "/dev", IN_CREATE | IN_DELETE | IN_ATTRIB);
+    if (wd < 0)
+        dbg("No device notifications, polling serial ports");
+}
+
+PosixPortWatcher::~PosixPortWatcher()
+{
+    if (infd >= 0)
+        ::close(infd);
+    ::close(evfd);
+}
+
+bool PosixPortWatcher::wait(double timeout)
+{
+    struct pollfd pfd[2] = { { evfd, POLLIN, 0 }, { infd, POLLIN, 0 } };
+    int n = poll(pfd, (infd >= 0) ? 2 : 1, (timeout < 0) ? -1 : (int)(timeout * 1000.0));
+    if (n <= 0)
+        return false;
+
+    if (pfd[0].revents)
+        clearFd(evfd);
+
+    if ((infd >= 0) && pfd[1].revents)
+    {
+        char buf[4096];
+        while (::read(infd, buf, sizeof(buf)) > 0)
+            ; // any change in /dev
+        return true;
+    }
+    return false;
+}
+
+UartPortWatcher *UartPortWatcher::create()
+{
+    return new PosixPortWatcher;
+}
+
+#endif
@@ -0,0 +1,84 @@
+/*-----------------------------------------------------------------------------
+UartSerial
+serial port backends for midiUartBridge (Win32 overlapped I/O, POSIX termios/epoll)
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#ifndef UARTSERIAL_H
+#define UARTSERIAL_H
+
+#include <string>
+#include <vector>
+
+#define UART_BAUD_RATE 115200 // default, and start of the baud rate negotiation
+
+//-------------------------------------------------------------------------------------------------------
+// Serial port backend. All calls are made from a single I/O thread (open/close may also be
+// called by another thread while the port is not attached to a poller).
+// read() and write() never block for long.
+
+class UartSerial
+{
+public:
+    enum { kReadable = 1, kWoken = 2 };
+
+    virtual ~UartSerial() {}
+
+    virtual bool open(const char *name, long baud) = 0;
+    virtual void close() = 0;
+    virtual bool isOpen() const = 0;
+    virtual bool setBaud(long baud) = 0; // 8N1, bytes already written go out at the old rate
+    virtual bool setFlowControl(bool rtsCts) = 0; // hardware handshake of the transmit direction
+    virtual long txQueued(bool& held) = 0; // bytes written but not sent yet (-1 if unknown), held: CTS off
+
+    virtual long read(unsigned char *buf, long maxlen) = 0;   // bytes read, -1 on error
+    virtual long write(const unsigned char *buf, long len) = 0; // bytes written, -1 on error
+
+    virtual int  poll() = 0; // after UartPoller::wait(): kReadable, 0 if nothing to read, -1 on error
+
+    static UartSerial *create(); // backend of this platform
+};
+
+//-------------------------------------------------------------------------------------------------------
+// Waits on several open ports at once, so that one I/O thread can service all of them.
+// add(), remove() and wait() are called from the I/O thread, wake() from any thread.
+
+class UartPoller
+{
+public:
+    virtual ~UartPoller() {}
+
+    virtual bool add(UartSerial *port) = 0;    // port must be open
+    virtual void remove(UartSerial *port) = 0; // before closing the port
+
+    virtual int  wait(double timeout) = 0; // UartSerial::kReadable (check each poll()) | kWoken, 0 on timeout (< 0: forever)
+    virtual void wake() = 0;               // any thread, interrupts wait()
+
+    static UartPoller *create(); // backend of this platform
+};
+
+//-------------------------------------------------------------------------------------------------------
+// Enumerates the serial ports of this system, e.g. "COM3" or "/dev/ttyACM0", sorted.
+
+void listSerialPorts(std::vector<std::string>& names);
+
+//-------------------------------------------------------------------------------------------------------
+// Waits for serial devices being plugged in or removed.
+// Uses the OS notification if available (WM_DEVICECHANGE, inotify on /dev),
+// otherwise wait() simply times out and the caller polls.
+// The notification is set up by the first wait() and released by detach(),
+// both must be called on the same (waiting) thread.
+
+class UartPortWatcher
+{
+public:
+    virtual ~UartPortWatcher() {}
+
+    virtual bool hasNotification() const = 0;
+    virtual bool wait(double timeout) = 0; // true if devices changed (may be spurious)
+    virtual void wake() = 0;               // any thread, interrupts wait()
+    virtual void detach() {}
+
+    static UartPortWatcher *create();
+};
+
+#endif
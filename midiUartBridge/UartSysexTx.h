@@ -0,0 +1,102 @@
+/*-----------------------------------------------------------------------------
+UartSysexTx
+sysex transmit of midiUartBridge
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#ifndef UARTSYSEXTX_H
+#define UARTSYSEXTX_H
+
+#include "../common/PizRing.h"
+#include "../common/MIDI.h"
+
+//-------------------------------------------------------------------------------------------------------
+// Sysex transmit of one serial port. The audio thread copies complete dumps into a
+// lock-free byte ring (all or nothing, it never waits), the I/O worker sends them in
+// between the other messages, as far as the link and the flow control allow:
+//
+// - None:     as fast as the link allows
+// - RTS/CTS:  the driver stops while the device clears CTS, the worker then writes
+//             nothing (notes wait in the transmit queue instead of the driver)
+// - XON/XOFF: sysex pauses on XOFF from the device until XON, other messages continue
+// - Paced:    sysex limited to a byte rate, for devices without flow control
+//
+// The counters may be read by any thread.
+
+enum
+{
+    kFlowNone,
+    kFlowRtsCts,
+    kFlowXonXoff,
+    kFlowPaced,
+
+    kNumFlowModes
+};
+
+static inline const char *getFlowModeName(int mode)
+{
+    switch (mode)
+    {
+    case kFlowRtsCts:  return "RTS/CTS";
+    case kFlowXonXoff: return "XON/XOFF";
+    case kFlowPaced:   return "Paced";
+    }
+    return "None";
+}
+
+#define UART_SYSEX_BUFFER 65536 // bytes per port, limits the size of a dump
+
+class UartSysexTx
+{
+public:
+    UartSysexTx() : sent(0), rejected(0), held(0), inDump(false), xoff(false), credit(0), creditTime(0) {}
+
+    bool push(const unsigned char *dump, long len) // audio thread, false if malformed or no room
+    {
+        if ((len < 2) || (dump[0] != MIDI_SYSEX) || (dump[len - 1] != MIDI_EOX) || !bytes.write(dump, (unsigned)len))
+        {
+            rejected++;
+            return false;
+        }
+        return true;
+    }
+
+    long pending() const { return bytes.size(); } // bytes waiting, any thread
+
+    // worker only, from here on
+
+    long take(unsigned char *out, long max) // next bytes, up to the end of the current dump
+    {
+        long n = 0;
+        unsigned char c;
+        while ((n < max) && bytes.pop(c))
+        {
+            out[n++] = c;
+            inDump = (c != MIDI_EOX);
+            if (!inDump)
+                break;
+        }
+        sent += n;
+        return n;
+    }
+
+    void clear() // new port, a partial dump is of no use
+    {
+        bytes.clear();
+        inDump = xoff = false;
+        credit = 0;
+    }
+
+    std::atomic<long> sent;     // bytes written
+    std::atomic<long> rejected; // dumps not accepted
+    std::atomic<long> held;     // times stopped by the device (XOFF, CTS)
+
+    bool   inDump;     // between F0 and F7
+    bool   xoff;       // stopped by the device
+    double credit;     // paced mode, bytes which may be sent
+    double creditTime; // of the last update
+
+private:
+    PizRing<unsigned char, UART_SYSEX_BUFFER> bytes; // complete dumps, F0 .. F7
+};
+
+#endif
@@ -0,0 +1,147 @@
+/*-----------------------------------------------------------------------------
+UartTxQueue
+transmit scheduling of midiUartBridge
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#ifndef UARTTXQUEUE_H
+#define UARTTXQUEUE_H
+
+#include "../common/PizRing.h"
+#include "../common/MIDI.h"
+
+struct UartTxEvent
+{
+    double time;     // when to write to the UART (pizTimeNow)
+    char   data[3];
+    char   len;
+    char   cable;    // virtual cable (ignored for raw MIDI)
+};
+
+//-------------------------------------------------------------------------------------------------------
+// Transmit queue of one serial port, used by the I/O worker only (the counters may be
+// read by any thread). A slow link (115200 baud = 3 bytes in 260 us) easily gets flooded
+// by controller sweeps, so messages are split into two lanes:
+//
+// - ordered lane: notes, program changes and all messages whose order matters
+//   (bank select, data entry, (N)RPN, switch pedals, channel mode), sent first, in order
+// - value lane: continuous controllers, pitch bend and pressure. Only the latest value
+//   per controller (channel, cable) is kept, a newer value replaces one not yet sent.
+//
+// Only the next message due is taken, so the worker can write as much as the link can
+// transmit and the rest keeps getting thinned out instead of queueing up in the driver.
+
+#define UART_TX_SLOTS (2 * MIDI_MAX_CHANNELS * MIDI_MAX_CC + 2 * MIDI_MAX_CHANNELS) // CC, poly pressure, bend, pressure
+
+class UartTxQueue
+{
+public:
+    UartTxQueue() : merged(0), dropped(0), depth(0), fromSlot(false) { clear(); }
+
+    void clear()
+    {
+        ordered.clear();
+        order.clear();
+        for (int i = 0; i < UART_TX_SLOTS; i++)
+            pending[i] = false;
+        depth = 0;
+    }
+
+    void push(const UartTxEvent& ev)
+    {
+        int s = getSlot(ev);
+        if (s < 0)
+        {
+            if (ordered.push(ev))
+                depth++;
+            else
+                dropped++;
+        }
+        else if (pending[s]) // superseded, keep the time of the first
+        {
+            for (int i = 0; i < 3; i++)
+                slots[s].data[i] = ev.data[i];
+            merged++;
+        }
+        else if (order.push((unsigned short)s))
+        {
+            slots[s] = ev;
+            pending[s] = true;
+            depth++;
+        }
+        else
+            dropped++;
+    }
+
+    const UartTxEvent *next(double now) // most urgent message due, 0 if none
+    {
+        const UartTxEvent *ev = ordered.peek();
+        fromSlot = false;
+        if (ev && (ev->time <= now))
+            return ev;
+
+        const unsigned short *s = order.peek();
+        fromSlot = true;
+        if (s && (slots[*s].time <= now))
+            return &slots[*s];
+        return 0;
+    }
+
+    void pop() // removes the message returned by next()
+    {
+        unsigned short s;
+        if (!fromSlot)
+            ordered.discard();
+        else if (order.pop(s))
+            pending[s] = false;
+        depth--;
+    }
+
+    double nextTime() const // of the earliest message, 0 if empty
+    {
+        const UartTxEvent *ev = ordered.peek();
+        const unsigned short *s = order.peek();
+        double t = ev ? ev->time : 0;
+        if (s && ((t == 0) || (slots[*s].time < t)))
+            t = slots[*s].time;
+        return t;
+    }
+
+    std::atomic<long> merged;   // superseded values not sent
+    std::atomic<long> dropped;  // queue full
+    std::atomic<int>  depth;    // messages waiting
+
+private:
+    // value lane slot of a message, -1 for the ordered lane
+    static int getSlot(const UartTxEvent& ev)
+    {
+        int status  = ev.data[0] & 0xF0;
+        int channel = (ev.data[0] + ev.cable) & 0x0F; // cable mode sends all cables on one channel
+        int cc = ev.data[1] & 0x7F;
+
+        switch (status)
+        {
+        case MIDI_CONTROLCHANGE:
+            if ((cc == MIDI_BANK_CHANGE) || (cc == MIDI_LSB) || (cc == MIDI_DATA_ENTRY) || (cc == MIDI_LSB + MIDI_DATA_ENTRY)
+                || ((cc >= MIDI_SUSTAIN) && (cc <= MIDI_HOLD_2))
+                || ((cc >= MIDI_DATA_INCREMENT) && (cc <= MIDI_REG_PARAM_NUM_MSB))
+                || (cc >= MIDI_ALL_SOUND_OFF))
+                return -1; // order matters
+            return channel * MIDI_MAX_CC + cc;
+        case MIDI_POLYKEYPRESSURE:
+            return (MIDI_MAX_CHANNELS + channel) * MIDI_MAX_CC + cc;
+        case MIDI_PITCHBEND:
+            return 2 * MIDI_MAX_CHANNELS * MIDI_MAX_CC + channel;
+        case MIDI_CHANNELPRESSURE:
+            return 2 * MIDI_MAX_CHANNELS * MIDI_MAX_CC + MIDI_MAX_CHANNELS + channel;
+        }
+        return -1;
+    }
+
+    PizRing<UartTxEvent, 1024> ordered;
+    PizRing<unsigned short, 8192> order; // slots pending, oldest first
+    UartTxEvent slots[UART_TX_SLOTS];
+    bool pending[UART_TX_SLOTS];
+    bool fromSlot; // of the last next()
+};
+
+#endif
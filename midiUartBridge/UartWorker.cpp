@@ -0,0 +1,976 @@
+/*-----------------------------------------------------------------------------
+UartWorker
+serial I/O thread of midiUartBridge
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#include "UartWorker.h"
+#include "../common/PizClock.h"
+#include "../common/pizvstbase.h" // dbg
+#include <cmath>
+#include <cstring>
+
+UartWorker::UartWorker()
+    : notify(0), quit(false), protocol(kUartRaw), probing(false), flow(kFlowNone), sysexRate(3125), changes(false)
+{
+    poller = UartPoller::create();
+}
+
+UartWorker::~UartWorker()
+{
+    stop();
+    delete poller;
+}
+
+void UartWorker::start(UartPortWatcher *n)
+{
+    if (thread.joinable())
+        return;
+
+    notify = n;
+    quit = false;
+#ifdef _WIN32
+    timeBeginPeriod(1); // 1ms wait granularity for the transmit schedule
+#endif
+    thread = std::thread(&UartWorker::run, this);
+}
+
+void UartWorker::stop()
+{
+    if (thread.joinable())
+    {
+        quit = true;
+        poller->wake();
+        thread.join();
+#ifdef _WIN32
+        timeEndPeriod(1);
+#endif
+    }
+    for (short n = 0; n < UART_MAX_LINKS; n++)
+        attach(n, 0);
+}
+
+void UartWorker::attach(short n, UartSerial *port, long baud)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    links[n].pending = port;
+    links[n].pendingBaud = baud;
+    links[n].changed = true;
+    changes = true;
+
+    if (!thread.joinable()) // no worker, take over directly
+    {
+        lock.unlock();
+        update();
+        return;
+    }
+    poller->wake();
+    taken.wait(lock, [&] { return !links[n].changed; });
+}
+
+// takes over ports handed over by attach(), worker thread
+void UartWorker::update()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    changes = false;
+
+    for (short n = 0; n < UART_MAX_LINKS; n++)
+    {
+        UartLink& l = links[n];
+        if (!l.changed)
+            continue;
+
+        l.changed = false;
+        l.running = false;
+        l.failed = false;
+        l.stats.baud = 0;
+        if (l.port)
+            poller->remove(l.port);
+        l.port = l.pending;
+        l.pending = 0;
+        if (!l.port)
+            continue;
+
+        l.tx.clear(); // stale messages of a previous port
+        l.queue.clear();
+        l.realTime.clear();
+        l.sysex.clear();
+        l.flow = -1;
+        l.ctsHeld = false;
+        l.busyUntil = 0;
+        l.probeSent = l.probeNext = 0;
+        l.negState = (l.pendingBaud > 0) ? kNegDone : kNegStart;
+        setRate(n, (l.pendingBaud > 0) ? l.pendingBaud : UART_BAUD_RATE);
+        l.recvPos = l.recvLen = 0;
+        l.recvSeq = -1;
+        l.devClock.reset();
+        if (poller->add(l.port))
+            l.running = true;
+        else
+            setFailed(n);
+    }
+    taken.notify_all();
+}
+
+void UartWorker::setFailed(short n)
+{
+    UartLink& l = links[n];
+    poller->remove(l.port); // until detached
+    l.running = false;
+    l.failed = true;
+    if (notify)
+        notify->wake();
+}
+
+bool UartWorker::send(short n, const char *msg, short len, double time, short cable)
+{
+    if (!isRunning(n))
+        return false;
+
+    UartTxEvent ev;
+    ev.time = time;
+    ev.len = (char)len;
+    ev.cable = (char)cable;
+    for (short i = 0; i < len; i++)
+        ev.data[i] = msg[i];
+
+    if (!links[n].tx.push(ev))
+    {
+        links[n].queue.dropped++;
+        dbg("UART transmit queue overflow");
+        return false;
+    }
+    poller->wake();
+    return true;
+}
+
+bool UartWorker::sendSysex(short n, const unsigned char *dump, long len)
+{
+    if (!isRunning(n))
+        return false;
+
+    if (!links[n].sysex.push(dump, len))
+    {
+        dbg("UART sysex buffer overflow");
+        return false;
+    }
+    poller->wake();
+    return true;
+}
+
+// packs due messages into one frame, returns its encoded length incl. delimiter (0 if none due)
+long UartWorker::makeFrame(short link, unsigned char *out, double now, long budget)
+{
+    UartLink& l = links[link];
+    unsigned char pkt[UART_FRAME_MAX];
+    long len = UART_FRAME_HEADER;
+
+    double time = 0; // of the first message
+    const UartTxEvent *ev;
+    while ((ev = l.queue.next(now)) && (len + 1 + ev->len + 2 <= UART_FRAME_MAX)
+           && (len + 1 + ev->len + 4 <= budget)) // crc, COBS overhead and delimiter
+    {
+        if (len == UART_FRAME_HEADER)
+            time = ev->time;
+        pkt[len++] = getFrameDt(ev->time - time);
+        for (int i = 0; i < ev->len; i++)
+            pkt[len++] = ev->data[i];
+        if ((unsigned char)ev->data[0] == UART_PROBE)
+            l.probeSent = now;
+        l.queue.pop();
+    }
+    if (len == UART_FRAME_HEADER)
+        return 0;
+    return encodeFrame(link, pkt, len, out, time);
+}
+
+// Encodes the real-time messages due when the next byte reaches the wire (at time wire),
+// returns the number of bytes (0 if none due or no room). Their delay is measured
+// against the time they were scheduled for.
+long UartWorker::putRealTime(short link, unsigned char *out, long room, double wire)
+{
+    UartLink& l = links[link];
+    int p = protocol;
+    long len = 0;
+
+    const UartTxEvent *ev;
+    while ((ev = l.realTime.peek()) && (ev->time <= wire))
+    {
+        long n;
+        if (p == kUartFramed)
+        {
+            if (room - len < 16)
+                break;
+            unsigned char pkt[UART_FRAME_HEADER + 2 + 2];
+            pkt[UART_FRAME_HEADER] = 0; // dt
+            pkt[UART_FRAME_HEADER + 1] = ev->data[0];
+            n = encodeFrame(link, pkt, UART_FRAME_HEADER + 2, &out[len], ev->time);
+        }
+        else if (p == kUartCables)
+        {
+            if (room - len < UART_CABLE_PACKET)
+                break;
+            makeCablePacket(&out[len], 0, ev->data, 1);
+            n = UART_CABLE_PACKET;
+        }
+        else
+        {
+            if (room - len < 1)
+                break;
+            out[len] = ev->data[0];
+            n = 1;
+        }
+        len += n;
+
+        long late = (long)((wire - ev->time) * 1e6);
+        if (late > l.stats.clockLate)
+            l.stats.clockLate = late;
+        l.realTime.discard();
+    }
+    return len;
+}
+
+// Encodes the sysex bytes which may be sent now (flow control, pacing) into at most room bytes,
+// the first of them reaching the wire at time wire. Returns the number of bytes.
+long UartWorker::putSysex(short link, unsigned char *out, long room, double wire, double now)
+{
+    UartLink& l = links[link];
+    UartSysexTx& sx = l.sysex;
+    const double byteTime = 10.0 / l.baud; // 8N1
+    int p = protocol;
+    int f = flow;
+
+    long pending = sx.pending();
+    if ((pending == 0) || ((f == kFlowXonXoff) && sx.xoff))
+        return 0;
+
+    long allowed = room;
+    if (f == kFlowPaced)
+    {
+        long rate = sysexRate;
+        double burst = std::max((double)UART_SYSEX_FRAGMENT, rate * UART_TX_BACKLOG);
+        sx.credit = std::min(sx.credit + (now - sx.creditTime) * rate, burst);
+        sx.creditTime = now;
+        allowed = std::min(allowed, (long)sx.credit);
+    }
+
+    long len = 0;
+    long taken = 0;
+    if (p == kUartFramed) // fragments in frames of their own
+    {
+        for (;;)
+        {
+            if (sx.pending() == 0)
+                break; // dump sent, no empty fragment after it
+            long n = std::min(std::min((long)UART_SYSEX_FRAGMENT, room - len - 12), allowed - taken); // frame overhead
+            if (n < std::min(sx.pending(), 4L))
+                break; // not worth a frame
+
+            unsigned char pkt[UART_FRAME_MAX];
+            pkt[UART_FRAME_HEADER] = 0; // dt
+            pkt[UART_FRAME_HEADER + 1] = MIDI_SYSEX;
+            long k = sx.take(&pkt[UART_FRAME_HEADER + 3], n);
+            pkt[UART_FRAME_HEADER + 2] = (unsigned char)k;
+            len += encodeFrame(link, pkt, UART_FRAME_HEADER + 3 + k, &out[len], now);
+            taken += k;
+            len += putRealTime(link, &out[len], room - len, wire + len * byteTime);
+        }
+    }
+    else if (p == kUartCables) // 3 bytes per packet, cable 0
+    {
+        while (room - len >= UART_CABLE_PACKET)
+        {
+            if (sx.pending() == 0)
+                break;
+            long n = std::min(3L, allowed - taken);
+            if (n < std::min(sx.pending(), 3L))
+                break;
+
+            unsigned char bytes[3];
+            long k = sx.take(bytes, n);
+            makeSysexPacket(&out[len], 0, bytes, (short)k, !sx.inDump);
+            len += UART_CABLE_PACKET;
+            taken += k;
+            len += putRealTime(link, &out[len], room - len, wire + len * byteTime);
+        }
+    }
+    else // raw MIDI, real-time messages may go in between
+    {
+        while ((len < room) && (taken < allowed))
+        {
+            len += putRealTime(link, &out[len], room - len, wire + len * byteTime);
+            if ((len >= room) || (sx.take(&out[len], 1) == 0))
+                break;
+            len++;
+            taken++;
+            if (!sx.inDump)
+                break; // end of the dump, queued messages go first
+        }
+    }
+
+    if (f == kFlowPaced)
+        sx.credit -= taken;
+    return len;
+}
+
+// when pending sysex may be sent next, 0 if none or stopped by the device
+double UartWorker::sysexDue(short link, long window)
+{
+    UartLink& l = links[link];
+    UartSysexTx& sx = l.sysex;
+    const double byteTime = 10.0 / l.baud; // 8N1
+    int f = flow;
+    int p = protocol;
+
+    long pending = sx.pending();
+    if ((pending == 0) || ((f == kFlowXonXoff) && sx.xoff))
+        return 0; // until XON
+
+    long need = 1; // bytes on the wire
+    if (p == kUartFramed) // fragments as large as the window allows, a frame costs 12 bytes
+        need = std::min(window, std::min(pending, (long)UART_SYSEX_FRAGMENT) + 12);
+    else if (p == kUartCables)
+        need = UART_CABLE_PACKET;
+    double t = l.busyUntil - (window - need) * byteTime; // when the link has room
+    if (f == kFlowPaced) // again when there is credit for the next packet
+    {
+        long need = std::min(pending, (p == kUartFramed) ? 16L : (p == kUartCables) ? 3L : 1L);
+        long rate = sysexRate;
+        if (sx.credit < need)
+            t = std::max(t, sx.creditTime + (need - sx.credit) / rate);
+    }
+    return t;
+}
+
+void UartWorker::flowReceived(short n, bool on) // used with XON/XOFF only
+{
+    UartSysexTx& sx = links[n].sysex;
+    if (!on && !sx.xoff)
+        sx.held++;
+    sx.xoff = !on;
+}
+
+// completes header (time of the first message) and crc of a frame, returns its encoded
+// length incl. delimiter
+long UartWorker::encodeFrame(short link, unsigned char *pkt, long len, unsigned char *out, double time)
+{
+    UartLink& l = links[link];
+    unsigned int t = (unsigned int)(long long)(time * 1e6);
+    pkt[0] = l.txSeq++;
+    pkt[1] = (unsigned char)t;
+    pkt[2] = (unsigned char)(t >> 8);
+    pkt[3] = (unsigned char)(t >> 16);
+    pkt[4] = (unsigned char)(t >> 24);
+
+    unsigned short crc = uartCrc16(pkt, len);
+    pkt[len++] = (unsigned char)crc;
+    pkt[len++] = (unsigned char)(crc >> 8);
+
+    long n = cobsEncode(pkt, len, out);
+    out[n++] = 0; // delimiter
+    return n;
+}
+
+// Writes the messages of a link which are due, as far as the link can transmit them
+// within UART_TX_BACKLOG. Everything else stays in the queue, where controller values
+// keep getting merged and notes can still overtake. Frames always get room for a full
+// one (at 115200 baud more than UART_TX_BACKLOG), and a busy link is written to again
+// when there is, so the messages due meanwhile share one frame instead of paying its
+// overhead each. Returns the time to call again (0: idle).
+double UartWorker::flushTx(short link)
+{
+    const double byteTime = 10.0 / links[link].baud; // 8N1
+    const long frame = (protocol == kUartFramed) ? UART_FRAME_ENCODED : UART_CABLE_PACKET; // room to wait for
+    const long window = std::max((long)(UART_TX_BACKLOG / byteTime), frame);
+    UartLink& l = links[link];
+
+    UartTxEvent ev;
+    while (l.tx.pop(ev)) // take over from audio thread
+    {
+        if (!isRealTime(ev.data[0]))
+            l.queue.push(ev);
+        else if (!l.realTime.push(ev))
+            l.queue.dropped++;
+    }
+
+    int f = flow;
+    if (f != l.flow)
+    {
+        if (!l.port->setFlowControl(f == kFlowRtsCts))
+            dbg("Failed to set flow control");
+        l.flow = f;
+    }
+
+    if (l.negState != kNegDone) // hold back everything else
+        return negotiate(link, pizTimeNow());
+
+    double probeNext = probing ? sendProbe(link, pizTimeNow()) : 0;
+
+    for (;;)
+    {
+        unsigned char buf[256];
+        long len = 0;
+        double now = pizTimeNow();
+        int p = protocol;
+        bool cables = (p == kUartCables);
+
+        if (l.busyUntil < now)
+            l.busyUntil = now; // idle
+
+        if (f == kFlowRtsCts) // bytes may wait in the driver
+        {
+            bool held = false;
+            long queued = l.port->txQueued(held);
+            if (held) // write nothing, the queue keeps merging and prioritizing
+            {
+                if (!l.ctsHeld)
+                    l.sysex.held++;
+                l.ctsHeld = true;
+                return now + 0.001; // until the device clears to send
+            }
+            l.ctsHeld = false;
+            if ((queued >= 0) && (now + queued * byteTime > l.busyUntil))
+                l.busyUntil = now + queued * byteTime;
+        }
+
+        long budget = window - (long)((l.busyUntil - now) / byteTime);
+        if (budget > (long)sizeof(buf) - UART_FRAME_ENCODED)
+            budget = sizeof(buf) - UART_FRAME_ENCODED; // leave room for real-time messages
+
+        // Real-time messages go to the position in the byte stream which reaches the wire
+        // when they are due: between two bytes (raw MIDI), packets or frames.
+        const UartTxEvent *next;
+        if (p == kUartFramed)
+        {
+            for (;;)
+            {
+                double wire = l.busyUntil + len * byteTime;
+                long n = putRealTime(link, &buf[len], sizeof(buf) - len, wire);
+                if (n > 0)
+                {
+                    len += n;
+                    continue;
+                }
+
+                long room = budget - len;
+                if (room < frame) // busy, the messages due meanwhile go into one frame
+                    break;
+                const UartTxEvent *rt = l.realTime.peek();
+                if (rt && (rt->time - wire < room * byteTime)) // end the frame in time
+                    room = (long)((rt->time - wire) / byteTime);
+                if ((n = makeFrame(link, &buf[len], now, room)) <= 0)
+                    break;
+                len += n;
+            }
+        }
+        else
+        while ((cables || !l.sysex.inDump) && (next = l.queue.next(now))) // raw MIDI: not within a dump
+        {
+            short cost = cables ? UART_CABLE_PACKET : next->len;
+            if (len + cost > budget)
+                break;
+
+            if (cables)
+            {
+                len += putRealTime(link, &buf[len], sizeof(buf) - len, l.busyUntil + len * byteTime);
+                makeCablePacket(&buf[len], next->cable, next->data, next->len);
+                len += cost;
+            }
+            else
+            for (short i = 0; i < cost; i++)
+            {
+                len += putRealTime(link, &buf[len], sizeof(buf) - len, l.busyUntil + len * byteTime);
+                buf[len++] = next->data[i];
+            }
+            if ((unsigned char)next->data[0] == UART_PROBE)
+                l.probeSent = now;
+            l.queue.pop();
+        }
+        if ((len < budget) && ((p != kUartFramed) || !l.queue.next(now))) // sysex takes what is left
+                                                                          // (not the room a frame waits for)
+            len += putSysex(link, &buf[len], budget - len, l.busyUntil + len * byteTime, now);
+        len += putRealTime(link, &buf[len], sizeof(buf) - len, l.busyUntil + len * byteTime);
+
+        if (len == 0)
+        {
+            double room = l.busyUntil - (window - frame) * byteTime;
+            double t = 0;
+            if (cables || !l.sysex.inDump) // raw MIDI: the queue waits for the end of the dump
+            {
+                if (l.queue.next(now)) // link busy, again when there is room
+                    t = room;
+                else
+                {
+                    t = l.queue.nextTime();
+                    if ((t == 0) || ((probeNext > 0) && (probeNext < t)))
+                        t = probeNext;
+                }
+            }
+
+            double st = sysexDue(link, window);
+            if ((st > 0) && ((t == 0) || (st < t)))
+                t = st;
+
+            const UartTxEvent *rt = l.realTime.peek();
+            if (rt && ((t == 0) || (t <= now) || (rt->time < t))) // next real-time message, or a frame waiting for it
+                t = rt->time;
+            return t;
+        }
+
+        if (l.port->write(buf, len) != len)
+        {
+            setFailed(link);
+            return 0;
+        }
+        l.busyUntil += len * byteTime;
+    }
+}
+
+// writes a single message right away, bypassing the queue
+void UartWorker::writeMsg(short n, const char *msg, short len)
+{
+    UartLink& l = links[n];
+    unsigned char buf[UART_FRAME_ENCODED];
+    double now = pizTimeNow();
+    long cnt;
+
+    int p = protocol;
+    if (p == kUartCables)
+    {
+        makeCablePacket(buf, 0, msg, len);
+        cnt = UART_CABLE_PACKET;
+    }
+    else if (p == kUartFramed)
+    {
+        unsigned char pkt[UART_FRAME_MAX];
+        pkt[UART_FRAME_HEADER] = 0; // dt
+        memcpy(&pkt[UART_FRAME_HEADER + 1], msg, len);
+        cnt = encodeFrame(n, pkt, UART_FRAME_HEADER + 1 + len, buf, now);
+    }
+    else
+    {
+        memcpy(buf, msg, len);
+        cnt = len;
+    }
+
+    if (l.port->write(buf, cnt) != cnt)
+    {
+        setFailed(n);
+        return;
+    }
+    l.busyUntil = std::max(l.busyUntil, now) + cnt * 10.0 / l.baud;
+}
+
+void UartWorker::setRate(short n, long baud)
+{
+    UartLink& l = links[n];
+    if ((baud != l.baud) && !l.port->setBaud(baud))
+        dbg("Failed to set " << baud << " baud");
+    l.baud = baud;
+    l.busyUntil = 0;
+    if (l.negState == kNegDone)
+        l.stats.baud = baud;
+}
+
+// Baud rate negotiation, see UartProtocol.h. Called by flushTx() until done,
+// returns the time to call again.
+double UartWorker::negotiate(short n, double now)
+{
+    UartLink& l = links[n];
+    switch (l.negState)
+    {
+    case kNegStart:
+    {
+        char msg[3] = { (char)UART_CONTROL, kUartQuery, 0 };
+        writeMsg(n, msg, 3);
+        l.negState = kNegQuery;
+        l.negTime = now + 0.2;
+        break;
+    }
+    case kNegQuery: // no answer, device does not negotiate
+        if (now >= l.negTime)
+        {
+            dbg("No baud rate negotiation");
+            l.negState = kNegDone;
+            setRate(n, UART_BAUD_RATE);
+        }
+        break;
+    case kNegSwitch: // no acknowledge
+        if (now >= l.negTime)
+            nextRate(n, now);
+        break;
+    case kNegProbe: // device switched, verify the new rate
+        if (now >= l.negTime)
+        {
+            char msg[2] = { (char)UART_PROBE, (char)(++l.probeId & 0x7F) };
+            writeMsg(n, msg, 2);
+            l.probeSent = now;
+            l.negState = kNegVerify;
+            l.negTime = now + 0.2;
+        }
+        break;
+    case kNegVerify: // no echo, both fall back
+        if (now >= l.negTime)
+        {
+            dbg(uartRates[l.negRate] << " baud failed");
+            setRate(n, UART_BAUD_RATE);
+            l.probeSent = 0;
+            l.negState = kNegFallback;
+            l.negTime = now + 1.2; // device falls back after 1s
+        }
+        break;
+    case kNegFallback:
+        if (now >= l.negTime)
+            nextRate(n, now);
+        break;
+    }
+    return (l.negState == kNegDone) ? now : l.negTime;
+}
+
+// requests the next slower rate supported by the device, or stays at UART_BAUD_RATE
+void UartWorker::nextRate(short n, double now)
+{
+    UartLink& l = links[n];
+    while (--l.negRate > 0)
+    {
+        if (l.negMask & (1 << l.negRate))
+        {
+            char msg[3] = { (char)UART_CONTROL, kUartSwitch, (char)l.negRate };
+            writeMsg(n, msg, 3);
+            l.negState = kNegSwitch;
+            l.negTime = now + 0.2;
+            return;
+        }
+    }
+    l.negState = kNegDone;
+    setRate(n, UART_BAUD_RATE);
+}
+
+void UartWorker::controlReceived(short n, unsigned char cmd, unsigned char value)
+{
+    UartLink& l = links[n];
+    double now = pizTimeNow();
+
+    if ((cmd == kUartRates) && (l.negState == kNegQuery))
+    {
+        l.negMask = value;
+        l.negRate = UART_NUM_RATES;
+        nextRate(n, now);
+    }
+    else if ((cmd == kUartSwitched) && (l.negState == kNegSwitch) && (value == l.negRate))
+    {
+        setRate(n, uartRates[l.negRate]);
+        l.negState = kNegProbe;
+        l.negTime = now + 0.01; // give the device time to switch as well
+    }
+    else if (cmd == kUartFlow)
+        flowReceived(n, value != 0);
+}
+
+// queues a probe when it is time, returns the time of the next one
+double UartWorker::sendProbe(short n, double now)
+{
+    UartLink& l = links[n];
+    if (now < l.probeNext)
+        return l.probeNext;
+
+    if (l.probeSent > 0) // previous one got no echo
+        l.stats.probeLost++;
+    l.probeSent = 0; // set when written
+
+    UartTxEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.time = now;
+    ev.data[0] = (char)UART_PROBE;
+    ev.data[1] = (char)(++l.probeId & 0x7F);
+    ev.len = 2;
+    l.queue.push(ev);
+
+    l.probeNext = now + UART_PROBE_INTERVAL;
+    return l.probeNext;
+}
+
+void UartWorker::probeReceived(short n, unsigned char id, double time)
+{
+    UartLink& l = links[n];
+    if ((l.probeSent > 0) && (id == (l.probeId & 0x7F)) && (time > l.probeSent))
+    {
+        l.stats.addRtt(time - l.probeSent);
+        l.probeSent = 0;
+
+        if (l.negState == kNegVerify) // new rate works
+        {
+            dbg("Switched to " << uartRates[l.negRate] << " baud");
+            l.negState = kNegDone;
+            setRate(n, uartRates[l.negRate]);
+        }
+    }
+}
+
+void UartWorker::received(short n, const unsigned char *msg, short len, double time, short cable)
+{
+    if (msg[0] == MIDI_TIMINGCLOCK)
+        clockReceived(n, time);
+
+    UartRxEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.time = time;
+    ev.cable = (char)cable;
+    ev.link = (char)n;
+    for (int j = 0; j < len; j++)
+        ev.data[j] = msg[j];
+    if (!rx.push(ev))
+        dbg("UART receive queue overflow");
+}
+
+// Jitter of a received clock: deviation of each interval from the smoothed period
+void UartWorker::clockReceived(short n, double time)
+{
+    UartLink& l = links[n];
+    double interval = time - l.clockTime;
+    l.clockTime = time;
+    if ((interval <= 0) || (interval > 0.2)) // (re)started, slower than 12.5 bpm
+    {
+        l.clockPeriod = 0;
+        return;
+    }
+    if (l.clockPeriod == 0)
+    {
+        l.clockPeriod = interval;
+        return;
+    }
+
+    long jitter = (long)(fabs(interval - l.clockPeriod) * 1e6);
+    if (jitter > l.stats.clockJitter)
+        l.stats.clockJitter = jitter;
+    l.clockPeriod += (interval - l.clockPeriod) / 16; // follows tempo changes
+}
+
+void UartWorker::parse(short n, const unsigned char *buf, long len, double tEnd)
+{
+    UartLink& l = links[n];
+    int p = protocol;
+    if (p != l.recvProtocol) // switched, drop partial message
+    {
+        l.recvProtocol = p;
+        l.recvPos = l.recvLen = 0;
+        l.recvSeq = -1;
+        l.devClock.reset();
+    }
+
+    if (p == kUartCables)
+        parseCables(n, buf, len, tEnd);
+    else if (p == kUartFramed)
+        parseFramed(n, buf, len, tEnd);
+    else
+        parseRaw(n, buf, len, tEnd);
+}
+
+void UartWorker::parseRaw(short n, const unsigned char *buf, long len, double tEnd)
+{
+    UartLink& l = links[n];
+    const double byteTime = 10.0 / l.baud; // 8N1
+
+    for (long i = 0; i < len; i++)
+    {
+        unsigned char c = buf[i];
+        if (c >= 0xF8) // real-time, may interrupt other messages
+        {
+            if (isRealTime(c))
+                received(n, &c, 1, tEnd - (len - 1 - i) * byteTime, 0);
+            continue;
+        }
+
+        if (((c == UART_XON) || (c == UART_XOFF)) && (l.recvPos == 0)) // between messages
+        {
+            flowReceived(n, c == UART_XON);
+            continue;
+        }
+
+        if (c & 0x80) // status
+        {
+            l.recvLen = getUartMsgLen(c);
+            l.recvPos = 0;
+            if (l.recvLen <= 0)
+                continue; // skip
+
+            // bytes of one read arrived back-to-back, the last one at tEnd
+            l.recvTime = tEnd - (len - 1 - i) * byteTime;
+        }
+        else if (l.recvPos == 0)
+            continue; // skip data without status
+
+        l.recvBuf[l.recvPos++] = c;
+        if (l.recvPos >= l.recvLen)
+        {
+            if (l.recvBuf[0] == UART_PROBE)
+                probeReceived(n, l.recvBuf[1], l.recvTime);
+            else if (l.recvBuf[0] == UART_CONTROL)
+                controlReceived(n, l.recvBuf[1], l.recvBuf[2]);
+            else
+                received(n, l.recvBuf, l.recvLen, l.recvTime, 0);
+            l.recvPos = 0;
+            l.recvLen = 0;
+        }
+    }
+}
+
+void UartWorker::parseCables(short n, const unsigned char *buf, long len, double tEnd)
+{
+    UartLink& l = links[n];
+    const double byteTime = 10.0 / l.baud; // 8N1
+
+    for (long i = 0; i < len; i++)
+    {
+        if (l.recvPos == 0)
+        {
+            if ((buf[i] == UART_XON) || (buf[i] == UART_XOFF)) // between packets, never a packet header
+            {
+                flowReceived(n, buf[i] == UART_XON);
+                continue;
+            }
+            // bytes of one read arrived back-to-back, the last one at tEnd
+            l.recvTime = tEnd - (len - 1 - i) * byteTime;
+        }
+
+        l.recvBuf[l.recvPos++] = buf[i];
+        if (l.recvPos < UART_CABLE_PACKET)
+            continue;
+
+        if (isCablePacket(l.recvBuf))
+        {
+            short msgLen = getUartMsgLen(l.recvBuf[1]);
+            if (l.recvBuf[1] == UART_PROBE)
+                probeReceived(n, l.recvBuf[2], l.recvTime);
+            else if (l.recvBuf[1] == UART_CONTROL)
+                controlReceived(n, l.recvBuf[2], l.recvBuf[3]);
+            else if (msgLen > 0)
+                received(n, &l.recvBuf[1], msgLen, l.recvTime, l.recvBuf[0] >> 4);
+            l.recvPos = 0;
+        }
+        else // out of sync, slide by one byte
+        {
+            memmove(l.recvBuf, l.recvBuf + 1, UART_CABLE_PACKET - 1);
+            l.recvPos = UART_CABLE_PACKET - 1;
+        }
+    }
+}
+
+void UartWorker::parseFramed(short n, const unsigned char *buf, long len, double tEnd)
+{
+    UartLink& l = links[n];
+    const double byteTime = 10.0 / l.baud; // 8N1
+
+    for (long i = 0; i < len; i++)
+    {
+        unsigned char c = buf[i];
+        if (c == 0) // delimiter
+        {
+            if (l.recvPos > 0)
+                receivedFrame(n);
+            l.recvPos = 0;
+            continue;
+        }
+
+        if (l.recvPos == 0) // bytes of one read arrived back-to-back, the last one at tEnd
+            l.recvTime = tEnd - (len - 1 - i) * byteTime;
+        if (l.recvPos < UART_FRAME_ENCODED)
+            l.recvBuf[l.recvPos++] = c;
+        else
+            l.recvPos = UART_FRAME_ENCODED; // too long, dropped at the delimiter
+    }
+}
+
+void UartWorker::receivedFrame(short n)
+{
+    UartLink& l = links[n];
+    unsigned char pkt[UART_FRAME_ENCODED];
+
+    long len = (l.recvPos < UART_FRAME_ENCODED) ? cobsDecode(l.recvBuf, l.recvPos, pkt) : -1;
+    if ((len < UART_FRAME_HEADER + 2) || (uartCrc16(pkt, len - 2) != (pkt[len - 2] | (pkt[len - 1] << 8))))
+    {
+        l.stats.rxBad++;
+        return;
+    }
+    len -= 2; // crc
+
+    if (l.recvSeq >= 0)
+        l.stats.rxLost += (pkt[0] - l.recvSeq - 1) & 0xFF;
+    l.recvSeq = pkt[0];
+    l.stats.rxFrames++;
+
+    unsigned int devTime = pkt[1] | (pkt[2] << 8) | (pkt[3] << 16) | ((unsigned int)pkt[4] << 24);
+    double t = l.devClock.update(devTime, l.recvTime);
+
+    long i = UART_FRAME_HEADER;
+    while (i + 1 < len)
+    {
+        short msgLen = getUartMsgLen(pkt[i + 1]);
+        if ((msgLen <= 0) || (i + 1 + msgLen > len))
+            break;
+        if (pkt[i + 1] == UART_PROBE) // round trip, not re-timed
+            probeReceived(n, pkt[i + 2], l.recvTime);
+        else if (pkt[i + 1] == UART_CONTROL)
+            controlReceived(n, pkt[i + 2], pkt[i + 3]);
+        else
+            received(n, &pkt[i + 1], msgLen, t + pkt[i] * 100e-6, 0);
+        i += 1 + msgLen;
+    }
+    if (i != len)
+        l.stats.rxBad++; // malformed message
+}
+
+void UartWorker::run()
+{
+    unsigned char buf[256];
+
+    while (!quit)
+    {
+        if (changes)
+            update();
+
+        double due = 0;
+        for (short n = 0; n < UART_MAX_LINKS; n++)
+        {
+            if (!links[n].running)
+                continue;
+            double t = flushTx(n);
+            if ((t > 0) && ((due == 0) || (t < due)))
+                due = t;
+        }
+
+        double timeOut = -1; // forever
+        if (due > 0) // sleep until the next message is due (spin for the last fraction of a ms)
+        {
+            timeOut = due - pizTimeNow();
+            if (timeOut < 0)
+                timeOut = 0;
+        }
+
+        int res = poller->wait(timeOut);
+        double now = pizTimeNow();
+        if (!(res & UartSerial::kReadable))
+            continue;
+
+        for (short n = 0; n < UART_MAX_LINKS; n++)
+        {
+            if (!links[n].running)
+                continue;
+
+            UartSerial *port = links[n].port;
+            int st = port->poll();
+            if (st < 0)
+            {
+                setFailed(n);
+                continue;
+            }
+            if (!(st & UartSerial::kReadable))
+                continue;
+
+            long len;
+            while ((len = port->read(buf, sizeof(buf))) > 0)
+                parse(n, buf, len, now);
+            if (len < 0)
+                setFailed(n);
+        }
+    }
+}
@@ -0,0 +1,241 @@
+/*-----------------------------------------------------------------------------
+UartWorker
+serial I/O thread of midiUartBridge
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#ifndef UARTWORKER_H
+#define UARTWORKER_H
+
+#include "../common/PizRing.h"
+#include "UartSerial.h"
+#include "UartProtocol.h"
+#include "UartTxQueue.h"
+#include "UartSysexTx.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+//-------------------------------------------------------------------------------------------------------
+// Serial I/O worker: owns all reads and writes of the open serial ports.
+// A single thread services all ports (links) of a bridge instance.
+// Received bytes are timestamped on arrival and parsed into MIDI messages,
+// which are handed to the audio thread through a lock-free ring.
+// Outgoing messages are queued by the audio thread with a target time and
+// written by the worker when they are due, preserving their timing within a block.
+// The wire format (raw MIDI, cable packets or frames) is only known to the worker.
+
+#define UART_MAX_LINKS 8 // serial ports per bridge instance, see kComPort2..kComPort8
+#define UART_TX_BACKLOG 0.002 // bytes written ahead of the wire, bounds the delay of notes behind controllers
+#define UART_PROBE_INTERVAL 0.1 // s
+#define UART_RTT_BINS 1000      // 0.1 ms each, the last one collects everything above
+
+struct UartRxEvent
+{
+    double time;     // arrival time of the status byte (pizTimeNow)
+    char   data[3];
+    char   cable;    // virtual cable (0 for raw MIDI)
+    char   link;     // port it was received on
+};
+
+// Maps the device clock of framed packets (wrapping microseconds) to pizTimeNow().
+// The offset follows the fastest transfer seen (minimum delay), and creeps up slowly
+// so that a device clock running slightly slower than ours is tracked as well.
+
+class UartDeviceClock
+{
+public:
+    UartDeviceClock() : valid(false), last(0), devTime(0), offset(0), lastArrival(0) {}
+
+    void reset() { valid = false; }
+
+    double update(unsigned int t, double arrival) // returns device time t in pizTimeNow()
+    {
+        if (!valid)
+        {
+            valid = true;
+            devTime = 0;
+            offset = arrival;
+        }
+        else
+        {
+            devTime += (unsigned int)(t - last) * 1e-6; // unwrapped
+            offset += (arrival - lastArrival) * 500e-6; // up to 500 ppm slower
+        }
+        last = t;
+        lastArrival = arrival;
+
+        double off = arrival - devTime;
+        if ((off < offset) || (off - offset > 1.0)) // faster transfer, or device restarted
+            offset = off;
+        return devTime + offset;
+    }
+
+private:
+    bool valid;
+    unsigned int last;
+    double devTime;
+    double offset;
+    double lastArrival;
+};
+
+enum // baud rate negotiation states
+{
+    kNegDone,
+    kNegStart,
+    kNegQuery,    // waiting for the rates
+    kNegSwitch,   // waiting for the acknowledge
+    kNegProbe,    // switched, probe not yet sent
+    kNegVerify,   // waiting for the echo at the new rate
+    kNegFallback  // waiting for the device to fall back
+};
+
+struct UartLinkStats // lock-free counters, written by the worker, read by any thread
+{
+    UartLinkStats() : baud(0), rxFrames(0), rxLost(0), rxBad(0), probeLost(0), rttMin(0), rttMax(0),
+                      clockLate(0), clockJitter(0)
+    {
+        for (int i = 0; i < UART_RTT_BINS; i++)
+            rtt[i] = 0;
+    }
+
+    void addRtt(double t) // worker
+    {
+        long us = (long)(t * 1e6);
+        if ((rttMax == 0) || (us < rttMin))
+            rttMin = us;
+        if (us > rttMax)
+            rttMax = us;
+        rtt[std::min(us / 100, (long)UART_RTT_BINS - 1)]++;
+    }
+
+    std::atomic<long> baud;   // current rate, 0 while negotiating or closed
+
+    std::atomic<long> rxFrames;
+    std::atomic<long> rxLost; // frames missing in the sequence
+    std::atomic<long> rxBad;  // frames with framing or CRC errors
+
+    std::atomic<long> probeLost;         // probes without echo
+    std::atomic<long> rttMin;            // round-trip time of probes in us
+    std::atomic<long> rttMax;
+    std::atomic<long> rtt[UART_RTT_BINS]; // histogram
+
+    std::atomic<long> clockLate;   // real-time messages, max. delay on the wire in us
+    std::atomic<long> clockJitter; // received clock, max. deviation from its period in us
+};
+
+struct UartLink
+{
+    UartLink() : port(0), pending(0), pendingBaud(0), changed(false), running(false), failed(false), baud(UART_BAUD_RATE),
+                 negState(0), negRate(0), negMask(0), negTime(0),
+                 flow(-1), ctsHeld(false),
+                 recvProtocol(kUartRaw), recvPos(0), recvLen(0), recvTime(0), recvSeq(-1), txSeq(0), busyUntil(0),
+                 probeId(0), probeSent(0), probeNext(0), clockTime(0), clockPeriod(0) {}
+
+    UartSerial *port;    // attached port, worker thread only
+    UartSerial *pending; // handed over by attach(), guarded by mutex
+    long pendingBaud;
+    bool changed;        // guarded by mutex
+    std::atomic<bool> running;
+    std::atomic<bool> failed;
+    long baud; // current rate
+
+    int    negState; // baud rate negotiation
+    int    negRate;  // index into uartRates
+    int    negMask;  // rates supported by the device
+    double negTime;  // timeout
+
+    PizRing<UartTxEvent, 1024> tx; // produced by audio thread
+    UartTxQueue queue;             // taken over from tx, scheduled by the worker
+    PizRing<UartTxEvent, 64> realTime; // taken over from tx, bypassing the queue
+    UartSysexTx sysex;
+    int flow;     // flow control the port is set to, -1 if not yet
+    bool ctsHeld;
+
+    int    recvProtocol;
+    unsigned char recvBuf[UART_FRAME_ENCODED];
+    short  recvPos;
+    short  recvLen;
+    double recvTime;
+    short  recvSeq; // last frame sequence number, -1 if none
+    unsigned char txSeq;
+    double busyUntil; // when the bytes written so far are on the wire
+    unsigned char probeId;
+    double probeSent; // when the outstanding probe was written, 0 if none
+    double probeNext;
+    UartDeviceClock devClock;
+    double clockTime;   // last received clock
+    double clockPeriod; // smoothed
+
+    UartLinkStats stats;
+};
+
+class UartWorker
+{
+public:
+    UartWorker();
+    ~UartWorker();
+
+    void start(UartPortWatcher *notify);
+    void stop();
+
+    void attach(short link, UartSerial *port, long baud = UART_BAUD_RATE); // port must be open at baud (0: negotiate),
+                                                                          // 0 to detach; returns when the worker took it over
+    bool isRunning(short link) const { return links[link].running.load(); }
+    bool hasFailed(short link) const { return links[link].failed.load(); } // read or write error, notify is woken
+
+    void setProtocol(int p) { protocol = p; } // any thread
+    void setProbe(bool on) { probing = on; poller->wake(); } // any thread
+    bool send(short link, const char *msg, short len, double time, short cable = 0); // audio thread
+    bool sendSysex(short link, const unsigned char *dump, long len);                // audio thread
+    void setFlowControl(int mode) { flow = mode; poller->wake(); } // any thread
+    void setSysexRate(long bytesPerSecond) { sysexRate = bytesPerSecond; } // any thread, paced mode
+    const UartSysexTx& sysexTx(short link) const { return links[link].sysex; } // counters only
+    const UartLinkStats& stats(short link) const { return links[link].stats; }
+    const UartTxQueue& txQueue(short link) const { return links[link].queue; } // counters only
+
+    PizRing<UartRxEvent, 1024> rx; // consumed by audio thread
+
+private:
+    void run();
+    void update();
+    void parse(short link, const unsigned char *buf, long len, double tEnd);
+    void parseRaw(short link, const unsigned char *buf, long len, double tEnd);
+    void parseCables(short link, const unsigned char *buf, long len, double tEnd);
+    void parseFramed(short link, const unsigned char *buf, long len, double tEnd);
+    void receivedFrame(short link);
+    long makeFrame(short link, unsigned char *out, double now, long budget);
+    long putRealTime(short link, unsigned char *out, long room, double wire);
+    long putSysex(short link, unsigned char *out, long room, double wire, double now);
+    double sysexDue(short link, long window);
+    void flowReceived(short link, bool on);
+    void clockReceived(short link, double time);
+    void received(short link, const unsigned char *msg, short len, double time, short cable);
+    void probeReceived(short link, unsigned char id, double time);
+    void controlReceived(short link, unsigned char cmd, unsigned char value);
+    double negotiate(short link, double now);
+    void nextRate(short link, double now);
+    void setRate(short link, long baud);
+    void writeMsg(short link, const char *msg, short len);
+    long encodeFrame(short link, unsigned char *pkt, long len, unsigned char *out, double time);
+    double sendProbe(short link, double now);
+    double flushTx(short link);
+    void setFailed(short link);
+
+    UartLink links[UART_MAX_LINKS];
+    UartPoller *poller;
+    UartPortWatcher *notify;
+    std::thread thread;
+    std::atomic<bool> quit;
+    std::atomic<int>  protocol;
+    std::atomic<bool> probing;
+    std::atomic<int>  flow;
+    std::atomic<long> sysexRate;
+
+    std::mutex mutex;               // attach() handshake
+    std::condition_variable taken;
+    std::atomic<bool> changes;
+};
+
+#endif
@@ -4,163 +4,339 @@ original framework by Reuben Vinal
 specific implementation by H.R.Graf
 -----------------------------------------------------------------------------*/
 #include "../common/PizMidi.h"
+#include "../common/PizRing.h"
+#include "../common/PizClock.h"
+#include "UartSerial.h"
+#include "UartProtocol.h"
+#include "UartWorker.h"
 #include <cstdlib>
+#include <algorithm>
 #include <vector> 
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 enum
 {
     kChannel,
     kComPort,
     kPower,
+    kRxLatency,
+    kTxLatency,
+    kProtocol,
+    kRxChannel,
+    kComPort2, // further ports, bridged on the following channels
+    kComPort3,
+    kComPort4,
+    kComPort5,
+    kComPort6,
+    kComPort7,
+    kComPort8,
+    kRxLost,   // read-only
+    kTxQueue,  // read-only
+    kTxMerged, // read-only
+    kTxDropped, // read-only
+    kProbe,
+    kRttMin,   // read-only
+    kRttP50,   // read-only
+    kRttP99,   // read-only
+    kRttMax,   // read-only
+    kBaudRate,
+    kTxJitter, // read-only
+    kRxJitter, // read-only
+    kFlowControl,
+    kSysexRate,
+    kSysexQueue,   // read-only
+    kSysexSent,    // read-only
+    kSysexDropped, // read-only
+    kSysexHeld,    // read-only
 
     kNumParams,
     kNumPrograms = 4
 };
 
 //-------------------------------------------------------------------------------------------------------
+// Immutable snapshot of the available serial ports (sorted).
+// Published by the monitor through an atomic pointer and never modified afterwards,
+// so it can be read from any thread, including the audio thread.
 
-static short getMidiEvLen(short status)
+struct UartPortList
 {
-    short len = 0;
-    switch (status & 0xF0)
-    {
-    case MIDI_NOTEOFF:         len = 3; break;
-    case MIDI_NOTEON:          len = 3; break;
-    case MIDI_POLYKEYPRESSURE: len = 3; break;
-    case MIDI_PROGRAMCHANGE:   len = 2; break;
-    case MIDI_CHANNELPRESSURE: len = 2; break;
-    case MIDI_PITCHBEND:       len = 3; break;
-    }
-    return len;
+    std::vector<std::string> names;
+};
+
+static const char *getComPortName(const UartPortList *list, float fComPort)
+{
+    short pos = 0;
+    short sz = list ? (short)list->names.size() : 0;
+    if (sz)
+        pos = roundToInt(fComPort * sz); // 0..sz
+    if (pos > 0)
+        return list->names.at(pos - 1).c_str();
+    return 0; // none
 }
 
 //-------------------------------------------------------------------------------------------------------
+// Serial port hot-plug monitor: background thread which enumerates the serial ports and
+// opens, closes and reconnects the requested ports for the serial I/O worker.
+// It is woken by device-change notifications (or polls at a low rate when they are
+// not available), by parameter changes and by I/O errors of the worker.
+// The audio thread never enumerates or opens ports.
 
-static HANDLE openComPort(short nr)
+class UartMonitor
 {
-    char name[10] = { 0 }; // com port id
-    snprintf(name, sizeof(name), "\\\\.\\COM%d", nr);
+public:
+    UartMonitor(UartWorker& worker);
+    ~UartMonitor();
 
-    HANDLE hCom = ::CreateFile(name, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, 0, 0);
-    if (hCom == INVALID_HANDLE_VALUE)
-    {
-        dbg("Failed to open COM" << nr);
-        return INVALID_HANDLE_VALUE;
-    }
+    void start();
+    void stop();
 
-    //Setting the Parameters for the SerialPort
-    DCB dcbSerialParams = { 0 };
-    dcbSerialParams.DCBlength = sizeof(dcbSerialParams);
-    if (!GetCommState(hCom, &dcbSerialParams))
-        dbg("Failed to get COM" << nr << " state");
+    void request(short link, float fComPort); // any thread
+    void setBaud(long baud);                  // any thread, 0 for negotiation, reopens all ports
 
+    const UartPortList *ports() const { return portList.load(std::memory_order_acquire); }
+    long  openErrors() const { return errors.load(); }
 
-    dcbSerialParams.BaudRate = CBR_115200;
-    dcbSerialParams.ByteSize = 8;
-    dcbSerialParams.StopBits = ONESTOPBIT;
-    dcbSerialParams.Parity = NOPARITY;
-    if (! SetCommState(hCom, &dcbSerialParams))
-        dbg("Failed to set COM" << nr << " state");
+private:
+    struct Link
+    {
+        UartSerial *port;
+        std::atomic<float> reqParam;
+        std::atomic<bool>  reqChanged;
+        std::string reqPort; // requested port, empty for none
+        std::string curPort; // open port
+        long curBaud;        // setting it was opened with
+        double retryTime;
+    };
+
+    void run();
+    void enumerate();
+    void connect(short link);
+    void disconnect(short link);
+    bool inUse(const std::string& name) const;
+    bool pending() const;
+
+    UartWorker& io;
+    UartPortWatcher *watcher;
+    std::thread thread;
+    std::atomic<bool> quit;
+
+    std::atomic<const UartPortList *> portList;
+    std::vector<UartPortList *> retired; // old snapshots, freed on destruction
+
+    Link links[UART_MAX_LINKS];
+    std::atomic<long> baud;
+    std::atomic<long> errors;
+};
 
+UartMonitor::UartMonitor(UartWorker& worker)
+    : io(worker), quit(false), portList(0), baud(UART_BAUD_RATE), errors(0)
+{
+    watcher = UartPortWatcher::create();
+    for (short n = 0; n < UART_MAX_LINKS; n++)
+    {
+        links[n].port = UartSerial::create();
+        links[n].reqParam = 0;
+        links[n].reqChanged = false;
+        links[n].curBaud = 0;
+        links[n].retryTime = 0;
+    }
+}
 
-    //Setting Timeouts for non-blocking read
-    COMMTIMEOUTS timeouts;
-    memset((void *)&timeouts, 0, sizeof(timeouts));
-    timeouts.ReadIntervalTimeout = MAXDWORD;
-    timeouts.ReadTotalTimeoutConstant = 0;
-    timeouts.ReadTotalTimeoutMultiplier = 0;
-    timeouts.WriteTotalTimeoutConstant = 0;
-    timeouts.WriteTotalTimeoutMultiplier = 0;
-    if (!SetCommTimeouts(hCom, &timeouts))
-        dbg("Failed to set COM" << nr << " timeouts");
+UartMonitor::~UartMonitor()
+{
+    stop();
+    delete watcher;
+    for (short n = 0; n < UART_MAX_LINKS; n++)
+        delete links[n].port;
+
+    delete ports();
+    for (size_t i = 0; i < retired.size(); i++)
+        delete retired[i];
+}
 
-    return hCom;
+void UartMonitor::start()
+{
+    if (thread.joinable())
+        return;
+
+    enumerate(); // initial list, available right after construction
+    io.start(watcher);
+    quit = false;
+    thread = std::thread(&UartMonitor::run, this);
 }
 
-static bool sendComPort(HANDLE hCom, char *msg, short msglen)
+void UartMonitor::stop()
 {
-    DWORD len = 0;
-    if ((!WriteFile(hCom, msg, msglen, &len, NULL)) || (len != msglen))
+    if (thread.joinable())
     {
-        dbg("Failed to write to COM");
-        return false;
+        quit = true;
+        watcher->wake();
+        thread.join();
     }
-    return true;
+    for (short n = 0; n < UART_MAX_LINKS; n++)
+        disconnect(n);
+    io.stop();
+}
+
+void UartMonitor::request(short n, float fComPort)
+{
+    links[n].reqParam = fComPort;
+    links[n].reqChanged = true;
+    watcher->wake();
 }
 
-static bool recvComPort(HANDLE hCom, char *msg, short maxlen, short& recvlen)
+void UartMonitor::setBaud(long b)
 {
-    DWORD len = 0;
-    recvlen = 0;
-    if (!ReadFile(hCom, msg, maxlen, &len, NULL))
+    if (baud.exchange(b) != b)
+        watcher->wake();
+}
+
+void UartMonitor::enumerate()
+{
+    UartPortList *list = new UartPortList;
+    listSerialPorts(list->names);
+
+    const UartPortList *old = ports();
+    if (old && (old->names == list->names))
     {
-        dbg("Failed to read from COM");
-        return false;
+        delete list; // unchanged
+        return;
     }
-    recvlen = (short)len;
-    return true;
+
+    // readers may still hold the old snapshot, keep it alive
+    portList.store(list, std::memory_order_release);
+    if (old)
+        retired.push_back((UartPortList *)old);
 }
 
-static void closeComPort(HANDLE hCom)
+bool UartMonitor::inUse(const std::string& name) const
 {
-    if (hCom == INVALID_HANDLE_VALUE)
-        return;
+    for (short n = 0; n < UART_MAX_LINKS; n++)
+        if (links[n].curPort == name)
+            return true;
+    return false;
+}
 
-    CloseHandle(hCom);
+bool UartMonitor::pending() const
+{
+    for (short n = 0; n < UART_MAX_LINKS; n++)
+        if (links[n].reqPort != links[n].curPort)
+            return true;
+    return false;
 }
 
-//-------------------------------------------------------------------------------------------------------
-static short reqComPort = 0;
-static std::vector<short> comPorts = {};
+void UartMonitor::disconnect(short n)
+{
+    Link& l = links[n];
+    io.attach(n, 0);
+    if (l.port->isOpen())
+    {
+        dbg("Closing " << l.curPort);
+        l.port->close();
+    }
+    l.curPort.clear();
+}
 
-static void listComPorts()
+void UartMonitor::connect(short n)
 {
-    int num_ports = 0;
-    comPorts.clear();
+    Link& l = links[n];
+    if (l.reqChanged.exchange(false)) // resolve request against the current list
+    {
+        const char *name = getComPortName(ports(), l.reqParam);
+        l.reqPort = name ? name : "";
+    }
 
-    dbg("listComPorts:");
-    char buf[65535];
-    long len = QueryDosDevice(0, buf, sizeof(buf));
+    if (io.hasFailed(n)) // read or write error, e.g. device unplugged
+        disconnect(n);
 
-    for (long n = 0; n < len; n++)
+    long b = baud;
+    if (!l.curPort.empty() && (l.curBaud != b)) // reopen at the new rate
+        disconnect(n);
+
+    if (l.reqPort == l.curPort)
+        return;
+
+    if (!l.curPort.empty()) // close existing port
+        disconnect(n);
+
+    if (l.reqPort.empty() || inUse(l.reqPort)) // none, or already bridged by another link
+        return;
+
+    if (pizTimeNow() >= l.retryTime) // open requested port
     {
-        if (strncmp(&buf[n], "COM", 3) == 0)
+        dbg("Opening " << l.reqPort);
+        if (l.port->open(l.reqPort.c_str(), b ? b : UART_BAUD_RATE))
+        {
+            io.attach(n, l.port, b);
+            l.curPort = l.reqPort;
+            l.curBaud = b;
+        }
+        else
         {
-            int port_num = atoi(&buf[n + 3]);
-            dbg("  COM" << port_num);
-            num_ports++;
-            comPorts.push_back(port_num);
+            errors++;
+            l.retryTime = pizTimeNow() + 2.0; // 2s
         }
+    }
+}
+
+void UartMonitor::run()
+{
+    double lastPoll = pizTimeNow();
+    while (!quit)
+    {
+        for (short n = 0; n < UART_MAX_LINKS; n++)
+            connect(n);
+
+        double timeOut = watcher->hasNotification() ? 10.0 : 2.0; // safety net / fallback polling
+        bool retry = pending();
+        if (retry)
+            timeOut = 2.0;
 
-        // find next null pointer
-        while (buf[n])
-            n++;
+        bool changed = watcher->wait(timeOut);
+        if (quit)
+            break;
+
+        bool poll = (pizTimeNow() - lastPoll) >= timeOut;
+        if (changed || poll || retry)
+        {
+            lastPoll = pizTimeNow();
+            enumerate();
+            for (short n = 0; n < UART_MAX_LINKS; n++)
+                links[n].retryTime = 0; // device arrived or retry is due
+        }
     }
-    dbg("Found " << num_ports << " COM ports");
-    sort(comPorts.begin(), comPorts.end());
+    watcher->detach();
 }
 
-static short getComPortNr(float fComPort)
+// settings of the baud rate parameter, 0 negotiates the fastest rate supported by the device
+static const long baudRates[] = { 9600, 19200, 38400, 57600, 115200, 230400, 460800, 500000, 921600, 1000000, 2000000, 0 };
+#define NUM_BAUD_RATES (long)(sizeof(baudRates) / sizeof(baudRates[0]))
+
+static long getBaudRate(float value)
 {
-    short pos = 0, nr = 0;
-    short sz = comPorts.size();
-    if (sz)
-        pos = roundToInt(fComPort * sz); // 0..sz
-    if (pos > 0)
-        nr = comPorts.at(pos - 1);
-    reqComPort = nr; // save
-    return nr;
+    return baudRates[roundToInt(value * (NUM_BAUD_RATES - 1))];
 }
 
-static char *getComPortName(float fComPort)
+// settings of the sysex rate parameter (paced flow control) in bytes/s, 3125 is MIDI DIN
+static const long sysexRates[] = { 250, 500, 1000, 2000, 3125, 5000, 10000, 20000 };
+#define NUM_SYSEX_RATES (long)(sizeof(sysexRates) / sizeof(sysexRates[0]))
+
+static long getSysexRate(float value)
 {
-    static char buf[8];
-    short nr = getComPortNr(fComPort);
-    if (nr > 0)
-        snprintf(buf, sizeof(buf), "COM%d", nr);
-    else
-        strcpy(buf, "NONE");
-    return buf;
+    return sysexRates[roundToInt(value * (NUM_SYSEX_RATES - 1))];
+}
+
+// serial port (link) selected by a parameter, -1 if none
+static short getLinkOfParam(VstInt32 index)
+{
+    if (index == kComPort)
+        return 0;
+    if ((index >= kComPort2) && (index <= kComPort8))
+        return (short)(index - kComPort2 + 1);
+    return -1;
 }
 
 //-------------------------------------------------------------------------------------------------------
@@ -171,8 +347,16 @@ public:
     ~MidiUartBridgeProgram() {}
 private:
     float fChannel;
-    float fComPort;
+    float fComPort[UART_MAX_LINKS];
     float fPower;
+    float fRxLatency;
+    float fTxLatency;
+    float fProtocol;
+    float fRxChannel;
+    float fProbe;
+    float fBaudRate;
+    float fFlowControl;
+    float fSysexRate;
     char name[kVstMaxProgNameLen];
 };
 
@@ -195,15 +379,34 @@ public:
 
 protected:
     float fChannel;
-    float fComPort;
+    float fComPort[UART_MAX_LINKS];
     float fPower;
+    float fRxLatency;
+    float fTxLatency;
+    float fProtocol;
+    float fRxChannel;
+    float fProbe;
+    float fBaudRate;
+    float fFlowControl;
+    float fSysexRate;
 
     virtual void processMidiEvents(VstMidiEventVec *inputs, VstMidiEventVec *outputs, VstInt32 sampleFrames);
 
     MidiUartBridgeProgram *programs;
 
 private:
-    HANDLE hCom;
+    void receiveUart(VstMidiEventVec *outputs, VstInt32 sampleFrames);
+    int  getProtocol() const { return roundToInt(fProtocol * (kNumUartProtocols - 1)); }
+    int  getFlowMode() const { return roundToInt(fFlowControl * (kNumFlowModes - 1)); }
+    void sendSysex();
+    double getRtt(VstInt32 index);
+
+    UartWorker io;
+    UartMonitor monitor;
+    long openErrors;
+
+    PizClockDll clock;        // monotonic clock -> sample timeline
+    VstMidiEventVec rxEvents; // received events not yet due
 };
 
 
@@ -216,22 +419,29 @@ MidiUartBridgeProgram::MidiUartBridgeProgram()
 {
     // default Program Values
     fChannel = 0.0f;
-    fComPort = 1.0f;
+    fComPort[0] = 1.0f;
+    for (int i = 1; i < UART_MAX_LINKS; i++)
+        fComPort[i] = 0.0f; // none
     fPower = 1.0f;
+    fRxLatency = 0.25f; // 25ms
+    fTxLatency = 0.05f; // 5ms
+    fProtocol = 0.0f;   // raw MIDI
+    fRxChannel = 0.0f;  // as sent by the device
+    fProbe = 0.0f;
+    fBaudRate = 4.0f / (NUM_BAUD_RATES - 1); // 115200
+    fFlowControl = 0.0f; // none
+    fSysexRate = 4.0f / (NUM_SYSEX_RATES - 1); // 3125 bytes/s
 
     // default program name
     strcpy(name, "Default");
-
-    // activate UART
-    getComPortNr(fComPort);
 }
 
 //-----------------------------------------------------------------------------
 MidiUartBridge::MidiUartBridge(audioMasterCallback audioMaster)
-    : PizMidi(audioMaster, kNumPrograms, kNumParams), programs(0)
+    : PizMidi(audioMaster, kNumPrograms, kNumParams), programs(0), monitor(io), openErrors(0)
 {
-    hCom = INVALID_HANDLE_VALUE;
-    listComPorts();
+    rxEvents.reserve(MAX_EVENTS_PER_TIMESLICE);
+    monitor.start();
 
     programs = new MidiUartBridgeProgram[numPrograms];
 
@@ -240,9 +450,19 @@ MidiUartBridge::MidiUartBridge(audioMasterCallback audioMaster)
         if (readDefaultBank(PLUG_NAME, defaultBank)) {
             if ((VstInt32)defaultBank->GetFxID() == PLUG_IDENT) {
                 for (int i = 0; i < kNumPrograms; i++) {
-                    programs[i].fChannel = defaultBank->GetProgParm(i, 0);
-                    programs[i].fComPort = defaultBank->GetProgParm(i, 1);
-                    programs[i].fPower = defaultBank->GetProgParm(i, 2);
+                    programs[i].fChannel = defaultBank->GetProgParm(i, kChannel);
+                    programs[i].fComPort[0] = defaultBank->GetProgParm(i, kComPort);
+                    programs[i].fPower = defaultBank->GetProgParm(i, kPower);
+                    programs[i].fRxLatency = defaultBank->GetProgParm(i, kRxLatency);
+                    programs[i].fTxLatency = defaultBank->GetProgParm(i, kTxLatency);
+                    programs[i].fProtocol = defaultBank->GetProgParm(i, kProtocol);
+                    programs[i].fRxChannel = defaultBank->GetProgParm(i, kRxChannel);
+                    programs[i].fProbe = defaultBank->GetProgParm(i, kProbe);
+                    programs[i].fBaudRate = defaultBank->GetProgParm(i, kBaudRate);
+                    programs[i].fFlowControl = defaultBank->GetProgParm(i, kFlowControl);
+                    programs[i].fSysexRate = defaultBank->GetProgParm(i, kSysexRate);
+                    for (int n = 1; n < UART_MAX_LINKS; n++)
+                        programs[i].fComPort[n] = defaultBank->GetProgParm(i, kComPort2 + n - 1);
                     strcpy(programs[i].name, defaultBank->GetProgramName(i));
                 }
             }
@@ -271,8 +491,7 @@ MidiUartBridge::MidiUartBridge(audioMasterCallback audioMaster)
 
 //-----------------------------------------------------------------------------------------
 MidiUartBridge::~MidiUartBridge() {
-    closeComPort(hCom);
-    hCom = INVALID_HANDLE_VALUE;
+    monitor.stop();
 
     if (programs) 
         delete[] programs;
@@ -285,8 +504,18 @@ void MidiUartBridge::setProgram(VstInt32 program)
 
     curProgram = program;
     setParameter(kChannel, ap->fChannel);
-    setParameter(kComPort, ap->fComPort);
     setParameter(kPower, ap->fPower);
+    setParameter(kRxLatency, ap->fRxLatency);
+    setParameter(kTxLatency, ap->fTxLatency);
+    setParameter(kProtocol, ap->fProtocol);
+    setParameter(kRxChannel, ap->fRxChannel);
+    setParameter(kProbe, ap->fProbe);
+    setParameter(kBaudRate, ap->fBaudRate);
+    setParameter(kFlowControl, ap->fFlowControl);
+    setParameter(kSysexRate, ap->fSysexRate);
+    setParameter(kComPort, ap->fComPort[0]);
+    for (int n = 1; n < UART_MAX_LINKS; n++)
+        setParameter(kComPort2 + n - 1, ap->fComPort[n]);
 }
 
 //------------------------------------------------------------------------
@@ -317,10 +546,52 @@ void MidiUartBridge::setParameter(VstInt32 index, float value) {
 
     MidiUartBridgeProgram* ap = &programs[curProgram];
 
+    short link = getLinkOfParam(index);
+    if (link >= 0)
+    {
+        fComPort[link] = ap->fComPort[link] = value;
+        monitor.request(link, value);
+        return;
+    }
+
     switch (index) {
     case kChannel: fChannel = ap->fChannel = value; break;
-    case kComPort: fComPort = ap->fComPort = value; break;
     case kPower:    fPower  = ap->fPower  = value;  break;
+    case kRxLatency: fRxLatency = ap->fRxLatency = value; break;
+    case kTxLatency: fTxLatency = ap->fTxLatency = value; break;
+    case kProtocol:
+        fProtocol = ap->fProtocol = value;
+        io.setProtocol(getProtocol());
+        break;
+    case kRxChannel: fRxChannel = ap->fRxChannel = value; break;
+    case kProbe: fProbe = ap->fProbe = value; io.setProbe(value >= 0.5f); break;
+    case kBaudRate:
+        fBaudRate = ap->fBaudRate = value;
+        monitor.setBaud(getBaudRate(value));
+        break;
+    case kFlowControl:
+        fFlowControl = ap->fFlowControl = value;
+        io.setFlowControl(getFlowMode());
+        break;
+    case kSysexRate:
+        fSysexRate = ap->fSysexRate = value;
+        io.setSysexRate(getSysexRate(value));
+        break;
+    case kRxLost:
+    case kTxQueue:
+    case kTxMerged:
+    case kTxDropped:
+    case kRttMin:
+    case kRttP50:
+    case kRttP99:
+    case kRttMax:
+    case kTxJitter:
+    case kRxJitter:
+    case kSysexQueue:
+    case kSysexSent:
+    case kSysexDropped:
+    case kSysexHeld:
+        break; // read-only
     }
 }
 
@@ -328,82 +599,222 @@ void MidiUartBridge::setParameter(VstInt32 index, float value) {
 float MidiUartBridge::getParameter(VstInt32 index) {
     float v = 0;
 
+    short link = getLinkOfParam(index);
+    if (link >= 0)
+        return fComPort[link];
+
     switch (index) {
     case kChannel:   v = fChannel; break;
-    case kComPort:   v = fComPort; break;
     case kPower:     v = fPower;   break;
+    case kRxLatency:   v = fRxLatency; break;
+    case kTxLatency:   v = fTxLatency; break;
+    case kProtocol:    v = fProtocol;  break;
+    case kRxChannel:   v = fRxChannel; break;
+    case kProbe:       v = fProbe;     break;
+    case kBaudRate:    v = fBaudRate;  break;
+    case kFlowControl: v = fFlowControl; break;
+    case kSysexRate:   v = fSysexRate; break;
     }
     return v;
 }
 
 //-----------------------------------------------------------------------------------------
 void MidiUartBridge::getParameterName(VstInt32 index, char *label) {
+    short link = getLinkOfParam(index);
+    if (link > 0)
+    {
+        sprintf(label, "COM Port %d", link + 1);
+        return;
+    }
+
     switch (index) {
     case kChannel:  strcpy(label, "Channel Out"); break;
     case kComPort:  strcpy(label, "COM Port");    break;
     case kPower:    strcpy(label, "Power");       break;
+    case kRxLatency:  strcpy(label, "RX Latency");  break;
+    case kTxLatency:  strcpy(label, "TX Latency");  break;
+    case kProtocol:   strcpy(label, "Protocol");    break;
+    case kRxChannel:  strcpy(label, "RX Channel");  break;
+    case kRxLost:     strcpy(label, "RX Lost");     break;
+    case kTxQueue:    strcpy(label, "TX Queue");    break;
+    case kTxMerged:   strcpy(label, "TX Merged");   break;
+    case kTxDropped:  strcpy(label, "TX Dropped");  break;
+    case kProbe:      strcpy(label, "Probe");       break;
+    case kRttMin:     strcpy(label, "RTT min");     break;
+    case kRttP50:     strcpy(label, "RTT p50");     break;
+    case kRttP99:     strcpy(label, "RTT p99");     break;
+    case kRttMax:     strcpy(label, "RTT max");     break;
+    case kBaudRate:   strcpy(label, "Baud Rate");   break;
+    case kTxJitter:   strcpy(label, "TX Jitter");   break;
+    case kRxJitter:   strcpy(label, "RX Jitter");   break;
+    case kFlowControl: strcpy(label, "Flow Control"); break;
+    case kSysexRate:  strcpy(label, "Sysex Rate");  break;
+    case kSysexQueue: strcpy(label, "Sysex Queue"); break;
+    case kSysexSent:  strcpy(label, "Sysex Sent");  break;
+    case kSysexDropped: strcpy(label, "Sysex Dropped"); break;
+    case kSysexHeld:  strcpy(label, "Sysex Held");  break;
     }
 }
 
 //-----------------------------------------------------------------------------------------
 void MidiUartBridge::getParameterDisplay(VstInt32 index, char *text) {
+    short link = getLinkOfParam(index);
+    if (link >= 0)
+    {
+        const char *name = getComPortName(monitor.ports(), fComPort[link]);
+        if (name && strrchr(name, '/'))
+            name = strrchr(name, '/') + 1; // e.g. ttyACM0
+        vst_strncpy(text, name ? name : "NONE", kVstMaxParamStrLen);
+        return;
+    }
+
     switch (index) {
     case kChannel: sprintf(text, "%d", FLOAT_TO_CHANNEL015(fChannel) + 1); break;
-    case kComPort: strcpy(text, getComPortName(fComPort));  break;
     case kPower:   strcpy(text, (fPower < 0.5f) ? "off" : "on"); break;
+    case kRxLatency: sprintf(text, "%d ms", roundToInt(fRxLatency * 100.0f)); break;
+    case kTxLatency: sprintf(text, "%d ms", roundToInt(fTxLatency * 100.0f)); break;
+    case kProtocol:  strcpy(text, getUartProtocolName(getProtocol())); break;
+    case kRxChannel: strcpy(text, (fRxChannel < 0.5f) ? "Device" : "Port"); break;
+    case kRxLost:
+    {
+        long lost = 0; // missing or damaged frames of all ports
+        for (short n = 0; n < UART_MAX_LINKS; n++)
+            lost += io.stats(n).rxLost + io.stats(n).rxBad;
+        sprintf(text, "%ld", lost);
+        break;
+    }
+    case kTxQueue:
+    case kTxMerged:
+    case kTxDropped:
+    {
+        long v = 0; // sum of all ports
+        for (short n = 0; n < UART_MAX_LINKS; n++)
+        {
+            const UartTxQueue& q = io.txQueue(n);
+            v += (index == kTxQueue) ? q.depth.load() : (index == kTxMerged) ? q.merged.load() : q.dropped.load();
+        }
+        sprintf(text, "%ld", v);
+        break;
+    }
+    case kProbe:   strcpy(text, (fProbe < 0.5f) ? "off" : "on"); break;
+    case kRttMin:
+    case kRttP50:
+    case kRttP99:
+    case kRttMax:
+    {
+        double ms = getRtt(index);
+        if (ms < 0)
+            strcpy(text, "-");
+        else
+            sprintf(text, "%.1f ms", ms);
+        break;
+    }
+    case kBaudRate:
+    {
+        long baud = getBaudRate(fBaudRate);
+        if (baud)
+            sprintf(text, "%ld", baud);
+        else if (io.stats(0).baud) // negotiated rate of the first port
+            sprintf(text, "Auto %ld", io.stats(0).baud.load());
+        else
+            strcpy(text, "Auto");
+        break;
+    }
+    case kTxJitter:
+    case kRxJitter:
+    {
+        long us = 0; // worst of all ports
+        for (short n = 0; n < UART_MAX_LINKS; n++)
+            us = std::max(us, (index == kTxJitter) ? io.stats(n).clockLate.load() : io.stats(n).clockJitter.load());
+        sprintf(text, "%ld us", us);
+        break;
+    }
+    case kFlowControl: strcpy(text, getFlowModeName(getFlowMode())); break;
+    case kSysexRate:   sprintf(text, "%ld B/s", getSysexRate(fSysexRate)); break;
+    case kSysexQueue:
+    case kSysexSent:
+    case kSysexDropped:
+    case kSysexHeld:
+    {
+        long v = 0; // sum of all ports
+        for (short n = 0; n < UART_MAX_LINKS; n++)
+        {
+            const UartSysexTx& sx = io.sysexTx(n);
+            v += (index == kSysexQueue) ? sx.pending() : (index == kSysexSent) ? sx.sent.load()
+               : (index == kSysexDropped) ? sx.rejected.load() : sx.held.load();
+        }
+        if ((index == kSysexQueue) && v && (getProtocol() == kUartRaw))
+            sprintf(text, "%ld, notes wait", v); // see README, Cables or Framed keep them going
+        else
+            sprintf(text, "%ld", v);
+        break;
+    }
     }
 }
 
 //-----------------------------------------------------------------------------------------
+// Round-trip time of the probes of all ports in ms (-1 if none), from the shared statistics.
+// Percentiles are resolved to the 0.1 ms bins of the histogram.
 
-void MidiUartBridge::processMidiEvents(VstMidiEventVec *inputs, VstMidiEventVec *outputs, VstInt32 sampleFrames)
+double MidiUartBridge::getRtt(VstInt32 index)
 {
-    static short curComPort = 0;
-    short uartChannel = (FLOAT_TO_CHANNEL015(fChannel) & 0x0F); // midi channel to send to uart
-
-    static DWORD timeOut = 0;
-    if (timeOut)
+    long total = 0;
+    long rttMin = -1;
+    long rttMax = -1;
+    for (short n = 0; n < UART_MAX_LINKS; n++)
     {
-        if (GetTickCount() > timeOut)
-            timeOut = 0;
+        const UartLinkStats& st = io.stats(n);
+        if (st.rttMax == 0)
+            continue; // none
+        if ((rttMin < 0) || (st.rttMin < rttMin))
+            rttMin = st.rttMin;
+        if (st.rttMax > rttMax)
+            rttMax = st.rttMax;
+        for (int b = 0; b < UART_RTT_BINS; b++)
+            total += st.rtt[b];
     }
+    if (total == 0)
+        return -1;
 
-    if (reqComPort != curComPort) // change com port
+    if (index == kRttMin)
+        return rttMin * 1e-3;
+    if (index == kRttMax)
+        return rttMax * 1e-3;
+
+    long rank = (long)ceil(((index == kRttP50) ? 0.50 : 0.99) * total);
+    long count = 0;
+    for (int b = 0; b < UART_RTT_BINS; b++)
     {
-        if (curComPort) // close existing port
-        {
-            dbg("Closing COM" << curComPort);
-            closeComPort(hCom);
-            hCom = INVALID_HANDLE_VALUE;
-            curComPort = 0;
-        }
-        
-        if (reqComPort && (! timeOut)) // open requested port
-        {
-            dbg("Opening COM" << reqComPort);
-            hCom = openComPort(reqComPort);
-            if (hCom == INVALID_HANDLE_VALUE)
-            {
-                VstMidiEvent me;
-                memset(&me, 0, sizeof(me));
-                me.midiData[0] = MIDI_NOTEOFF | uartChannel; // "Error Message"
-                outputs[0].push_back(me);
-
-                listComPorts();
-                timeOut = GetTickCount() + 2000; // 2s
-            }
-            else
-                curComPort = reqComPort;
-        }
+        for (short n = 0; n < UART_MAX_LINKS; n++)
+            count += io.stats(n).rtt[b];
+        if (count >= rank)
+            return (b + 0.5) * 0.1;
     }
+    return rttMax * 1e-3;
+}
+
+//-----------------------------------------------------------------------------------------
+
+void MidiUartBridge::processMidiEvents(VstMidiEventVec *inputs, VstMidiEventVec *outputs, VstInt32 sampleFrames)
+{
+    short uartChannel = (FLOAT_TO_CHANNEL015(fChannel) & 0x0F); // midi channel to send to uart
+
+    clock.update(pizTimeNow(), sampleFrames, getSampleRate());
 
-    if ((! reqComPort) && (! timeOut))
+    long errors = monitor.openErrors();
+    if (errors != openErrors) // failed to open the requested port
     {
-        listComPorts();
-        timeOut = GetTickCount() + 2000; // 2s
+        openErrors = errors;
+
+        VstMidiEvent me;
+        memset(&me, 0, sizeof(me));
+        me.midiData[0] = MIDI_NOTEOFF | uartChannel; // "Error Message"
+        outputs[0].push_back(me);
     }
 
-    // process incoming events (of first input)
+    // process incoming events (of first input), scheduled at their position in the block
+    double lookahead = fTxLatency * 0.1; // 0..100ms
+    bool cables = (getProtocol() == kUartCables);
     for (unsigned int i = 0; i < inputs[0].size(); i++) 
     {
         //copying event "i" from input (with all its fields)
@@ -413,81 +824,106 @@ void MidiUartBridge::processMidiEvents(VstMidiEventVec *inputs, VstMidiEventVec
         short channel = me.midiData[0] & 0x0F;  // isolating channel (0-15)
         //short data1 = me.midiData[1] & 0x7F;
         //short data2 = me.midiData[2] & 0x7F;
-        if ((channel == uartChannel) && (fPower >= 0.5f) && (hCom != INVALID_HANDLE_VALUE))
+        if (fPower < 0.5f)
+            continue;
+
+        double time = clock.timeAtSample(me.deltaFrames) + lookahead;
+        if (isRealTime(me.midiData[0])) // clock and transport to all ports
         {
-            short len = getMidiEvLen(status);
-            if (len > 0)
-            {
-                if (!sendComPort(hCom, me.midiData, len))
-                {
-                    closeComPort(hCom);
-                    hCom = INVALID_HANDLE_VALUE;
-                    curComPort = 0;
-                }
-            }
+            for (short n = 0; n < UART_MAX_LINKS; n++)
+                io.send(n, me.midiData, 1, time);
+            continue;
         }
-    }
 
-    // process incoming UART data
-    static char recvBuf[20];
-    static short recvPos = 0;
-    
-    if ((recvPos < sizeof(recvBuf)) && (hCom != INVALID_HANDLE_VALUE))
-    {
-        short len = 0;
-        if (! recvComPort(hCom, &recvBuf[recvPos], sizeof(recvBuf) - recvPos, len))
+        short len = getMidiEvLen(status);
+        if (len <= 0)
+            continue;
+
+        if (cables) // host channel selects the cable, sent on UART channel to all ports
         {
-            closeComPort(hCom);
-            hCom = INVALID_HANDLE_VALUE;
-            curComPort = 0;
+            me.midiData[0] = (char)(status | uartChannel);
+            for (short n = 0; n < UART_MAX_LINKS; n++)
+                io.send(n, me.midiData, len, time, channel);
+        }
+        else // each port bridges its own channel, counting up from the UART channel
+        {
+            short link = (channel - uartChannel) & 0x0F;
+            if (link < UART_MAX_LINKS)
+                io.send(link, me.midiData, len, time);
         }
-
-        recvPos += len;
     }
 
     if (fPower >= 0.5f)
-    {
-        short i = 0;
-        while (i < recvPos)
-        {
-            if (recvBuf[i] & 0x80) // status
-            {
-                short len = getMidiEvLen(recvBuf[i]);
-                if (len > 0)
-                {
-                    if ((i + len) > recvPos)
-                        break; // not enough data yet
+        sendSysex();
 
-                    VstMidiEvent me;
-                    memset(&me, 0, sizeof(me));
-                    for (int j = 0; j < len; j++)
-                        me.midiData[j] = recvBuf[i + j];
-                    outputs[0].push_back(me);
+    // process incoming UART data
+    receiveUart(outputs, sampleFrames);
+}
 
-                    i += len;
-                }
-                else
-                    i++; // skip
-            }
-            else
-                i++; // skip
-        }
+//-----------------------------------------------------------------------------------------
+// Sysex dumps go to all ports, copied into their sysex buffers (never waits).
+// A dump which does not fit is dropped and counted.
 
-        if (i >= recvPos)
-        {
-            recvPos = 0; // all consumed
-        }
-        else if (i > 0) // partly consumed
-        {
-            recvPos -= i;
+void MidiUartBridge::sendSysex()
+{
+    for (unsigned int i = 0; i < _midiSysexEventsIn[0].size(); i++)
+    {
+        const VstMidiSysexEvent& se = _midiSysexEventsIn[0][i];
+        for (short n = 0; n < UART_MAX_LINKS; n++)
+            io.sendSysex(n, (const unsigned char *)se.sysexDump, se.dumpBytes);
+    }
+}
 
-            // shift down
-            for (int j = 0; j < recvPos; j++)
-                recvBuf[j] = recvBuf[j + i];
-        }
+//-----------------------------------------------------------------------------------------
+// Received messages carry their arrival time. Each one is placed at the matching
+// sample position plus a fixed latency, which turns the block size jitter into a
+// constant (compensatable) delay. Messages due in a later block are held back.
+
+void MidiUartBridge::receiveUart(VstMidiEventVec *outputs, VstInt32 sampleFrames)
+{
+    if (fPower < 0.5f) // ignore recv data
+    {
+        io.rx.clear();
+        rxEvents.clear();
+        return;
     }
-    else // ignore recv data
+
+    double latency = fRxLatency * 0.1 / clock.samplePeriod(); // 0..100ms in samples
+    double maxDelta = 1.0 / clock.samplePeriod(); // never hold back more than 1s
+    bool cables = (getProtocol() == kUartCables);
+    bool portChannel = (fRxChannel >= 0.5f);
+    short uartChannel = (FLOAT_TO_CHANNEL015(fChannel) & 0x0F);
+
+    UartRxEvent ev;
+    while (io.rx.pop(ev))
     {
-        recvPos = 0;
+        VstMidiEvent me;
+        memset(&me, 0, sizeof(me));
+        for (int j = 0; j < 3; j++)
+            me.midiData[j] = ev.data[j];
+        bool realTime = ((ev.data[0] & 0xF0) == 0xF0); // no channel
+        if (cables && !realTime) // cable selects the host channel
+            me.midiData[0] = (char)((ev.data[0] & 0xF0) | (ev.cable & 0x0F));
+        else if (portChannel && !realTime) // channel of the receiving port
+            me.midiData[0] = (char)((ev.data[0] & 0xF0) | ((uartChannel + ev.link) & 0x0F));
+
+        double pos = clock.samplesFromBlockStart(ev.time) + latency;
+        if (pos < 0)
+            pos = 0; // too late, as soon as possible
+        if (pos > maxDelta)
+            pos = maxDelta;
+        me.deltaFrames = (VstInt32)pos;
+
+        if (!rxEvents.empty() && (me.deltaFrames < rxEvents.back().deltaFrames))
+            me.deltaFrames = rxEvents.back().deltaFrames; // keep order
+        rxEvents.push_back(me);
     }
+
+    size_t n = 0;
+    while ((n < rxEvents.size()) && (rxEvents[n].deltaFrames < sampleFrames))
+        outputs[0].push_back(rxEvents[n++]);
+
+    rxEvents.erase(rxEvents.begin(), rxEvents.begin() + n);
+    for (size_t i = 0; i < rxEvents.size(); i++)
+        rxEvents[i].deltaFrames -= sampleFrames;
 }
@@ -0,0 +1,18 @@
+/*-----------------------------------------------------------------------------
+ChannelBatch
+batch channel rewrite of midiUnifyChannel
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#include "ChannelBatch.h"
+
+//-------------------------------------------------------------------------------------------------------
+void setChannelBatch(VstMidiEvent *events, size_t n, unsigned char channel)
+{
+    channel &= 0x0F;
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned char status = (unsigned char)events[i].midiData[0];
+        if ((status >= 0x80) && (status < 0xF0))
+            events[i].midiData[0] = (char)((status & 0xF0) | channel);
+    }
+}
@@ -0,0 +1,23 @@
+/*-----------------------------------------------------------------------------
+ChannelBatch
+batch channel rewrite of midiUnifyChannel
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#ifndef CHANNELBATCH_H
+#define CHANNELBATCH_H
+
+#include "public.sdk/source/vst2.x/audioeffectx.h"
+#include <stddef.h>
+
+//-------------------------------------------------------------------------------------------------------
+// Sets the channel of all channel messages (status 0x80..0xEF) of n events in place.
+// System messages (0xF0..0xFF) and stray data bytes are left as they are.
+//
+// What the batch path saves over a loop of push_back is the copy and the per-event
+// decisions: the events of a block are first copied in one go, then rewritten where they are.
+// A plain byte loop, which compilers make branchless; SIMD variants (one 32 byte event per
+// register) measured no faster with UnifyBench.
+
+void setChannelBatch(VstMidiEvent *events, size_t n, unsigned char channel);
+
+#endif
@@ -0,0 +1,203 @@
+/*-----------------------------------------------------------------------------
+ChannelRouter
+channel routing matrix of midiUnifyChannel
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#include "ChannelRouter.h"
+#include "../common/pizvstbase.h"
+#include "../common/PizTextFile.h"
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+static const char *defaultRules = "route all same\n";
+
+#define ALL_CHANNELS 0xFFFF
+#define SAME_CHANNEL 0x10000 // output bit for the input channel
+
+struct RouterName
+{
+    const char *name;
+    unsigned char value;
+};
+
+static const RouterName typeNames[] =
+{
+    { "NOTES",        ChannelRouter::kNotes },
+    { "POLYPRESSURE", ChannelRouter::kPolyPressure },
+    { "CONTROLLERS",  ChannelRouter::kControllers },
+    { "PROGRAMS",     ChannelRouter::kPrograms },
+    { "PRESSURE",     ChannelRouter::kPressure },
+    { "PITCHBEND",    ChannelRouter::kPitchBend },
+    { 0, 0 } // terminator
+};
+
+// message type of the status nibbles 0x8..0xE
+static const unsigned char statusTypes[7] =
+{
+    ChannelRouter::kNotes, ChannelRouter::kNotes, ChannelRouter::kPolyPressure, ChannelRouter::kControllers,
+    ChannelRouter::kPrograms, ChannelRouter::kPressure, ChannelRouter::kPitchBend
+};
+
+// channel bits of "all", "same" (if allowed), "n" or "n-m", 0 if not a channel
+static long parseChannels(const char *word, bool same)
+{
+    if (!strcmp(word, "ALL"))
+        return ALL_CHANNELS;
+    if (same && !strcmp(word, "SAME"))
+        return SAME_CHANNEL;
+
+    char *end;
+    long first = strtol(word, &end, 10);
+    long last = first;
+    if ((end != word) && (*end == '-'))
+        last = strtol(end + 1, &end, 10);
+    if ((end == word) || *end || (first < 1) || (last < first) || (last > ROUTER_NUM_CHANNELS))
+        return 0;
+    return ((1L << last) - 1) & ~((1L << (first - 1)) - 1);
+}
+
+//-------------------------------------------------------------------------------------------------------
+ChannelRouter::ChannelRouter()
+    : table(0), retired(0)
+{
+    setDefault();
+    compile();
+}
+
+ChannelRouter::~ChannelRouter()
+{
+    delete table.load();
+    delete retired;
+}
+
+void ChannelRouter::setDefault()
+{
+    parse(defaultRules);
+}
+
+bool ChannelRouter::load(const char *path)
+{
+    std::vector<char> text;
+    if (!pizLoadText(path, text))
+        return false;
+
+    if (!parse(&text[0]))
+        dbg("ChannelRouter: errors in " << path);
+    return true;
+}
+
+bool ChannelRouter::parse(const char *text)
+{
+    memset(routes, 0, sizeof(routes)); // all dropped
+    rules = 0;
+
+    bool ok = true;
+    PizTextLines lines(text);
+    while (char *line = lines.next())
+    {
+        if (!parseLine(line))
+        {
+            dbg("ChannelRouter: line " << lines.getNumber() << " not understood");
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+bool ChannelRouter::parseLine(char *line)
+{
+    char *pos = line;
+    char *word = pizNextWord(pos);
+    if (!word)
+        return true; // empty line
+
+    bool route = !strcmp(word, "ROUTE");
+    if (!route && strcmp(word, "DROP"))
+        return false;
+
+    long inputs;
+    if (!(word = pizNextWord(pos)) || !(inputs = parseChannels(word, false)))
+        return false;
+
+    long outputs = 0;
+    unsigned char types = 0; // bits, none for all
+    while ((word = pizNextWord(pos)) != 0)
+    {
+        unsigned char type;
+        long channels;
+        if (pizFindName(typeNames, word, type))
+            types |= 1 << type;
+        else if (route && ((channels = parseChannels(word, true)) != 0))
+            outputs |= channels;
+        else
+            return false;
+    }
+    if (route && !outputs)
+        return false;
+    if (!types)
+        types = (1 << kNumTypes) - 1;
+
+    for (int in = 0; in < ROUTER_NUM_CHANNELS; in++)
+    {
+        if (!(inputs & (1 << in)))
+            continue;
+        unsigned short bits = (unsigned short)(outputs & ALL_CHANNELS);
+        if (outputs & SAME_CHANNEL)
+            bits |= 1 << in;
+        for (int t = 0; t < kNumTypes; t++)
+        {
+            if (!(types & (1 << t)))
+                continue;
+            if (route)
+                routes[in][t] |= bits;
+            else
+                routes[in][t] = 0;
+        }
+    }
+    rules++;
+    return true;
+}
+
+//-------------------------------------------------------------------------------------------------------
+void ChannelRouter::compile()
+{
+    // no reader holds a table replaced before the last compile any more
+    delete retired;
+    retired = 0;
+
+    Table *t = new Table;
+    t->fanOut = 1;
+    for (int s = 0; s < 256; s++)
+    {
+        Action a;
+        memset(&a, 0, sizeof(a));
+        if ((s < 0x80) || (s >= 0xF0))
+        {
+            // system message (or a stray data byte) as it is
+            a.count = 1;
+            a.status[0] = (unsigned char)s;
+        }
+        else
+        {
+            unsigned short bits = routes[s & 0x0F][statusTypes[(s >> 4) - 8]];
+            for (int out = 0; out < ROUTER_NUM_CHANNELS; out++)
+                if (bits & (1 << out))
+                    a.status[a.count++] = (unsigned char)((s & 0xF0) | out);
+        }
+        if (a.count > t->fanOut)
+            t->fanOut = a.count;
+        t->actions[s] = a;
+    }
+
+    const Table *old = table.load(std::memory_order_acquire);
+    if (old && !memcmp(old, t, sizeof(Table)))
+    {
+        delete t; // unchanged
+        return;
+    }
+
+    // readers may still hold the old table, keep it alive until the next compile
+    table.store(t, std::memory_order_release);
+    retired = old;
+}
@@ -0,0 +1,76 @@
+/*-----------------------------------------------------------------------------
+ChannelRouter
+channel routing matrix of midiUnifyChannel
+by H.R.Graf
+-----------------------------------------------------------------------------*/
+#ifndef CHANNELROUTER_H
+#define CHANNELROUTER_H
+
+//-------------------------------------------------------------------------------------------------------
+// Routing rules, one per line ('#' starts a comment):
+//
+//   route <inputs> <outputs> [<types>]  adds routes from the input to the output channels
+//   drop <inputs> [<types>]             removes all routes of the input channels
+//
+// channels: 1..16, a range like 1-8, or all; as output also same (the input channel)
+// types (default all): notes (on and off), polypressure, controllers, programs,
+//                      pressure (channel), pitchbend
+//
+// An input channel without a route is dropped, one with several routes is split (fanned
+// out) to all of them, and several inputs routed to one output are merged. System
+// messages pass unchanged. Later rules add to (or remove from) earlier ones.
+//
+// The 16 x 16 matrix of every message type is compiled into a table of 256 status bytes,
+// each with the list of status bytes to send, so routing an event costs one lookup.
+// A compiled table is published through an atomic pointer and never modified afterwards,
+// so it can be read from any thread, including the audio thread, while the next one is
+// parsed and compiled. The table it replaces is kept until the next compile (a reader may
+// still hold it), so a reader must not keep a table across two compiles: the plug-in
+// compiles only in resume(), and loads the table once per block. An unchanged table is
+// not published again.
+
+#include <atomic>
+
+#define ROUTER_NUM_CHANNELS 16
+
+class ChannelRouter
+{
+public:
+    enum { kNotes, kPolyPressure, kControllers, kPrograms, kPressure, kPitchBend, kNumTypes };
+
+    struct Action
+    {
+        unsigned char count;                           // 0 drop, 1 remap (or pass), more fan out
+        unsigned char status[ROUTER_NUM_CHANNELS];     // status bytes to send
+    };
+
+    struct Table
+    {
+        Action actions[256]; // by status byte
+        int fanOut;          // largest count
+    };
+
+    ChannelRouter();
+    ~ChannelRouter();
+
+    bool parse(const char *text); // false if a line was not understood (the others are used)
+    bool load(const char *path);  // false if not found
+    void setDefault();            // every channel to itself
+
+    // builds and publishes the table from the routes, on one thread at a time like parse()
+    void compile();
+
+    // any thread, load it once per block
+    const Table& getTable() const { return *table.load(std::memory_order_acquire); }
+    long numRules() const { return rules; }
+
+private:
+    bool parseLine(char *line);
+
+    unsigned short routes[ROUTER_NUM_CHANNELS][kNumTypes]; // output channel bits per input and type
+    long rules;
+    std::atomic<const Table *> table;
+    const Table *retired; // replaced by the last compile, freed by the next one
+};
+
+#endif
@@ -4,11 +4,14 @@ original framework by Reuben Vinal
 specific implementation by H.R.Graf
 -----------------------------------------------------------------------------*/
 #include "../common/PizMidi.h"
+#include "ChannelBatch.h"
+#include "ChannelRouter.h"
 
 enum
 {
     kChannel,
     kPower,
+    kRouting,
 
     kNumParams,
     kNumPrograms = 4
@@ -23,6 +26,7 @@ public:
 private:
     float fChannel;
     float fPower;
+    float fRouting;
     char name[kVstMaxProgNameLen];
 };
 
@@ -43,13 +47,23 @@ public:
     virtual void   getParameterDisplay(VstInt32 index, char *text);
     virtual void   getParameterName(VstInt32 index, char *text);
 
+    virtual void   resume();
+
 protected:
     float fChannel;
     float fPower;
+    float fRouting;
 
     virtual void processMidiEvents(VstMidiEventVec *inputs, VstMidiEventVec *outputs, VstInt32 sampleFrames);
 
     MidiUnifyChannelProgram *programs;
+
+private:
+    void loadRoutes();
+    bool isUnify() const { return fRouting < 0.5f; }
+
+    unsigned char channel;       // outgoing midi channel
+    ChannelRouter router;        // routes of the map file, compiled when it is read
 };
 
 
@@ -63,6 +77,7 @@ MidiUnifyChannelProgram::MidiUnifyChannelProgram()
     // default Program Values
     fChannel = 0.0f;
     fPower = 1.0f;
+    fRouting = 0.0f; // unify
 
     // default program name
     strcpy(name, "Default");
@@ -70,7 +85,7 @@ MidiUnifyChannelProgram::MidiUnifyChannelProgram()
 
 //-----------------------------------------------------------------------------
 MidiUnifyChannel::MidiUnifyChannel(audioMasterCallback audioMaster)
-    : PizMidi(audioMaster, kNumPrograms, kNumParams), programs(0)
+    : PizMidi(audioMaster, kNumPrograms, kNumParams), fRouting(0.0f), programs(0), channel(0)
 {
     programs = new MidiUnifyChannelProgram[numPrograms];
 
@@ -81,6 +96,7 @@ MidiUnifyChannel::MidiUnifyChannel(audioMasterCallback audioMaster)
                 for (int i = 0; i < kNumPrograms; i++) {
                     programs[i].fChannel = defaultBank->GetProgParm(i, 0);
                     programs[i].fPower = defaultBank->GetProgParm(i, 1);
+                    programs[i].fRouting = defaultBank->GetProgParm(i, 2);
                     strcpy(programs[i].name, defaultBank->GetProgramName(i));
                 }
             }
@@ -94,6 +110,10 @@ MidiUnifyChannel::MidiUnifyChannel(audioMasterCallback audioMaster)
                     sprintf(programs[i].name, "Output on channel 10");
                     programs[i].fChannel = CHANNEL_TO_FLOAT015(9);
                     break;
+                case 1:
+                    sprintf(programs[i].name, "Routing from map file");
+                    programs[i].fRouting = 1.0f;
+                    break;
                 default:
                     sprintf(programs[i].name, "Program %d", i + 1);
                     break;
@@ -103,6 +123,7 @@ MidiUnifyChannel::MidiUnifyChannel(audioMasterCallback audioMaster)
         setProgram(0);
     }
 
+    loadRoutes();
     init();
 }
 
@@ -121,6 +142,7 @@ void MidiUnifyChannel::setProgram(VstInt32 program)
     curProgram = program;
     setParameter(kChannel, ap->fChannel);
     setParameter(kPower, ap->fPower);
+    setParameter(kRouting, ap->fRouting);
 }
 
 //------------------------------------------------------------------------
@@ -152,9 +174,11 @@ void MidiUnifyChannel::setParameter(VstInt32 index, float value) {
     MidiUnifyChannelProgram* ap = &programs[curProgram];
 
     switch (index) {
-    case kChannel: fChannel = ap->fChannel = value; break;
+    case kChannel: fChannel = ap->fChannel = value; channel = FLOAT_TO_CHANNEL015(fChannel) & 0x0F; break;
     case kPower:    fPower  = ap->fPower  = value;  break;
+    case kRouting:  fRouting = ap->fRouting = value; break;
     }
+    // nothing to compile: unify rewrites with the batch function, map uses the table of the file
 }
 
 //-----------------------------------------------------------------------------------------
@@ -164,6 +188,7 @@ float MidiUnifyChannel::getParameter(VstInt32 index) {
     switch (index) {
     case kChannel:   v = fChannel; break;
     case kPower:     v = fPower;   break;
+    case kRouting:   v = fRouting; break;
     }
     return v;
 }
@@ -173,6 +198,7 @@ void MidiUnifyChannel::getParameterName(VstInt32 index, char *label) {
     switch (index) {
     case kChannel:  strcpy(label, "Channel Out"); break;
     case kPower:    strcpy(label, "Power");       break;
+    case kRouting:  strcpy(label, "Routing");     break;
     }
 }
 
@@ -181,28 +207,80 @@ void MidiUnifyChannel::getParameterDisplay(VstInt32 index, char *text) {
     switch (index) {
     case kChannel: sprintf(text, "%d", FLOAT_TO_CHANNEL015(fChannel) + 1); break;
     case kPower:   strcpy(text, (fPower < 0.5f) ? "off" : "on"); break;
+    case kRouting: strcpy(text, isUnify() ? "unify" : "map"); break;
     }
 }
 
-void MidiUnifyChannel::processMidiEvents(VstMidiEventVec *inputs, VstMidiEventVec *outputs, VstInt32 sampleFrames)
+//-----------------------------------------------------------------------------------------
+void MidiUnifyChannel::resume()
 {
-    // process incoming events (of first input)
-    for (unsigned int i = 0; i < inputs[0].size(); i++) 
+    loadRoutes();
+
+    // room for a full block at the largest fan-out of the routes just read, so that
+    // processMidiEvents does not allocate
+    if (_midiEventsOut)
+        _midiEventsOut[0].reserve(MAX_EVENTS_PER_TIMESLICE * router.getTable().fanOut);
+    PizMidi::resume();
+}
+
+//-----------------------------------------------------------------------------------------
+// The routes are read from midiUnifyChannel.map (next to the plug-in, or in the pizmidi
+// folder of the application data, like the default bank), see ChannelRouter.h. Without
+// a file, every channel keeps its messages. The file is read again on every resume, so
+// it can be edited while the host is running.
+
+void MidiUnifyChannel::loadRoutes()
+{
+    char path[512];
+    char name[512];
+    char adpath[512];
+    getInstancePath(path, name, false);
+    strcat(name, ".map");
+    strcat(path, name);
+    bool found = false;
+    if (getAppDataPath(adpath, "pizmidi"))
     {
-        //copying event "i" from input (with all its fields)
-        VstMidiEvent me = inputs[0][i];
+        strcat(adpath, name);
+        found = router.load(adpath);
+    }
+    if (!found && !router.load(path))
+        router.setDefault();
+    router.compile(); // published for the audio thread, see ChannelRouter.h
+    dbg("ChannelRouter: " << router.numRules() << " rules");
+}
 
-        short status = me.midiData[0] & 0xF0;   // scraping  channel
-        //short channel = me.midiData[0] & 0x0F;  // isolating channel (0-15)
-        //short data1 = me.midiData[1] & 0x7F;
-        //short data2 = me.midiData[2] & 0x7F;
+//-----------------------------------------------------------------------------------------
+// Unify: the events of the block are copied in one go and then rewritten in place.
+// Map: every event is dropped, remapped or fanned out by the action of its status byte in
+// the router's current table (taken once per block), into the room resume() reserved for
+// the largest fan-out (the output vector keeps its capacity between blocks, so this
+// allocates only for a block of more than MAX_EVENTS_PER_TIMESLICE events).
+// System messages keep their status byte either way.
+
+void MidiUnifyChannel::processMidiEvents(VstMidiEventVec *inputs, VstMidiEventVec *outputs, VstInt32 sampleFrames)
+{
+    // output enabled
+    if ((fPower < 0.5f) || inputs[0].empty())
+        return;
 
-        // modify event
-        short channel = FLOAT_TO_CHANNEL015(fChannel) & 0x0F; //outgoing midi channel
-        me.midiData[0] = status | channel;
+    // process incoming events (of first input)
+    VstMidiEventVec& out = outputs[0];
+    size_t first = out.size();
+    if (isUnify())
+    {
+        out.insert(out.end(), inputs[0].begin(), inputs[0].end());
+        setChannelBatch(&out[first], inputs[0].size(), channel);
+        return;
+    }
 
-        // output event
-        if (fPower >= 0.5f)
-                outputs[0].push_back(me);
+    const ChannelRouter::Table& table = router.getTable();
+    for (VstMidiEventVec::const_iterator it = inputs[0].begin(); it != inputs[0].end(); ++it)
+    {
+        const ChannelRouter::Action& a = table.actions[(unsigned char)it->midiData[0]];
+        for (int k = 0; k < a.count; k++)
+        {
+            out.push_back(*it);
+            out.back().midiData[0] = (char)a.status[k];
+        }
     }
 }